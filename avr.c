@@ -21,6 +21,7 @@
 
 #include "ac_cfg.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -33,10 +34,13 @@
 
 #include "tpi.h"
 
-FP_UpdateProgress update_progress;
+LIBAVRDUDE_TLS FP_UpdateProgress update_progress;
 
 #define DEBUG 0
 
+static int avr_verify_range(AVRMEM * a, AVRMEM * b, char * memtype,
+                            int from, int to);
+
 /* TPI: returns 1 if NVM controller busy, 0 if free */
 int avr_tpi_poll_nvmbsy(PROGRAMMER *pgm)
 {
@@ -365,55 +369,48 @@ int avr_read(PROGRAMMER * pgm, AVRPART * p, char * memtype,
     /*
      * the programmer supports a paged mode read
      */
-    int need_read, failure;
-    unsigned int pageaddr;
-    unsigned int npages, nread;
-
-    /* quickly scan number of pages to be written to first */
-    for (pageaddr = 0, npages = 0;
-         pageaddr < mem->size;
-         pageaddr += mem->page_size) {
-      /* check whether this page must be read */
-      for (i = pageaddr;
-           i < pageaddr + mem->page_size;
-           i++)
-        if (vmem == NULL /* no verify, read everything */ ||
-            (mem->tags[i] & TAG_ALLOCATED) != 0 /* verify, do only
-                                                    read pages that
-                                                    are needed in
-                                                    input file */) {
-          npages++;
-          break;
-        }
-    }
+    int failure, page, next;
+    unsigned int pageaddr, nbytes;
+    unsigned int npages, nread, run, maxrun;
+
+    /* quickly determine the number of pages to be read first */
+    if (vmem == NULL)
+      /* no verify, read everything */
+      npages = (mem->size + mem->page_size - 1) / mem->page_size;
+    else
+      /* verify, only read pages that are needed in input file */
+      npages = avr_mem_count_tagged_pages(vmem, vmem->size);
 
-    for (pageaddr = 0, failure = 0, nread = 0;
-         !failure && pageaddr < mem->size;
-         pageaddr += mem->page_size) {
-      /* check whether this page must be read */
-      for (i = pageaddr, need_read = 0;
-           i < pageaddr + mem->page_size;
-           i++)
-        if (vmem == NULL /* no verify, read everything */ ||
-            (vmem->tags[i] & TAG_ALLOCATED) != 0 /* verify, do only
-                                                    read pages that
-                                                    are needed in
-                                                    input file */) {
-          need_read = 1;
+    /*
+     * If the programmer can load more than a page at a time, read
+     * contiguous runs of needed pages in one call.
+     */
+    maxrun = pgm->paged_load_max > mem->page_size?
+      pgm->paged_load_max / mem->page_size: 1;
+
+    for (page = vmem == NULL? 0: avr_mem_next_tagged_page(vmem, 0),
+           failure = 0, nread = 0;
+         !failure && page >= 0 &&
+           (pageaddr = page * mem->page_size) < mem->size;
+         page = next) {
+      for (run = 1; run < maxrun; run++) {
+        if ((page + run) * mem->page_size >= mem->size)
+          break;
+        if (vmem != NULL &&
+            avr_mem_next_tagged_page(vmem, page + run) != page + run)
           break;
-        }
-      if (need_read) {
-        rc = pgm->paged_load(pgm, p, mem, mem->page_size,
-                            pageaddr, mem->page_size);
-        if (rc < 0)
-          /* paged load failed, fall back to byte-at-a-time read below */
-          failure = 1;
-      } else {
-        avrdude_message(MSG_DEBUG, "%s: avr_read(): skipping page %u: no interesting data\n",
-                        progname, pageaddr / mem->page_size);
       }
-      nread++;
+      nbytes = run * mem->page_size;
+      if (pageaddr + nbytes > mem->size)
+        nbytes = mem->size - pageaddr;
+      rc = pgm->paged_load(pgm, p, mem, mem->page_size,
+                           pageaddr, nbytes);
+      if (rc < 0)
+        /* paged load failed, fall back to byte-at-a-time read below */
+        failure = 1;
+      nread += run;
       report_progress(nread, npages, NULL);
+      next = vmem == NULL? page + run: avr_mem_next_tagged_page(vmem, page + run);
     }
     if (!failure) {
       if (strcasecmp(mem->desc, "flash") == 0 ||
@@ -434,6 +431,13 @@ int avr_read(PROGRAMMER * pgm, AVRPART * p, char * memtype,
   }
 
   for (i=0; i < mem->size; i++) {
+    if (vmem != NULL && i % avr_mem_tag_unit(vmem) == 0) {
+      /* skip over pages that are not needed in input file */
+      int page = avr_mem_next_tagged_page(vmem, i / avr_mem_tag_unit(vmem));
+      i = page < 0? mem->size: page * avr_mem_tag_unit(vmem);
+      if (i >= mem->size)
+        break;
+    }
     if (vmem == NULL ||
 	(vmem->tags[i] & TAG_ALLOCATED) != 0)
     {
@@ -827,8 +831,85 @@ int avr_write_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
  *
  * Return the number of bytes written, or -1 if an error occurs.
  */
-int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size, 
-              int auto_erase)
+/*
+ * Check whether the page starting at pageaddr already holds the
+ * intended contents on the device.  The current device contents are
+ * read into the scratch memory cm, so m->buf remains untouched.
+ * Returns 1 if the page is up to date, 0 if it differs or could not
+ * be read.
+ */
+static int avr_page_uptodate(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                             AVRMEM * cm, unsigned int pageaddr)
+{
+  unsigned int len = m->page_size;
+
+  if (pageaddr + len > m->size)
+    len = m->size - pageaddr;
+
+  if (pgm->paged_load(pgm, p, cm, m->page_size, pageaddr, m->page_size) < 0)
+    return 0;
+
+  return memcmp(m->buf + pageaddr, cm->buf + pageaddr, len) == 0;
+}
+
+/*
+ * Read back the page starting at pageaddr into the scratch memory cm
+ * right after it has been written, and compare it against the image.
+ * Returns 0 if the page verified, -1 otherwise.
+ */
+static int avr_page_verify(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                           AVRMEM * cm, unsigned int pageaddr)
+{
+  unsigned int end = pageaddr + m->page_size;
+
+  if (end > m->size)
+    end = m->size;
+
+  if (pgm->paged_load(pgm, p, cm, m->page_size, pageaddr, m->page_size) < 0) {
+    avrdude_message(MSG_INFO, "%s: avr_write(): failed to read back page at 0x%04x\n",
+                    progname, pageaddr);
+    return -1;
+  }
+
+  return avr_verify_range(cm, m, m->desc, pageaddr, end);
+}
+
+/*
+ * Verify a memory that could not be verified page by page while
+ * writing it, by reading all of it back.  The image in p is restored
+ * afterwards.
+ */
+static int avr_readback_verify(PROGRAMMER * pgm, AVRPART * p, char * memtype,
+                               int size)
+{
+  AVRPART * v;
+  AVRMEM * m, * vm;
+  int rc;
+
+  v = avr_dup_part(p);
+  rc = avr_read(pgm, p, memtype, v);
+  if (rc >= 0)
+    rc = avr_verify(p, v, memtype, size);
+
+  m = avr_locate_mem(p, memtype);
+  vm = avr_locate_mem(v, memtype);
+  memcpy(m->buf, vm->buf, m->size);
+  avr_free_part(v);
+
+  return rc < 0? -1: 0;
+}
+
+/*
+ * write the memory region of the specified type from the in-memory
+ * buffer; flags is a combination of the UF_* update flags, of which
+ * UF_AUTO_ERASE, UF_DIFF_WRITE, UF_VERIFY and UF_CHIP_ERASED are
+ * considered here
+ *
+ * With UF_VERIFY, each page is read back right after it has been
+ * written, and the write is aborted on the first mismatch.
+ */
+static int avr_write_mem(PROGRAMMER * pgm, AVRPART * p, char * memtype,
+                         int size, int flags, FILEIO_STREAM * stream)
 {
   int              rc;
   int              newpage, page_tainted, flush_page, do_write;
@@ -848,6 +929,14 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
 
   pgm->err_led(pgm, OFF);
 
+  /* after a chip erase, there is nothing for -d to compare flash against */
+  if ((flags & UF_CHIP_ERASED) &&
+      (strcasecmp(m->desc, "flash") == 0 ||
+       strcasecmp(m->desc, "application") == 0 ||
+       strcasecmp(m->desc, "apptable") == 0 ||
+       strcasecmp(m->desc, "boot") == 0))
+    flags &= ~UF_DIFF_WRITE;
+
   werror  = 0;
 
   wsize = m->size;
@@ -862,6 +951,17 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
                     progbuf, wsize);
   }
 
+  if (stream != NULL &&
+      (pgm->paged_write == NULL || m->page_size == 0 ||
+       ((p->flags & AVRPART_HAS_TPI) && pgm->cmd_tpi != NULL))) {
+    /* no paged write, read all of the input first */
+    if ((rc = fileio_stream_fill(stream, UINT_MAX)) < 0)
+      return -1;
+    if (rc < wsize)
+      wsize = rc;
+    stream = NULL;
+  }
+
 
   if ((p->flags & AVRPART_HAS_TPI) && m->page_size != 0 &&
       pgm->cmd_tpi != NULL) {
@@ -900,6 +1000,8 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
       }
       report_progress(i, wsize, NULL);
     }
+    if ((flags & UF_VERIFY) && avr_readback_verify(pgm, p, memtype, wsize) < 0)
+      return -1;
     return i;
   }
 
@@ -907,53 +1009,128 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
     /*
      * the programmer supports a paged mode write
      */
-    int need_write, failure;
-    unsigned int pageaddr;
-    unsigned int npages, nwritten;
-
-    /* quickly scan number of pages to be written to first */
-    for (pageaddr = 0, npages = 0;
-         pageaddr < wsize;
-         pageaddr += m->page_size) {
-      /* check whether this page must be written to */
-      for (i = pageaddr;
-           i < pageaddr + m->page_size;
-           i++)
-        if ((m->tags[i] & TAG_ALLOCATED) != 0) {
-          npages++;
-          break;
-        }
-    }
-
-    for (pageaddr = 0, failure = 0, nwritten = 0;
-         !failure && pageaddr < wsize;
-         pageaddr += m->page_size) {
-      /* check whether this page must be written to */
-      for (i = pageaddr, need_write = 0;
-           i < pageaddr + m->page_size;
-           i++)
-        if ((m->tags[i] & TAG_ALLOCATED) != 0) {
-          need_write = 1;
-          break;
+    int failure, page, ready, end;
+    unsigned int pageaddr, next, lo, hi;
+    unsigned int npages, nwritten, nskipped;
+    AVRMEM * cm = NULL;
+
+    if ((flags & (UF_DIFF_WRITE | UF_VERIFY)) && pgm->paged_load != NULL)
+      /* scratch memory to read the current device contents into */
+      cm = avr_dup_mem(m);
+
+    /* quickly determine the number of pages to be written to first */
+    npages = avr_mem_count_tagged_pages(m, wsize);
+    ready = end = 0;
+
+    for (page = 0, failure = 0, nwritten = 0, nskipped = 0;
+         !failure; page++) {
+      if (stream != NULL) {
+        /* parse the input until this page is complete */
+        next = (page + 1) * m->page_size;
+        if ((ready = fileio_stream_fill(stream, next)) < 0) {
+          if (cm != NULL)
+            avr_free_mem(cm);
+          return -1;
         }
-      if (need_write) {
+        if ((end = fileio_stream_eof(stream)) && ready < wsize)
+          wsize = ready;
+      }
+      page = avr_mem_next_tagged_page(m, page);
+      if (stream != NULL && !end &&
+          (page < 0 || (page + 1) * m->page_size > ready)) {
+        /*
+         * Nothing more is complete yet, go on below the latest record.
+         * The pages skipped over are never looked at again, so records
+         * for them that are still to come must be written as a redo.
+         */
+        page = (page < 0? ready / m->page_size: page) - 1;
+        fileio_stream_consumed(stream, (page + 1) * m->page_size);
+        continue;
+      }
+      if (page < 0 || (pageaddr = page * m->page_size) >= wsize)
+        break;
+
+      if (cm != NULL && (flags & UF_DIFF_WRITE) &&
+          avr_page_uptodate(pgm, p, m, cm, pageaddr)) {
+        avrdude_message(MSG_DEBUG, "%s: avr_write(): skipping page %u: already up to date\n",
+                        progname, page);
+        nskipped++;
+      } else {
         rc = 0;
-        if (auto_erase)
+        if (flags & UF_AUTO_ERASE)
           rc = pgm->page_erase(pgm, p, m, pageaddr);
         if (rc >= 0)
           rc = pgm->paged_write(pgm, p, m, m->page_size, pageaddr, m->page_size);
         if (rc < 0)
           /* paged write failed, fall back to byte-at-a-time write below */
           failure = 1;
-      } else {
-        avrdude_message(MSG_DEBUG, "%s: avr_write(): skipping page %u: no interesting data\n",
-                        progname, pageaddr / m->page_size);
+        else if (cm != NULL && (flags & UF_VERIFY) &&
+                 avr_page_verify(pgm, p, m, cm, pageaddr) < 0) {
+          avr_free_mem(cm);
+          pgm->err_led(pgm, ON);
+          return -1;
+        }
       }
       nwritten++;
-      report_progress(nwritten, npages, NULL);
+      if (stream != NULL) {
+        fileio_stream_consumed(stream, pageaddr + m->page_size);
+        /* the total is not known yet, show how far into the memory we are */
+        report_progress(pageaddr + m->page_size < wsize?
+                        pageaddr + m->page_size: wsize, wsize, NULL);
+      }
+      else
+        report_progress(nwritten, npages, NULL);
     }
-    if (!failure)
+    if (stream != NULL && !failure &&
+        fileio_stream_redo(stream, &lo, &hi)) {
+      /*
+       * Records went back into pages that had already been written.
+       * Write these pages again, now that they are complete.
+       */
+      avrdude_message(MSG_INFO, "%s: WARNING: input records out of order, "
+                      "writing %s addresses 0x%04x - 0x%04x again\n",
+                      progname, m->desc, lo, hi - 1);
+      for (page = lo / m->page_size;
+           !failure && (pageaddr = page * m->page_size) < hi; page++) {
+        if (avr_mem_next_tagged_page(m, page) != page)
+          continue;
+        rc = 0;
+        if (flags & UF_AUTO_ERASE)
+          rc = pgm->page_erase(pgm, p, m, pageaddr);
+        if (rc >= 0)
+          rc = pgm->paged_write(pgm, p, m, m->page_size, pageaddr, m->page_size);
+        if (rc < 0)
+          failure = 1;
+        else if (cm != NULL && (flags & UF_VERIFY) &&
+                 avr_page_verify(pgm, p, m, cm, pageaddr) < 0) {
+          avr_free_mem(cm);
+          pgm->err_led(pgm, ON);
+          return -1;
+        }
+      }
+    }
+    if (stream != NULL && failure) {
+      /* the byte-at-a-time write below needs all of the input */
+      if ((ready = fileio_stream_fill(stream, UINT_MAX)) < 0) {
+        if (cm != NULL)
+          avr_free_mem(cm);
+        return -1;
+      }
+      if (ready < wsize)
+        wsize = ready;
+    }
+    if (cm != NULL) {
+      avr_free_mem(cm);
+      if (!failure && (flags & UF_DIFF_WRITE) && quell_progress < 2)
+        avrdude_message(MSG_INFO, "%s: %u of %u %s pages already up to date, skipped\n",
+                        progname, nskipped, npages, m->desc);
+    }
+    if (!failure) {
+      if ((flags & UF_VERIFY) && pgm->paged_load == NULL &&
+          avr_readback_verify(pgm, p, memtype, wsize) < 0)
+        return -1;
       return wsize;
+    }
     /* else: fall back to byte-at-a-time write, for historical reasons */
   }
 
@@ -966,6 +1143,14 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
   flush_page = 0;
 
   for (i=0; i<wsize; i++) {
+    if (i % avr_mem_tag_unit(m) == 0) {
+      /* skip over pages without any allocated data */
+      int page = avr_mem_next_tagged_page(m, i / avr_mem_tag_unit(m));
+      i = page < 0? wsize: page * avr_mem_tag_unit(m);
+      if (i >= wsize)
+        break;
+    }
+
     data = m->buf[i];
     report_progress(i, wsize, NULL);
 
@@ -1039,10 +1224,41 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
     }
   }
 
+  if ((flags & UF_VERIFY) && avr_readback_verify(pgm, p, memtype, wsize) < 0)
+    return -1;
+
   return i;
 }
 
 
+int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
+              int flags)
+{
+  return avr_write_mem(pgm, p, memtype, size, flags, NULL);
+}
+
+
+/*
+ * Write memory while its input file is still being parsed, see
+ * fileio_stream_open().  Each page is written as soon as the input has
+ * moved past it, so programming overlaps with receiving the rest of
+ * the file.
+ */
+int avr_write_stream(PROGRAMMER * pgm, AVRPART * p, char * memtype,
+                     FILEIO_STREAM * stream, int flags)
+{
+  AVRMEM * m = avr_locate_mem(p, memtype);
+
+  if (m == NULL) {
+    avrdude_message(MSG_INFO, "No \"%s\" memory for part %s\n",
+            memtype, p->desc);
+    return -1;
+  }
+
+  return avr_write_mem(pgm, p, memtype, m->size, flags, stream);
+}
+
+
 
 /*
  * read the AVR device's signature bytes
@@ -1097,6 +1313,49 @@ int compare_memory_masked(AVRMEM * m, unsigned char buf1, unsigned char buf2) {
   return ((buf1 & bitmask) != (buf2 & bitmask));
 }
 
+/*
+ * Compare the bytes between from and to that are tagged in the image
+ * memory b against the device contents in a.
+ *
+ * Return 0 if they match, or -1 on the first mismatch.
+ */
+static int avr_verify_range(AVRMEM * a, AVRMEM * b, char * memtype,
+                            int from, int to)
+{
+  int i;
+  unsigned char * buf1, * buf2;
+
+  buf1  = a->buf;
+  buf2  = b->buf;
+
+  for (i=from; i<to; i++) {
+    if (i % avr_mem_tag_unit(b) == 0) {
+      /* skip over pages without any allocated data */
+      int page = avr_mem_next_tagged_page(b, i / avr_mem_tag_unit(b));
+      i = page < 0? to: page * avr_mem_tag_unit(b);
+      if (i >= to)
+        break;
+    }
+    if ((b->tags[i] & TAG_ALLOCATED) != 0 &&
+        buf1[i] != buf2[i]) {
+      if(compare_memory_masked(a , buf1[i], buf2[i])) {
+        avrdude_message(MSG_INFO, "%s: verification error, first mismatch at byte 0x%04x\n"
+                        "%s0x%02x != 0x%02x\n",
+                        progname, i,
+                        progbuf, buf1[i], buf2[i]);
+        return -1;
+      } else {
+        avrdude_message(MSG_INFO, "%s: WARNING: invalid value for unused bits in fuse \"%s\", should be set to 1 according to datasheet\n"
+                        "This behaviour is deprecated and will result in an error in future version\n"
+                        "You probably want to use 0x%02x instead of 0x%02x (double check with your datasheet first).\n",
+                        progname, memtype, buf1[i], buf2[i]);
+      }
+    }
+  }
+
+  return 0;
+}
+
 /*
  * Verify the memory buffer of p with that of v.  The byte range of v,
  * may be a subset of p.  The byte range of p should cover the whole
@@ -1106,8 +1365,6 @@ int compare_memory_masked(AVRMEM * m, unsigned char buf1, unsigned char buf2) {
  */
 int avr_verify(AVRPART * p, AVRPART * v, char * memtype, int size)
 {
-  int i;
-  unsigned char * buf1, * buf2;
   int vsize;
   AVRMEM * a, * b;
 
@@ -1125,8 +1382,6 @@ int avr_verify(AVRPART * p, AVRPART * v, char * memtype, int size)
     return -1;
   }
 
-  buf1  = a->buf;
-  buf2  = b->buf;
   vsize = a->size;
 
   if (vsize < size) {
@@ -1139,23 +1394,8 @@ int avr_verify(AVRPART * p, AVRPART * v, char * memtype, int size)
     size = vsize;
   }
 
-  for (i=0; i<size; i++) {
-    if ((b->tags[i] & TAG_ALLOCATED) != 0 &&
-        buf1[i] != buf2[i]) {
-      if(compare_memory_masked(a , buf1[i], buf2[i])) {
-        avrdude_message(MSG_INFO, "%s: verification error, first mismatch at byte 0x%04x\n"
-                        "%s0x%02x != 0x%02x\n",
-                        progname, i,
-                        progbuf, buf1[i], buf2[i]);
-        return -1;
-      } else {
-        avrdude_message(MSG_INFO, "%s: WARNING: invalid value for unused bits in fuse \"%s\", should be set to 1 according to datasheet\n"
-                        "This behaviour is deprecated and will result in an error in future version\n"
-                        "You probably want to use 0x%02x instead of 0x%02x (double check with your datasheet first).\n",
-                        progname, memtype, buf1[i], buf2[i]);
-      }
-    }
-  }
+  if (avr_verify_range(a, b, memtype, 0, size) < 0)
+    return -1;
 
   return size;
 }
@@ -1267,8 +1507,8 @@ int avr_unlock(PROGRAMMER * pgm, AVRPART * p)
  */
 void report_progress (int completed, int total, char *hdr)
 {
-  static int last = 0;
-  static double start_time;
+  static LIBAVRDUDE_TLS int last = 0;
+  static LIBAVRDUDE_TLS double start_time;
   int percent = (total > 0) ? ((completed * 100) / total) : 100;
   struct timeval tv;
   double t;
@@ -1296,3 +1536,28 @@ void report_progress (int completed, int total, char *hdr)
   if (percent == 100)
     last = 0;                   /* Get ready for next time. */
 }
+
+/*
+ * The message and progress settings are thread-local.  A thread that
+ * the library starts on behalf of a session takes them over from the
+ * thread that starts it: the latter saves them, and the new thread
+ * restores them before doing anything else.
+ */
+void avr_thread_state_save(struct avr_thread_state * s)
+{
+  s->progname = progname;
+  s->progbuf = progbuf;
+  s->verbose = verbose;
+  s->quell_progress = quell_progress;
+  s->update_progress = update_progress;
+}
+
+void avr_thread_state_restore(const struct avr_thread_state * s)
+{
+  progname = s->progname;
+  if (progbuf != s->progbuf)
+    strcpy(progbuf, s->progbuf);
+  verbose = s->verbose;
+  quell_progress = s->quell_progress;
+  update_progress = s->update_progress;
+}
@@ -21,12 +21,14 @@
 #ifndef avrdude_h
 #define avrdude_h
 
-extern char * progname;		/* name of program, for messages */
-extern char progbuf[];		/* spaces same length as progname */
+#include "libavrdude.h"		/* LIBAVRDUDE_TLS */
 
-extern int ovsigck;		/* override signature check (-F) */
-extern int verbose;		/* verbosity level (-v, -vv, ...) */
-extern int quell_progress;	/* quiteness level (-q, -qq) */
+extern LIBAVRDUDE_TLS char * progname;	/* name of program, for messages */
+extern LIBAVRDUDE_TLS char progbuf[];	/* spaces same length as progname */
+
+extern LIBAVRDUDE_TLS int ovsigck;	/* override signature check (-F) */
+extern LIBAVRDUDE_TLS int verbose;	/* verbosity level (-v, -vv, ...) */
+extern LIBAVRDUDE_TLS int quell_progress; /* quiteness level (-q, -qq) */
 
 int avrdude_message(const int msglvl, const char *format, ...);
 
@@ -77,7 +77,7 @@ static int write_flush(avrftdi_t *);
 static char*
 ftdi_pin_name(avrftdi_t* pdata, struct pindef_t pin)
 {
-	static char str[128];
+	static LIBAVRDUDE_TLS char str[128];
 
 	char interface = '@';
 
@@ -207,7 +207,8 @@ static int set_frequency(avrftdi_t* ftdi, uint32_t freq)
 		divisor = 65535;
 	}
 
-	log_info("Using frequency: %d\n", 6000000/(divisor+1));
+	ftdi->frequency = 6000000/(divisor+1);
+	log_info("Using frequency: %d\n", ftdi->frequency);
 	log_info("Clock divisor: 0x%04x\n", divisor);
 
 	buf[0] = TCK_DIVISOR;
@@ -409,6 +410,10 @@ static int avrftdi_transmit_bb(PROGRAMMER * pgm, unsigned char mode, const unsig
  * buffer 'data'.
  * Write is only performed when mode contains MPSSE_DO_WRITE.
  * Read is only performed when mode contains MPSSE_DO_WRITE and MPSSE_DO_READ.
+ *
+ * Every block goes out in a single USB write, together with its MPSSE
+ * command header; when reading, the last block is followed by
+ * SEND_IMMEDIATE, so the answer does not wait for the latency timer.
  */
 static int avrftdi_transmit_mpsse(avrftdi_t* pdata, unsigned char mode, const unsigned char *buf,
 			    unsigned char *data, int buf_size)
@@ -416,38 +421,49 @@ static int avrftdi_transmit_mpsse(avrftdi_t* pdata, unsigned char mode, const un
 	size_t blocksize;
 	size_t remaining = buf_size;
 	size_t written = 0;
-	
-	unsigned char cmd[3];
-//	unsigned char si = SEND_IMMEDIATE;
-
-	cmd[0] = mode | MPSSE_WRITE_NEG;
-	cmd[1] = ((buf_size - 1) & 0xff);
-	cmd[2] = (((buf_size - 1) >> 8) & 0xff);
+	unsigned char *cmd;
 
 	//if we are not reading back, we can just write the data out
 	if(!(mode & MPSSE_DO_READ))
-		blocksize = buf_size;
+		blocksize = 65536;
 	else
 		blocksize = pdata->rx_buffer_size;
+	if (blocksize > remaining)
+		blocksize = remaining;
 
-	E(ftdi_write_data(pdata->ftdic, cmd, sizeof(cmd)) != sizeof(cmd), pdata->ftdic);
+	cmd = malloc(blocksize + 4);
+	if (cmd == NULL) {
+		log_err("out of memory\n");
+		return -1;
+	}
 
 	while(remaining)
 	{
 		size_t transfer_size = (remaining > blocksize) ? blocksize : remaining;
-
-		E(ftdi_write_data(pdata->ftdic, (unsigned char*)&buf[written], transfer_size) != transfer_size, pdata->ftdic);
-#if 0
-		if(remaining < blocksize)
-			E(ftdi_write_data(pdata->ftdic, &si, sizeof(si)) != sizeof(si), pdata->ftdic);
-#endif
+		size_t len = 0;
+
+		cmd[len++] = mode | MPSSE_WRITE_NEG;
+		cmd[len++] = ((transfer_size - 1) & 0xff);
+		cmd[len++] = (((transfer_size - 1) >> 8) & 0xff);
+		memcpy(&cmd[len], &buf[written], transfer_size);
+		len += transfer_size;
+		if ((mode & MPSSE_DO_READ) && transfer_size == remaining)
+			cmd[len++] = SEND_IMMEDIATE;
+
+		if (ftdi_write_data(pdata->ftdic, cmd, len) != len) {
+			free(cmd);
+			E(1, pdata->ftdic);
+		}
 
 		if (mode & MPSSE_DO_READ) {
 			int n;
 			int k = 0;
 			do {
 				n = ftdi_read_data(pdata->ftdic, &data[written + k], transfer_size - k);
-				E(n < 0, pdata->ftdic);
+				if (n < 0) {
+					free(cmd);
+					E(1, pdata->ftdic);
+				}
 				k += n;
 			} while (k < transfer_size);
 
@@ -457,6 +473,7 @@ static int avrftdi_transmit_mpsse(avrftdi_t* pdata, unsigned char mode, const un
 		remaining -= transfer_size;
 	}
 	
+	free(cmd);
 	return written;
 }
 
@@ -923,64 +940,161 @@ avrftdi_lext(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m, unsigned int address)
 	return 0;
 }
 
+/*
+ * Number of 4-byte commands that keep the SPI bus busy for at least
+ * 'delay' microseconds.  This is used to let a write complete inside
+ * the command stream, rather than sleeping after a round trip.  Only
+ * the MPSSE engine clocks at a known rate; returns 0 when bitbanging.
+ */
+static unsigned int avrftdi_delay_cmds(avrftdi_t* pdata, int delay)
+{
+	double clocks;
+
+	if (pdata->use_bitbanging || pdata->frequency == 0 || delay <= 0)
+		return 0;
+
+	clocks = (double)delay * pdata->frequency / 1000000.0;
+	return (unsigned int)(clocks / 32) + 1;
+}
+
+/* largest command stream built for a write and its delays */
+#define AVRFTDI_MAX_STREAM 0x8000
+
 static int avrftdi_eeprom_write(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m,
 		unsigned int page_size, unsigned int addr, unsigned int len)
 {
+	avrftdi_t* pdata = to_pdata(pgm);
 	unsigned char cmd[] = { 0x00, 0x00, 0x00, 0x00 };
 	unsigned char *data = &m->buf[addr];
-	unsigned int add;
+	unsigned char *buf, *bufptr;
+	unsigned int add, i, ndelay;
+	size_t step;
 
-	avr_set_bits(m->op[AVR_OP_WRITE], cmd);
+	ndelay = 0;
+	if (m->op[AVR_OP_READ] != NULL)
+		ndelay = avrftdi_delay_cmds(pdata, m->max_write_delay);
+	step = 4 * (ndelay + 1);
 
+	if (ndelay == 0 || step > AVRFTDI_MAX_STREAM) {
+		avr_set_bits(m->op[AVR_OP_WRITE], cmd);
+
+		for (add = addr; add < addr + len; add++)
+		{
+			avr_set_addr(m->op[AVR_OP_WRITE], cmd, add);
+			avr_set_input(m->op[AVR_OP_WRITE], cmd, *data++);
+
+			if (0 > avrftdi_transmit(pgm, MPSSE_DO_WRITE, cmd, cmd, 4))
+			    return -1;
+			usleep((m->max_write_delay));
+
+		}
+		return len;
+	}
+
+	/* Each byte is written, and then read back for as many times as it
+	 * takes to clock away the write delay.  This costs one USB transfer
+	 * per stream, rather than a round trip and a sleep per byte.
+	 */
+	buf = malloc(AVRFTDI_MAX_STREAM);
+	if (buf == NULL) {
+		log_err("out of memory\n");
+		return -1;
+	}
+
+	bufptr = buf;
 	for (add = addr; add < addr + len; add++)
 	{
-		avr_set_addr(m->op[AVR_OP_WRITE], cmd, add);
-		avr_set_input(m->op[AVR_OP_WRITE], cmd, *data++);
-
-		if (0 > avrftdi_transmit(pgm, MPSSE_DO_WRITE, cmd, cmd, 4))
-		    return -1;
-		usleep((m->max_write_delay));
+		memset(bufptr, 0, step);
+		avr_set_bits(m->op[AVR_OP_WRITE], bufptr);
+		avr_set_addr(m->op[AVR_OP_WRITE], bufptr, add);
+		avr_set_input(m->op[AVR_OP_WRITE], bufptr, *data++);
+		bufptr += 4;
+		for (i = 0; i < ndelay; i++) {
+			avr_set_bits(m->op[AVR_OP_READ], bufptr);
+			avr_set_addr(m->op[AVR_OP_READ], bufptr, add);
+			bufptr += 4;
+		}
 
+		if (add + 1 == addr + len || bufptr - buf + step > AVRFTDI_MAX_STREAM) {
+			if (0 > avrftdi_transmit(pgm, MPSSE_DO_WRITE, buf, buf, bufptr - buf)) {
+				free(buf);
+				return -1;
+			}
+			bufptr = buf;
+		}
 	}
+
+	free(buf);
 	return len;
 }
 
+/*
+ * Reading eeprom: the read commands for all bytes go out in one stream.
+ */
 static int avrftdi_eeprom_read(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m,
 		unsigned int page_size, unsigned int addr, unsigned int len)
 {
-	unsigned char cmd[4];
-	unsigned char buffer[len], *bufptr = buffer;
-	unsigned int add;
+	unsigned char o_buf[4*len+4];
+	unsigned char i_buf[4*len+4];
+	unsigned int add, index;
 
-	memset(buffer, 0, sizeof(buffer));
-	for (add = addr; add < addr + len; add++)
+	if (m->op[AVR_OP_READ] == NULL) {
+		log_err("AVR_OP_READ command not defined for %s\n", p->desc);
+		return -1;
+	}
+
+	memset(o_buf, 0, sizeof(o_buf));
+	memset(i_buf, 0, sizeof(i_buf));
+	for (add = addr, index = 0; add < addr + len; add++, index++)
 	{
-		memset(cmd, 0, sizeof(cmd));
-		avr_set_bits(m->op[AVR_OP_READ], cmd);
-		avr_set_addr(m->op[AVR_OP_READ], cmd, add);
+		avr_set_bits(m->op[AVR_OP_READ], &o_buf[index*4]);
+		avr_set_addr(m->op[AVR_OP_READ], &o_buf[index*4], add);
+	}
 
-		if (0 > avrftdi_transmit(pgm, MPSSE_DO_READ | MPSSE_DO_WRITE, cmd, cmd, 4))
-			return -1;
+	if (0 > avrftdi_transmit(pgm, MPSSE_DO_READ | MPSSE_DO_WRITE, o_buf, i_buf, len * 4))
+		return -1;
 
-		avr_get_output(m->op[AVR_OP_READ], cmd, bufptr++);
-	}
+	for (index = 0; index < len; index++)
+		avr_get_output(m->op[AVR_OP_READ], &i_buf[index*4], &m->buf[addr+index]);
 
-	memcpy(m->buf + addr, buffer, len);
 	return len;
 }
 
 static int avrftdi_flash_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
 		unsigned int page_size, unsigned int addr, unsigned int len)
 {
+	avrftdi_t* pdata = to_pdata(pgm);
 	int use_lext_address = m->op[AVR_OP_LOAD_EXT_ADDR] != NULL;
 	
 	unsigned int word;
 	unsigned int poll_index;
 	unsigned int buf_size;
+	unsigned int ndelay, i;
+	int can_poll;
 
 	unsigned char poll_byte;
 	unsigned char *buffer = &m->buf[addr];
-	unsigned char buf[4*len+4], *bufptr = buf;
+	OPCODE *pollop;
+
+	/* find a poll byte. we cannot poll a value of 0xff, so look
+	 * for a value != 0xff
+	 */
+	for(poll_index = addr+len-1; poll_index > addr-1; poll_index--)
+		if(m->buf[poll_index] != 0xff)
+			break;
+	can_poll = (poll_index < addr + len) && m->buf[poll_index] != 0xff;
+	pollop = m->op[(poll_index & 1)? AVR_OP_READ_HI: AVR_OP_READ_LO];
+
+	/* clock the write delay away in the same stream, reading back the
+	 * poll byte while doing so */
+	ndelay = 0;
+	if (pollop != NULL)
+		ndelay = avrftdi_delay_cmds(pdata, m->max_write_delay);
+	if (4 * (len + ndelay + 1) > AVRFTDI_MAX_STREAM)
+		ndelay = 0;
+
+	unsigned char buf[4*len+4+4*ndelay], *bufptr = buf;
+	unsigned char i_buf[ndelay? sizeof(buf): 1];
 
 	memset(buf, 0, sizeof(buf));
 
@@ -1045,24 +1159,33 @@ static int avrftdi_flash_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
 		bufptr += 4;
 	}
 
+	for (i = 0; i < ndelay; i++) {
+		avr_set_bits(pollop, bufptr);
+		avr_set_addr(pollop, bufptr, poll_index/2);
+		bufptr += 4;
+	}
+
 	buf_size = bufptr - buf;
 
 	if(verbose > TRACE)
 		buf_dump(buf, buf_size, "command buffer", 0, 16*2);
 
 	log_info("Transmitting buffer of size: %d\n", buf_size);
-	if (0 > avrftdi_transmit(pgm, MPSSE_DO_WRITE, buf, buf, buf_size))
-		return -1;
+	if (ndelay) {
+		if (0 > avrftdi_transmit(pgm, MPSSE_DO_READ | MPSSE_DO_WRITE, buf, i_buf, buf_size))
+			return -1;
 
-	bufptr = buf;
-	/* find a poll byte. we cannot poll a value of 0xff, so look
-	 * for a value != 0xff
-	 */
-	for(poll_index = addr+len-1; poll_index > addr-1; poll_index--)
-		if(m->buf[poll_index] != 0xff)
-			break;
+		/* the write delay has passed; done, unless the last read shows
+		 * the poll byte still differing */
+		if (!can_poll)
+			return len;
+		avr_get_output(pollop, &i_buf[buf_size-4], &poll_byte);
+		if (poll_byte == m->buf[poll_index])
+			return len;
+	} else if (0 > avrftdi_transmit(pgm, MPSSE_DO_WRITE, buf, buf, buf_size))
+		return -1;
 
-	if((poll_index < addr + len) && m->buf[poll_index] != 0xff)
+	if(can_poll)
 	{
 		log_info("Using m->buf[%d] = 0x%02x as polling value ", poll_index,
 		         m->buf[poll_index]);
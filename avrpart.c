@@ -20,6 +20,7 @@
 
 /* $Id$ */
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -71,26 +72,109 @@ void avr_free_opcode(OPCODE * op)
 }
 
 /*
- * avr_set_bits()
+ * Compile one bit type of an opcode: collect the command bits of that
+ * type, and find out whether they map to the source (address or data)
+ * bits by a constant shift, which is the case for nearly all parts.
+ */
+static void avr_compile_field(OPCODE * op, int type, OPCODE_FIELD * f)
+{
+  int i, shift = 0, first = 1;
+
+  f->mask = 0;
+  f->linear = 1;
+  for (i=0; i<32; i++) {
+    if (op->bit[i].type != type)
+      continue;
+    f->mask |= 1UL << i;
+    if (first) {
+      shift = op->bit[i].bitno - i;
+      first = 0;
+    } else if (op->bit[i].bitno - i != shift) {
+      f->linear = 0;
+    }
+  }
+  if (shift <= -32 || shift >= 32)
+    f->linear = 0;
+  f->shift = shift;
+}
+
+/*
+ * avr_compile_opcode()
  *
- * Set instruction bits in the specified command based on the opcode.
+ * Translate the bit specifications of the opcode into the masks and
+ * shifts used by avr_set_bits() and friends.  This is done once for
+ * each opcode read from the configuration file; the functions below
+ * compile an opcode on first use if that has not happened.
  */
-int avr_set_bits(OPCODE * op, unsigned char * cmd)
+void avr_compile_opcode(OPCODE * op)
 {
-  int i, j, bit;
-  unsigned char mask;
+  int i;
 
+  op->value_mask = op->value_bits = 0;
   for (i=0; i<32; i++) {
     if (op->bit[i].type == AVR_CMDBIT_VALUE) {
-      j = 3 - i / 8;
-      bit = i % 8;
-      mask = 1 << bit;
+      op->value_mask |= 1UL << i;
       if (op->bit[i].value)
-        cmd[j] = cmd[j] | mask;
-      else
-        cmd[j] = cmd[j] & ~mask;
+        op->value_bits |= 1UL << i;
     }
   }
+  avr_compile_field(op, AVR_CMDBIT_ADDRESS, &op->addr);
+  avr_compile_field(op, AVR_CMDBIT_INPUT, &op->input);
+  avr_compile_field(op, AVR_CMDBIT_OUTPUT, &op->output);
+  op->compiled = 1;
+}
+
+static unsigned long avr_cmd_word(const unsigned char * cmd)
+{
+  return ((unsigned long)cmd[0] << 24) | ((unsigned long)cmd[1] << 16) |
+    ((unsigned long)cmd[2] << 8) | cmd[3];
+}
+
+/*
+ * Replace the command bits in "mask" by those of "bits".
+ */
+static void avr_cmd_merge(unsigned char * cmd, unsigned long mask,
+                          unsigned long bits)
+{
+  unsigned long w = (avr_cmd_word(cmd) & ~mask) | (bits & mask);
+
+  cmd[0] = w >> 24;
+  cmd[1] = w >> 16;
+  cmd[2] = w >> 8;
+  cmd[3] = w;
+}
+
+/*
+ * Scatter the bits of "src" into the command bits of field "f".
+ */
+static unsigned long avr_field_scatter(OPCODE * op, OPCODE_FIELD * f,
+                                       unsigned long src)
+{
+  unsigned long bits = 0;
+  int i;
+
+  if (f->linear)
+    return f->shift >= 0? src >> f->shift: src << -f->shift;
+
+  for (i=0; i<32; i++)
+    if ((f->mask & (1UL << i)) && (src >> op->bit[i].bitno & 0x01))
+      bits |= 1UL << i;
+
+  return bits;
+}
+
+
+/*
+ * avr_set_bits()
+ *
+ * Set instruction bits in the specified command based on the opcode.
+ */
+int avr_set_bits(OPCODE * op, unsigned char * cmd)
+{
+  if (!op->compiled)
+    avr_compile_opcode(op);
+
+  avr_cmd_merge(cmd, op->value_mask, op->value_bits);
 
   return 0;
 }
@@ -104,22 +188,10 @@ int avr_set_bits(OPCODE * op, unsigned char * cmd)
  */
 int avr_set_addr(OPCODE * op, unsigned char * cmd, unsigned long addr)
 {
-  int i, j, bit;
-  unsigned long value;
-  unsigned char mask;
+  if (!op->compiled)
+    avr_compile_opcode(op);
 
-  for (i=0; i<32; i++) {
-    if (op->bit[i].type == AVR_CMDBIT_ADDRESS) {
-      j = 3 - i / 8;
-      bit = i % 8;
-      mask = 1 << bit;
-      value = addr >> op->bit[i].bitno & 0x01;
-      if (value)
-        cmd[j] = cmd[j] | mask;
-      else
-        cmd[j] = cmd[j] & ~mask;
-    }
-  }
+  avr_cmd_merge(cmd, op->addr.mask, avr_field_scatter(op, &op->addr, addr));
 
   return 0;
 }
@@ -133,22 +205,10 @@ int avr_set_addr(OPCODE * op, unsigned char * cmd, unsigned long addr)
  */
 int avr_set_input(OPCODE * op, unsigned char * cmd, unsigned char data)
 {
-  int i, j, bit;
-  unsigned char value;
-  unsigned char mask;
+  if (!op->compiled)
+    avr_compile_opcode(op);
 
-  for (i=0; i<32; i++) {
-    if (op->bit[i].type == AVR_CMDBIT_INPUT) {
-      j = 3 - i / 8;
-      bit = i % 8;
-      mask = 1 << bit;
-      value = data >> op->bit[i].bitno & 0x01;
-      if (value)
-        cmd[j] = cmd[j] | mask;
-      else
-        cmd[j] = cmd[j] & ~mask;
-    }
-  }
+  avr_cmd_merge(cmd, op->input.mask, avr_field_scatter(op, &op->input, data));
 
   return 0;
 }
@@ -162,22 +222,20 @@ int avr_set_input(OPCODE * op, unsigned char * cmd, unsigned char data)
  */
 int avr_get_output(OPCODE * op, unsigned char * res, unsigned char * data)
 {
-  int i, j, bit;
-  unsigned char value;
-  unsigned char mask;
+  unsigned long w;
+  int i;
 
-  for (i=0; i<32; i++) {
-    if (op->bit[i].type == AVR_CMDBIT_OUTPUT) {
-      j = 3 - i / 8;
-      bit = i % 8;
-      mask = 1 << bit;
-      value = ((res[j] & mask) >> bit) & 0x01;
-      value = value << op->bit[i].bitno;
-      if (value)
-        *data = *data | value;
-      else
-        *data = *data & ~value;
-    }
+  if (!op->compiled)
+    avr_compile_opcode(op);
+
+  w = avr_cmd_word(res) & op->output.mask;
+
+  if (op->output.linear) {
+    *data |= op->output.shift >= 0? w << op->output.shift: w >> -op->output.shift;
+  } else {
+    for (i=0; i<32; i++)
+      if (w & (1UL << i))
+        *data |= 1 << op->bit[i].bitno;
   }
 
   return 0;
@@ -259,6 +317,18 @@ AVRMEM * avr_new_memtype(void)
 }
 
 
+/*
+ * The page map carries one bit per page (or per byte for memories
+ * without a page size) that has at least one byte tagged
+ * TAG_ALLOCATED, so the read/write/verify loops can skip unused
+ * regions a word at a time rather than scanning every tag byte.
+ */
+#define PAGEMAP_BITS (sizeof(unsigned int) * 8)
+#define PAGEMAP_NPAGES(m) \
+  ((m)->size / avr_mem_tag_unit(m) + ((m)->size % avr_mem_tag_unit(m) != 0))
+#define PAGEMAP_WORDS(m) \
+  ((PAGEMAP_NPAGES(m) + PAGEMAP_BITS - 1) / PAGEMAP_BITS)
+
 /*
  * Allocate and initialize memory buffers for each of the device's
  * defined memory regions.
@@ -282,6 +352,12 @@ int avr_initmem(AVRPART * p)
               progname, m->desc, m->size);
       return -1;
     }
+    m->pagemap = (unsigned int *) calloc(PAGEMAP_WORDS(m), sizeof(unsigned int));
+    if (m->pagemap == NULL) {
+      avrdude_message(MSG_INFO, "%s: can't alloc page map for %s\n",
+              progname, m->desc);
+      return -1;
+    }
   }
 
   return 0;
@@ -317,6 +393,16 @@ AVRMEM * avr_dup_mem(AVRMEM * m)
     memcpy(n->tags, m->tags, n->size);
   }
 
+  if (m->pagemap != NULL) {
+    n->pagemap = (unsigned int *)malloc(PAGEMAP_WORDS(n) * sizeof(unsigned int));
+    if (n->pagemap == NULL) {
+      avrdude_message(MSG_INFO, "avr_dup_mem(): out of memory (memsize=%d)\n",
+                      n->size);
+      exit(1);
+    }
+    memcpy(n->pagemap, m->pagemap, PAGEMAP_WORDS(n) * sizeof(unsigned int));
+  }
+
   for (i = 0; i < AVR_OP_MAX; i++) {
     n->op[i] = avr_dup_opcode(n->op[i]);
   }
@@ -335,6 +421,10 @@ void avr_free_mem(AVRMEM * m)
       free(m->tags);
       m->tags = NULL;
     }
+    if (m->pagemap != NULL) {
+      free(m->pagemap);
+      m->pagemap = NULL;
+    }
     for(i=0;i<sizeof(m->op)/sizeof(m->op[0]);i++)
     {
       if (m->op[i] != NULL)
@@ -371,6 +461,128 @@ AVRMEM * avr_locate_mem(AVRPART * p, char * desc)
 }
 
 
+/*
+ * Return the granularity of the page map, i.e. the number of bytes
+ * covered by one bit.
+ */
+int avr_mem_tag_unit(AVRMEM * m)
+{
+  return m->page_size > 0? m->page_size: 1;
+}
+
+
+/*
+ * Clear all allocation tags of the memory.
+ */
+void avr_mem_clear_tags(AVRMEM * m)
+{
+  memset(m->tags, 0, m->size);
+  if (m->pagemap != NULL)
+    memset(m->pagemap, 0, PAGEMAP_WORDS(m) * sizeof(unsigned int));
+}
+
+
+/*
+ * Copy the contents of src, an image of the same memory loaded into
+ * another part, into dst: data, allocation tags and page map.
+ */
+int avr_mem_copy_image(AVRMEM * dst, AVRMEM * src)
+{
+  if (dst->size != src->size || dst->page_size != src->page_size ||
+      src->buf == NULL || src->tags == NULL ||
+      (dst->pagemap != NULL && src->pagemap == NULL))
+    return -1;
+
+  memcpy(dst->buf, src->buf, dst->size);
+  memcpy(dst->tags, src->tags, dst->size);
+  if (dst->pagemap != NULL)
+    memcpy(dst->pagemap, src->pagemap, PAGEMAP_WORDS(dst) * sizeof(unsigned int));
+
+  return 0;
+}
+
+
+/*
+ * Tag len bytes starting at addr as TAG_ALLOCATED, and record the
+ * affected pages in the page map.
+ */
+void avr_mem_tag_range(AVRMEM * m, int addr, int len)
+{
+  int unit, page, last;
+
+  if (len <= 0)
+    return;
+
+  memset(m->tags + addr, TAG_ALLOCATED, len);
+
+  if (m->pagemap == NULL)
+    return;
+
+  unit = avr_mem_tag_unit(m);
+  last = (addr + len - 1) / unit;
+  for (page = addr / unit; page <= last; page++)
+    m->pagemap[page / PAGEMAP_BITS] |= 1U << (page % PAGEMAP_BITS);
+}
+
+
+/*
+ * Return the number of the first page at or above page that holds
+ * allocated data, or -1 if there is none.
+ */
+int avr_mem_next_tagged_page(AVRMEM * m, int page)
+{
+  int npages, unit, i, w;
+  unsigned int bits;
+
+  npages = PAGEMAP_NPAGES(m);
+  if (page < 0)
+    page = 0;
+
+  if (m->pagemap == NULL) {
+    /* no page map, fall back to scanning the tags */
+    unit = avr_mem_tag_unit(m);
+    for (i = page * unit; i < m->size; i++)
+      if ((m->tags[i] & TAG_ALLOCATED) != 0)
+        return i / unit;
+    return -1;
+  }
+
+  w = page / PAGEMAP_BITS;
+  if (w >= PAGEMAP_WORDS(m))
+    return -1;
+  bits = m->pagemap[w] & (~0U << (page % PAGEMAP_BITS));
+
+  /* skip empty regions a word at a time */
+  while (bits == 0) {
+    if (++w >= PAGEMAP_WORDS(m))
+      return -1;
+    bits = m->pagemap[w];
+  }
+
+  for (page = w * PAGEMAP_BITS; (bits & 1) == 0; bits >>= 1)
+    page++;
+
+  return page < npages? page: -1;
+}
+
+
+/*
+ * Count the pages holding allocated data within the first size bytes.
+ */
+int avr_mem_count_tagged_pages(AVRMEM * m, int size)
+{
+  int unit, page, n;
+
+  unit = avr_mem_tag_unit(m);
+  for (n = 0, page = avr_mem_next_tagged_page(m, 0);
+       page >= 0 && page * unit < size;
+       page = avr_mem_next_tagged_page(m, page + 1))
+    n++;
+
+  return n;
+}
+
+
 void avr_mem_display(const char * prefix, FILE * f, AVRMEM * m, int type,
                      int verbose)
 {
@@ -505,12 +717,156 @@ int i;
 	free(d);
 }
 
+/*
+ * Lookup index over a list of parts, see index_avrparts().  All three
+ * tables are open-addressed hash tables of the same (power of two)
+ * size, an entry with p == NULL marks an empty slot.  Entries are
+ * inserted in list order, and a key already present is never inserted
+ * again, so a lookup yields the same part a linear search of the list
+ * would have found.
+ */
+struct partidx_ent {
+  union {
+    const char * name;  /* part id or description */
+    unsigned int num;   /* signature or AVR910 device code */
+  } key;
+  AVRPART * p;
+};
+
+static struct {
+  LISTID list;                  /* list the index is valid for */
+  int nparts;                   /* lsize(list) at the time of indexing */
+  unsigned int mask;            /* table size - 1 */
+  struct partidx_ent * byname;  /* id and desc, case-insensitive */
+  struct partidx_ent * bysig;   /* 24 bit signature */
+  struct partidx_ent * bycode;  /* AVR910 device code */
+} partidx;
+
+static unsigned int partidx_strhash(const char * s)
+{
+  unsigned int h = 2166136261U;
+
+  while (*s)
+    h = (h ^ (unsigned char)tolower((unsigned char)*s++)) * 16777619U;
+
+  return h;
+}
+
+static unsigned int partidx_numhash(unsigned int n)
+{
+  return (n * 2654435761U) ^ (n >> 16);
+}
+
+static struct partidx_ent * partidx_name_slot(const char * name)
+{
+  unsigned int i;
+
+  for (i = partidx_strhash(name) & partidx.mask;
+       partidx.byname[i].p != NULL && strcasecmp(partidx.byname[i].key.name, name) != 0;
+       i = (i + 1) & partidx.mask)
+    ;
+
+  return &partidx.byname[i];
+}
+
+static struct partidx_ent * partidx_num_slot(struct partidx_ent * tbl,
+                                             unsigned int num)
+{
+  unsigned int i;
+
+  for (i = partidx_numhash(num) & partidx.mask;
+       tbl[i].p != NULL && tbl[i].key.num != num;
+       i = (i + 1) & partidx.mask)
+    ;
+
+  return &tbl[i];
+}
+
+/*
+ * Return the index if it is usable for looking up in "parts".
+ */
+static int partidx_valid(LISTID parts)
+{
+  return partidx.list != NULL && partidx.list == parts &&
+    partidx.nparts == lsize(parts);
+}
+
+/*
+ * Build the lookup index used by locate_part(),
+ * locate_part_by_signature() and locate_part_by_avr910_devcode() for
+ * the list of parts given as "avrparts", replacing any previous index.
+ * Passing NULL just discards the index.  The index must be rebuilt or
+ * discarded whenever the list is modified; as a safety net, lookups
+ * fall back to searching the list if the number of parts changed.
+ */
+void index_avrparts(LISTID avrparts)
+{
+  LNODEID ln1;
+  AVRPART * p;
+  struct partidx_ent * e;
+  unsigned int size, sig;
+  int n;
+
+  free(partidx.byname);
+  free(partidx.bysig);
+  free(partidx.bycode);
+  memset(&partidx, 0, sizeof(partidx));
+
+  if (avrparts == NULL)
+    return;
+
+  /* at most two names per part, keep the load factor below 1/2 */
+  n = lsize(avrparts);
+  for (size = 16; size < 4U * n; size <<= 1)
+    ;
+
+  partidx.byname = calloc(size, sizeof(struct partidx_ent));
+  partidx.bysig = calloc(size, sizeof(struct partidx_ent));
+  partidx.bycode = calloc(size, sizeof(struct partidx_ent));
+  if (partidx.byname == NULL || partidx.bysig == NULL ||
+      partidx.bycode == NULL) {
+    avrdude_message(MSG_INFO, "%s: index_avrparts(): out of memory\n",
+                    progname);
+    index_avrparts(NULL);
+    return;
+  }
+  partidx.mask = size - 1;
+
+  for (ln1=lfirst(avrparts); ln1; ln1=lnext(ln1)) {
+    p = ldata(ln1);
+    if ((e = partidx_name_slot(p->id))->p == NULL) {
+      e->key.name = p->id;
+      e->p = p;
+    }
+    if ((e = partidx_name_slot(p->desc))->p == NULL) {
+      e->key.name = p->desc;
+      e->p = p;
+    }
+    sig = (p->signature[0] << 16) | (p->signature[1] << 8) | p->signature[2];
+    if ((e = partidx_num_slot(partidx.bysig, sig))->p == NULL) {
+      e->key.num = sig;
+      e->p = p;
+    }
+    if ((e = partidx_num_slot(partidx.bycode,
+                              (unsigned int)p->avr910_devcode))->p == NULL) {
+      e->key.num = (unsigned int)p->avr910_devcode;
+      e->p = p;
+    }
+  }
+
+  partidx.list = avrparts;
+  partidx.nparts = n;
+}
+
 AVRPART * locate_part(LISTID parts, char * partdesc)
 {
   LNODEID ln1;
   AVRPART * p = NULL;
   int found;
 
+  if (partidx_valid(parts))
+    return partidx_name_slot(partdesc)->p;
+
   found = 0;
 
   for (ln1=lfirst(parts); ln1 && !found; ln1=lnext(ln1)) {
@@ -531,6 +887,9 @@ AVRPART * locate_part_by_avr910_devcode(LISTID parts, int devcode)
   LNODEID ln1;
   AVRPART * p = NULL;
 
+  if (partidx_valid(parts))
+    return partidx_num_slot(partidx.bycode, (unsigned int)devcode)->p;
+
   for (ln1=lfirst(parts); ln1; ln1=lnext(ln1)) {
     p = ldata(ln1);
     if (p->avr910_devcode == devcode)
@@ -548,6 +907,10 @@ AVRPART * locate_part_by_signature(LISTID parts, unsigned char * sig,
   int i;
 
   if (sigsize == 3) {
+    if (partidx_valid(parts))
+      return partidx_num_slot(partidx.bysig, (sig[0] << 16) |
+                              (sig[1] << 8) | sig[2])->p;
+
     for (ln1=lfirst(parts); ln1; ln1=lnext(ln1)) {
       p = ldata(ln1);
       for (i=0; i<3; i++)
@@ -599,6 +962,10 @@ static int sort_avrparts_compare(AVRPART * p1,AVRPART * p2)
 void sort_avrparts(LISTID avrparts)
 {
   lsort(avrparts,(int (*)(void*, void*)) sort_avrparts_compare);
+
+  /* the order decides between duplicate names, so rebuild the index */
+  if (partidx.list == avrparts)
+    index_avrparts(avrparts);
 }
 
 
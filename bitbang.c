@@ -29,6 +29,8 @@
 #include <errno.h>
 
 #if !defined(WIN32NATIVE)
+#  include <ctype.h>
+#  include <limits.h>
 #  include <signal.h>
 #  include <sys/time.h>
 #endif
@@ -40,9 +42,12 @@
 #include "serbb.h"
 #include "tpi.h"
 #include "bitbang.h"
+#include "config.h"
 
 static int delay_decrement;
 
+LIBAVRDUDE_TLS int bitbang_recalibrate; /* ignore the cached calibration */
+
 #if defined(WIN32NATIVE)
 static int has_perfcount;
 static LARGE_INTEGER freq;
@@ -57,6 +62,150 @@ static void alarmhandler(int signo)
   done = 1;
   signal(SIGALRM, saved_alarmhandler);
 }
+
+/*
+ * The result of the delay loop calibration is kept in a small cache
+ * file, one line "<key> <cycles per us>" per host configuration.  The
+ * key is made up of the CPU model and the cpufreq governor, as these
+ * determine the speed of the loop.  A cached value is only used after
+ * a short check that it still yields the intended delay.
+ */
+#define BB_CAL_FILE     "bitbang-delay"
+#define BB_CAL_CHECK_US 2000    /* length of the check delay */
+#define BB_CAL_DRIFT    25      /* accepted deviation of the check, in % */
+
+static void bitbang_cal_read(const char * path, const char * tag,
+                             char * buf, size_t buflen)
+{
+  char line[256], * cp;
+  size_t n;
+  FILE * f;
+
+  if ((f = fopen(path, "r")) == NULL)
+    return;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (tag != NULL) {
+      if (strncmp(line, tag, strlen(tag)) != 0 ||
+          (cp = strchr(line, ':')) == NULL)
+        continue;
+      cp++;
+    } else {
+      cp = line;
+    }
+    while (isspace((unsigned char)*cp))
+      cp++;
+    for (n = 0; n < buflen - 1 && cp[n] != 0; n++)
+      buf[n] = cp[n];
+    buf[n] = 0;
+    break;
+  }
+  fclose(f);
+
+  /* the key must be a single word */
+  for (cp = buf + strlen(buf); cp > buf && isspace((unsigned char)cp[-1]); )
+    *--cp = 0;
+  for (cp = buf; *cp; cp++)
+    if (isspace((unsigned char)*cp))
+      *cp = '_';
+}
+
+static void bitbang_cal_key(char * key, size_t keylen)
+{
+  char model[128] = "unknown", gov[64] = "none";
+
+  bitbang_cal_read("/proc/cpuinfo", "model name", model, sizeof(model));
+  bitbang_cal_read("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor",
+                   NULL, gov, sizeof(gov));
+  snprintf(key, keylen, "%s/%s", model, gov);
+}
+
+static int bitbang_cal_name(char * buf, size_t buflen, int create)
+{
+  char dir[PATH_MAX];
+
+  if (avrdude_cache_dir(dir, sizeof(dir), create) < 0)
+    return -1;
+  if ((size_t)snprintf(buf, buflen, "%s/%s", dir, BB_CAL_FILE) >= buflen)
+    return -1;
+
+  return 0;
+}
+
+static int bitbang_cal_load(const char * key)
+{
+  char path[PATH_MAX], line[512], k[256];
+  FILE * f;
+  int val, rv = -1;
+
+  if (bitbang_cal_name(path, sizeof(path), 0) < 0 ||
+      (f = fopen(path, "r")) == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "%255s %d", k, &val) == 2 && strcmp(k, key) == 0 &&
+        val > 0) {
+      rv = val;
+      break;
+    }
+  }
+  fclose(f);
+
+  return rv;
+}
+
+static void bitbang_cal_save(const char * key, int val)
+{
+  char path[PATH_MAX], tmp[PATH_MAX + 4], line[512], k[256];
+  FILE * f, * nf;
+
+  if (bitbang_cal_name(path, sizeof(path), 1) < 0)
+    return;
+  snprintf(tmp, sizeof(tmp), "%s.new", path);
+  if ((nf = fopen(tmp, "w")) == NULL)
+    return;
+
+  /* keep the entries for other host configurations */
+  if ((f = fopen(path, "r")) != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if (sscanf(line, "%255s", k) == 1 && strcmp(k, key) != 0)
+        fputs(line, nf);
+    }
+    fclose(f);
+  }
+  fprintf(nf, "%s %d\n", key, val);
+
+  if (fclose(nf) != 0 || rename(tmp, path) != 0)
+    unlink(tmp);
+}
+
+/*
+ * Check that the current delay_decrement still yields the intended
+ * delay.  The shortest of a few runs is taken, as being preempted can
+ * only make a run longer.
+ */
+static int bitbang_cal_check(void)
+{
+  struct timeval tv0, tv1;
+  long us, best = LONG_MAX;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    gettimeofday(&tv0, NULL);
+    bitbang_delay(BB_CAL_CHECK_US);
+    gettimeofday(&tv1, NULL);
+    us = (tv1.tv_sec - tv0.tv_sec) * 1000000L + (tv1.tv_usec - tv0.tv_usec);
+    if (us < best)
+      best = us;
+  }
+
+  avrdude_message(MSG_DEBUG, "%s: %d us delay took %ld us\n",
+                  progname, BB_CAL_CHECK_US, best);
+
+  if (best * 100 < (long)BB_CAL_CHECK_US * (100 - BB_CAL_DRIFT) ||
+      best * 100 > (long)BB_CAL_CHECK_US * (100 + BB_CAL_DRIFT))
+    return -1;
+
+  return 0;
+}
 #endif /* WIN32NATIVE */
 
 /*
@@ -94,6 +243,20 @@ static void bitbang_calibrate_delay(void)
 #else  /* !WIN32NATIVE */
   struct itimerval itv;
   volatile int i;
+  char key[256];
+  int cached;
+
+  bitbang_cal_key(key, sizeof(key));
+  if (!bitbang_recalibrate && (cached = bitbang_cal_load(key)) > 0) {
+    delay_decrement = cached;
+    if (bitbang_cal_check() == 0) {
+      avrdude_message(MSG_NOTICE2, "%s: Using cached delay loop calibration, "
+                      "%d cycles per us\n", progname, delay_decrement);
+      return;
+    }
+    avrdude_message(MSG_NOTICE2, "%s: Cached delay loop calibration is off\n",
+                    progname);
+  }
 
   avrdude_message(MSG_NOTICE2, "%s: Calibrating delay loop...",
                   progname);
@@ -124,6 +287,9 @@ static void bitbang_calibrate_delay(void)
   delay_decrement = -i / 100000;
   avrdude_message(MSG_NOTICE2, " calibrated to %d cycles per us\n",
                   delay_decrement);
+
+  if (delay_decrement > 0)
+    bitbang_cal_save(key, delay_decrement);
 #endif /* WIN32NATIVE */
 }
 
@@ -182,12 +348,21 @@ static unsigned char bitbang_txrx(PROGRAMMER * pgm, unsigned char byte)
      * Due to the delay introduced by "IN" and "OUT"-commands,
      * T is greater than 1us (more like 2us) on x86-architectures.
      * So programming works safely down to 1MHz target clock.
+     *
+     * If the programmer can change several pins at once (setpins()),
+     * the falling SCK edge of one bit is combined with setting MOSI
+     * for the next one; the AVR samples MOSI on the rising edge, so
+     * this only saves one pin access per bit.
     */
 
     b = (byte >> i) & 0x01;
 
     /* set the data input line as desired */
-    pgm->setpin(pgm, PIN_AVR_MOSI, b);
+    if (pgm->setpins != NULL && i < 7)
+      pgm->setpins(pgm, (1 << PIN_AVR_SCK) | (1 << PIN_AVR_MOSI),
+                   b << PIN_AVR_MOSI);
+    else
+      pgm->setpin(pgm, PIN_AVR_MOSI, b);
 
     pgm->setpin(pgm, PIN_AVR_SCK, 1);
 
@@ -197,7 +372,8 @@ static unsigned char bitbang_txrx(PROGRAMMER * pgm, unsigned char byte)
      */
     r = pgm->getpin(pgm, PIN_AVR_MISO);
 
-    pgm->setpin(pgm, PIN_AVR_SCK, 0);
+    if (pgm->setpins == NULL || i == 0)
+      pgm->setpin(pgm, PIN_AVR_SCK, 0);
 
     rbyte |= r << i;
   }
@@ -205,6 +381,63 @@ static unsigned char bitbang_txrx(PROGRAMMER * pgm, unsigned char byte)
   return rbyte;
 }
 
+/*
+ * Waveform support
+ *
+ * Programmers that can apply a whole sequence of pin states in one
+ * transfer provide pgm->waveform().  It sets the pins in "mask" (a
+ * bit mask of PIN_* functions) to states[0] ... states[n-1] in turn,
+ * leaving all other pins alone, and returns in miso[i] the level of
+ * MISO sampled after states[i] has been applied.  The SPI and TPI bit
+ * streams are then built as such sequences of SCK/MOSI states rather
+ * than being driven one pin change at a time.
+ */
+#define BB_SCK   (1U << PIN_AVR_SCK)
+#define BB_MOSI  (1U << PIN_AVR_MOSI)
+
+#define BB_WAVE_BYTES 64                        /* SPI bytes per waveform */
+#define BB_WAVE_MAX   (BB_WAVE_BYTES * 8 * 2 + 1)
+
+static int bitbang_wave_spi(PROGRAMMER * pgm, const unsigned char *cmd,
+                            unsigned char *res, int count)
+{
+  unsigned int states[BB_WAVE_MAX];
+  unsigned char miso[BB_WAVE_MAX];
+  unsigned int mosi;
+  int i, j, n, chunk;
+
+  while (count > 0) {
+    chunk = count > BB_WAVE_BYTES? BB_WAVE_BYTES: count;
+
+    /* per bit: set up MOSI with SCK low, then raise SCK and sample MISO */
+    n = 0;
+    for (i = 0; i < chunk; i++) {
+      for (j = 7; j >= 0; j--) {
+        mosi = (cmd[i] >> j) & 0x01? BB_MOSI: 0;
+        states[n++] = mosi;
+        states[n++] = mosi | BB_SCK;
+      }
+    }
+    states[n] = states[n - 1] & ~BB_SCK;
+    n++;
+
+    if (pgm->waveform(pgm, BB_SCK | BB_MOSI, states, miso, n) < 0)
+      return -1;
+
+    for (i = 0; i < chunk; i++) {
+      res[i] = 0;
+      for (j = 0; j < 8; j++)
+        res[i] = (res[i] << 1) | miso[i * 16 + j * 2 + 1];
+    }
+
+    cmd += chunk;
+    res += chunk;
+    count -= chunk;
+  }
+
+  return 0;
+}
+
 static int bitbang_tpi_clk(PROGRAMMER * pgm) 
 {
   unsigned char r = 0;
@@ -217,11 +450,61 @@ static int bitbang_tpi_clk(PROGRAMMER * pgm)
   return r;
 }
 
+/*
+ * clock "n" (at most 16) TPI bits with TPIDATA released (high), and
+ * return the sampled bits, the first one in bit 0
+ */
+static int bitbang_tpi_clks(PROGRAMMER * pgm, int n)
+{
+  unsigned int states[2 * 16];
+  unsigned char miso[2 * 16];
+  int i, bits = 0;
+
+  if (pgm->waveform == NULL) {
+    for (i = 0; i < n; i++)
+      bits |= (bitbang_tpi_clk(pgm) & 0x01) << i;
+    return bits;
+  }
+
+  for (i = 0; i < n; i++) {
+    states[2 * i] = BB_MOSI | BB_SCK;
+    states[2 * i + 1] = BB_MOSI;
+  }
+  if (pgm->waveform(pgm, BB_SCK | BB_MOSI, states, miso, 2 * n) < 0)
+    return -1;
+  for (i = 0; i < n; i++)
+    bits |= miso[2 * i] << i;
+
+  return bits;
+}
+
 void bitbang_tpi_tx(PROGRAMMER * pgm, unsigned char byte) 
 {
   int i;
   unsigned char b, parity;
 
+  if (pgm->waveform != NULL) {
+    unsigned int states[2 * 12 + 1], mosi;
+    unsigned char miso[2 * 12 + 1];
+    /* start bit, 8 data bits, parity bit, 2 stop bits */
+    unsigned int frame = (byte << 1) | 0x0c00;
+    int n = 0;
+
+    parity = 0;
+    for (i = 0; i <= 7; i++)
+      parity ^= (byte >> i) & 0x01;
+    frame |= parity << 9;
+
+    for (i = 0; i < 12; i++) {
+      mosi = (frame >> i) & 0x01? BB_MOSI: 0;
+      states[n++] = mosi;
+      states[n++] = mosi | BB_SCK;
+    }
+    states[n++] = BB_MOSI;
+    pgm->waveform(pgm, BB_SCK | BB_MOSI, states, miso, n);
+    return;
+  }
+
   /* start bit */
   pgm->setpin(pgm, PIN_AVR_MOSI, 0);
   bitbang_tpi_clk(pgm);
@@ -248,7 +531,7 @@ void bitbang_tpi_tx(PROGRAMMER * pgm, unsigned char byte)
 
 int bitbang_tpi_rx(PROGRAMMER * pgm) 
 {
-  int i;
+  int i, frame;
   unsigned char b, rbyte, parity;
 
   /* make sure pin is on for "pullup" */
@@ -257,7 +540,7 @@ int bitbang_tpi_rx(PROGRAMMER * pgm)
   /* wait for start bit (up to 10 bits) */
   b = 1;
   for (i = 0; i < 10; i++) {
-    b = bitbang_tpi_clk(pgm);
+    b = bitbang_tpi_clks(pgm, 1);
     if (b == 0)
       break;
   }
@@ -266,26 +549,24 @@ int bitbang_tpi_rx(PROGRAMMER * pgm)
     return -1;
   }
 
-  rbyte = 0;
-  parity = 0;
-  for (i=0; i<=7; i++) {
-    b = bitbang_tpi_clk(pgm);
-    parity ^= b;
+  /* 8 data bits, parity bit, 2 stop bits */
+  if ((frame = bitbang_tpi_clks(pgm, 11)) < 0)
+    return -1;
 
-    rbyte |= b << i;
-  }
+  rbyte = frame & 0xff;
+  parity = 0;
+  for (i=0; i<=7; i++)
+    parity ^= (rbyte >> i) & 0x01;
 
   /* parity bit */
-  if (bitbang_tpi_clk(pgm) != parity) {
+  if (((frame >> 8) & 0x01) != parity) {
     avrdude_message(MSG_INFO, "bitbang_tpi_rx: parity bit is wrong\n");
     return -1;
   }
 
   /* 2 stop bits */
-  b = 1;
-  b &= bitbang_tpi_clk(pgm);
-  b &= bitbang_tpi_clk(pgm);
-  if (b != 1) {
+  b = (frame >> 9) & 0x03;
+  if (b != 3) {
     avrdude_message(MSG_INFO, "bitbang_tpi_rx: stop bits not received correctly\n");
     return -1;
   }
@@ -327,8 +608,13 @@ int bitbang_cmd(PROGRAMMER * pgm, const unsigned char *cmd,
 {
   int i;
 
-  for (i=0; i<4; i++) {
-    res[i] = bitbang_txrx(pgm, cmd[i]);
+  if (pgm->waveform != NULL) {
+    if (bitbang_wave_spi(pgm, cmd, res, 4) < 0)
+      return -1;
+  } else {
+    for (i=0; i<4; i++) {
+      res[i] = bitbang_txrx(pgm, cmd[i]);
+    }
   }
 
     if(verbose > 4)
@@ -396,8 +682,15 @@ int bitbang_spi(PROGRAMMER * pgm, const unsigned char *cmd,
 
   pgm->setpin(pgm, PIN_LED_PGM, 0);
 
-  for (i=0; i<count; i++) {
-    res[i] = bitbang_txrx(pgm, cmd[i]);
+  if (pgm->waveform != NULL) {
+    if (bitbang_wave_spi(pgm, cmd, res, count) < 0) {
+      pgm->setpin(pgm, PIN_LED_PGM, 1);
+      return -1;
+    }
+  } else {
+    for (i=0; i<count; i++) {
+      res[i] = bitbang_txrx(pgm, cmd[i]);
+    }
   }
 
   pgm->setpin(pgm, PIN_LED_PGM, 1);
@@ -526,7 +819,9 @@ int bitbang_initialize(PROGRAMMER * pgm, AVRPART * p)
   int tries;
   int i;
 
-  bitbang_calibrate_delay();
+  /* the delay loop is only used for an ISP clock delay (-i) */
+  if (pgm->ispdelay > 1)
+    bitbang_calibrate_delay();
 
   pgm->powerup(pgm);
   usleep(20000);
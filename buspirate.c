@@ -181,7 +181,7 @@ static char *buspirate_readline_noexit(struct programmer_t *pgm, char *buf, size
 	long orig_serial_recv_timeout = serial_recv_timeout;
 
 	/* Static local buffer - this may come handy at times */
-	static char buf_local[100];
+	static LIBAVRDUDE_TLS char buf_local[100];
 
 	if (buf == NULL) {
 		buf = buf_local;
@@ -1317,6 +1317,67 @@ static int buspirate_bb_setpin(struct programmer_t *pgm, int pinfunc, int value)
 }
 
 
+/*
+ * Apply a sequence of pin states.  Each state is a single "output
+ * value" command, and the status byte sent back for it holds MISO, so
+ * the whole sequence takes one write and one read.
+ */
+static int buspirate_bb_waveform(struct programmer_t *pgm, unsigned int mask,
+				 const unsigned int *states, unsigned char *miso, int n)
+{
+	unsigned char buf[256];
+	unsigned char val = PDATA(pgm)->pin_val;
+	int misopin = pgm->pinno[PIN_AVR_MISO];
+	int invert = 0;
+	int i, j, k, pin, value, chunk;
+
+	if (misopin & PIN_INVERSE) {
+		misopin &= PIN_MASK;
+		invert = 1;
+	}
+	if (misopin < 1 || misopin > 5)
+		return -1;
+
+	/* Read all of the previously-expected-but-unread bytes */
+	while (PDATA(pgm)->unread_bytes > 0) {
+		if (buspirate_recv_bin(pgm, buf, 1) < 0)
+			return -1;
+		PDATA(pgm)->unread_bytes--;
+	}
+
+	for (i = 0; i < n; i += chunk) {
+		chunk = n - i > (int)sizeof(buf)? (int)sizeof(buf): n - i;
+		for (j = 0; j < chunk; j++) {
+			for (k = 0; k < N_PINS; k++) {
+				if (!(mask & (1U << k)))
+					continue;
+				pin = pgm->pinno[k];
+				value = (states[i + j] >> k) & 1;
+				if (pin & PIN_INVERSE) {
+					value = !value;
+					pin &= PIN_MASK;
+				}
+				if (pin < 1 || pin > 5)
+					return -1;
+				if (value)
+					val |= (1 << (pin - 1));
+				else
+					val &= ~(1 << (pin - 1));
+			}
+			buf[j] = val | 0x80;
+		}
+		if (buspirate_send_bin(pgm, buf, chunk) < 0)
+			return -1;
+		PDATA(pgm)->pin_val = val;
+		if (buspirate_recv_bin(pgm, buf, chunk) < 0)
+			return -1;
+		for (j = 0; j < chunk; j++)
+			miso[i + j] = ((buf[j] >> (misopin - 1)) & 1) ^ invert;
+	}
+
+	return 0;
+}
+
 static int buspirate_bb_highpulsepin(struct programmer_t *pgm, int pinfunc)
 {
 	int ret;
@@ -1369,6 +1430,7 @@ void buspirate_bb_initpgm(struct programmer_t *pgm)
 	pgm->setpin         = buspirate_bb_setpin;
 	pgm->getpin         = buspirate_bb_getpin;
 	pgm->highpulsepin   = buspirate_bb_highpulsepin;
+	pgm->waveform       = buspirate_bb_waveform;
 	pgm->read_byte      = avr_read_byte_default;
 	pgm->write_byte     = avr_write_byte_default;
 }
@@ -56,6 +56,11 @@ struct pdata
 {
   char has_auto_incr_addr;
   unsigned int buffersize;
+
+  /* second byte of the last flash word read, see butterfly_read_byte_flash() */
+  int flash_cached;
+  unsigned char flash_cvalue;
+  unsigned long flash_caddr;
 };
 
 #define PDATA(pgm) ((struct pdata *)(pgm->cookie))
@@ -497,14 +502,11 @@ static int butterfly_write_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
 static int butterfly_read_byte_flash(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                   unsigned long addr, unsigned char * value)
 {
-  static int cached = 0;
-  static unsigned char cvalue;
-  static unsigned long caddr;
   int use_ext_addr = m->op[AVR_OP_LOAD_EXT_ADDR] != NULL;
 
-  if (cached && ((caddr + 1) == addr)) {
-    *value = cvalue;
-    cached = 0;
+  if (PDATA(pgm)->flash_cached && ((PDATA(pgm)->flash_caddr + 1) == addr)) {
+    *value = PDATA(pgm)->flash_cvalue;
+    PDATA(pgm)->flash_cached = 0;
   }
   else {
     char buf[2];
@@ -522,9 +524,9 @@ static int butterfly_read_byte_flash(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
 
     if ((addr & 0x01) == 0) {
       *value = buf[0];
-      cached = 1;
-      cvalue = buf[1];
-      caddr = addr;
+      PDATA(pgm)->flash_cached = 1;
+      PDATA(pgm)->flash_cvalue = buf[1];
+      PDATA(pgm)->flash_caddr = addr;
     }
     else {
       *value = buf[1];
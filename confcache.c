@@ -0,0 +1,577 @@
+/*
+ * avrdude - A Downloader/Uploader for AVR device programmers
+ * Copyright (C) 2026 The AVRDUDE authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$ */
+
+/*
+ * Binary cache of a parsed configuration file.
+ *
+ * After the configuration file has been parsed, the resulting parts,
+ * programmers and defaults are dumped into a cache file, keyed on the
+ * path name, modification time and size of the configuration file.
+ * Subsequent runs load that cache instead of running the parser over
+ * the file again.  The cache file contains no pointers; all lists are
+ * stored as counted sequences of records, and the pointers are
+ * re-established while loading.  As the records are raw structure
+ * images, the cache is only accepted by the very same build of
+ * avrdude that wrote it: besides the version and the structure sizes,
+ * the cache records when this file was compiled, which changes with
+ * every build that changes one of the structures, as they are all
+ * defined in headers included here.
+ *
+ * The cache is only consulted for a configuration file that is read
+ * into an empty configuration (normally the system-wide one), as
+ * later files may refer to or override existing entries.
+ */
+
+#include "ac_cfg.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "avrdude.h"
+#include "libavrdude.h"
+#include "config.h"
+
+#if !defined(WIN32NATIVE)
+
+#include <unistd.h>
+
+#define CONFCACHE_MAGIC   "AVDCONF"
+#define CONFCACHE_VERSION 2
+#define CONFCACHE_BUILD   __DATE__ " " __TIME__
+
+struct confcache_hdr {
+  char          magic[8];
+  unsigned int  version;
+  char          avrdude_version[64];
+  char          build[32];      /* CONFCACHE_BUILD */
+  unsigned int  sizes[4];       /* AVRPART, AVRMEM, OPCODE, PROGRAMMER */
+  char          path[PATH_MAX];
+  long long     mtime;
+  long long     size;
+  char          default_programmer[MAX_STR_CONST];
+  char          default_parallel[PATH_MAX];
+  char          default_serial[PATH_MAX];
+  double        default_bitclock;
+  int           default_safemode;
+  int           nparts;
+  int           nprogrammers;
+};
+
+/*
+ * Compute the name of avrdude's per-user cache directory, and create
+ * it if "create" is set.  Returns -1 if there is no place for it.
+ */
+int avrdude_cache_dir(char * buf, size_t buflen, int create)
+{
+  const char * base;
+  int n;
+
+  if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] != 0)
+    n = snprintf(buf, buflen, "%s/avrdude", base);
+  else if ((base = getenv("HOME")) != NULL && base[0] != 0)
+    n = snprintf(buf, buflen, "%s/.cache/avrdude", base);
+  else
+    return -1;
+  if (n < 0 || (size_t)n >= buflen)
+    return -1;
+
+  if (create) {
+    char * cp;
+
+    /* create all missing path components */
+    for (cp = strchr(buf + 1, '/'); cp != NULL; cp = strchr(cp + 1, '/')) {
+      *cp = 0;
+      (void)mkdir(buf, 0755);
+      *cp = '/';
+    }
+    if (mkdir(buf, 0755) < 0 && errno != EEXIST)
+      return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Compute the name of the cache file for the configuration file
+ * "file".  Returns -1 if there is no place to keep the cache.
+ */
+static int confcache_name(const char * file, char * buf, size_t buflen,
+                          int create)
+{
+  const unsigned char * s;
+  unsigned int hash;
+  char dir[PATH_MAX];
+
+  if (avrdude_cache_dir(dir, sizeof(dir), create) < 0)
+    return -1;
+
+  /* FNV-1a hash of the configuration file path name */
+  for (hash = 2166136261U, s = (const unsigned char *)file; *s; s++)
+    hash = (hash ^ *s) * 16777619U;
+
+  if ((size_t)snprintf(buf, buflen, "%s/conf-%08x.cache", dir, hash) >= buflen)
+    return -1;
+
+  return 0;
+}
+
+
+static void confcache_fill_hdr(struct confcache_hdr * hdr, const char * file,
+                               struct stat * sb)
+{
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, CONFCACHE_MAGIC, sizeof(hdr->magic));
+  hdr->version = CONFCACHE_VERSION;
+  strncpy(hdr->avrdude_version, VERSION, sizeof(hdr->avrdude_version) - 1);
+  strncpy(hdr->build, CONFCACHE_BUILD, sizeof(hdr->build) - 1);
+  hdr->sizes[0] = sizeof(AVRPART);
+  hdr->sizes[1] = sizeof(AVRMEM);
+  hdr->sizes[2] = sizeof(OPCODE);
+  hdr->sizes[3] = sizeof(PROGRAMMER);
+  strncpy(hdr->path, file, sizeof(hdr->path) - 1);
+  hdr->mtime = sb->st_mtime;
+  hdr->size = sb->st_size;
+}
+
+
+/*
+ * Sequential reader over the in-memory image of the cache file.
+ */
+struct confcache_rd {
+  const unsigned char * p;
+  size_t left;
+};
+
+static const void * confcache_get(struct confcache_rd * rd, size_t len)
+{
+  const void * rv;
+
+  if (len > rd->left)
+    return NULL;
+  rv = rd->p;
+  rd->p += len;
+  rd->left -= len;
+
+  return rv;
+}
+
+static int confcache_get_int(struct confcache_rd * rd, int * val)
+{
+  const void * p = confcache_get(rd, sizeof(int));
+
+  if (p == NULL)
+    return -1;
+  memcpy(val, p, sizeof(int));
+
+  return 0;
+}
+
+/*
+ * Load the opcodes present according to the bit mask preceding them.
+ */
+static int confcache_get_ops(struct confcache_rd * rd, OPCODE * op[AVR_OP_MAX])
+{
+  int i, mask;
+  const void * p;
+
+  for (i = 0; i < AVR_OP_MAX; i++)
+    op[i] = NULL;
+
+  if (confcache_get_int(rd, &mask) < 0)
+    return -1;
+
+  for (i = 0; i < AVR_OP_MAX; i++) {
+    if ((mask & (1 << i)) == 0)
+      continue;
+    if ((p = confcache_get(rd, sizeof(OPCODE))) == NULL)
+      return -1;
+    op[i] = avr_new_opcode();
+    memcpy(op[i], p, sizeof(OPCODE));
+  }
+
+  return 0;
+}
+
+static AVRPART * confcache_get_part(struct confcache_rd * rd)
+{
+  AVRPART * p;
+  AVRMEM * m;
+  const void * rec;
+  int i, nmem;
+
+  if ((rec = confcache_get(rd, sizeof(AVRPART))) == NULL)
+    return NULL;
+
+  p = avr_new_part();
+  ldestroy(p->mem);
+  memcpy(p, rec, sizeof(AVRPART));
+  p->mem = lcreat(NULL, 0);
+
+  if (confcache_get_ops(rd, p->op) < 0 ||
+      confcache_get_int(rd, &nmem) < 0) {
+    avr_free_part(p);
+    return NULL;
+  }
+
+  for (i = 0; i < nmem; i++) {
+    if ((rec = confcache_get(rd, sizeof(AVRMEM))) == NULL) {
+      avr_free_part(p);
+      return NULL;
+    }
+    m = avr_new_memtype();
+    memcpy(m, rec, sizeof(AVRMEM));
+    m->buf = NULL;
+    m->tags = NULL;
+    m->pagemap = NULL;
+    ladd(p->mem, m);
+    if (confcache_get_ops(rd, m->op) < 0) {
+      avr_free_part(p);
+      return NULL;
+    }
+  }
+
+  return p;
+}
+
+static PROGRAMMER * confcache_get_programmer(struct confcache_rd * rd)
+{
+  PROGRAMMER * pgm;
+  PROGRAMMER rec_buf, * rec = &rec_buf;
+  const PROGRAMMER_TYPE * type;
+  const void * p;
+  const char * s;
+  int i, n, len;
+
+  /* programmer type the initpgm function belongs to */
+  if (confcache_get_int(rd, &len) < 0 || len <= 0 ||
+      (s = confcache_get(rd, len)) == NULL || s[len - 1] != 0 ||
+      (type = locate_programmer_type(s)) == NULL)
+    return NULL;
+
+  if ((p = confcache_get(rd, sizeof(PROGRAMMER))) == NULL)
+    return NULL;
+  memcpy(rec, p, sizeof(PROGRAMMER));
+
+  /*
+   * Start out from a fresh programmer, so all function pointers are
+   * set up the same way the parser would have found them, and copy
+   * the parameters that can be set in the configuration file.
+   */
+  if ((pgm = pgm_new()) == NULL)
+    return NULL;
+  pgm->initpgm = type->initpgm;
+  memcpy(pgm->desc, rec->desc, sizeof(pgm->desc));
+  memcpy(pgm->type, rec->type, sizeof(pgm->type));
+  memcpy(pgm->port, rec->port, sizeof(pgm->port));
+  memcpy(pgm->pinno, rec->pinno, sizeof(pgm->pinno));
+  memcpy(pgm->pin, rec->pin, sizeof(pgm->pin));
+  pgm->exit_vcc = rec->exit_vcc;
+  pgm->exit_reset = rec->exit_reset;
+  pgm->exit_datahigh = rec->exit_datahigh;
+  pgm->conntype = rec->conntype;
+  pgm->ppidata = rec->ppidata;
+  pgm->ppictrl = rec->ppictrl;
+  pgm->baudrate = rec->baudrate;
+  pgm->usbvid = rec->usbvid;
+  memcpy(pgm->usbdev, rec->usbdev, sizeof(pgm->usbdev));
+  memcpy(pgm->usbsn, rec->usbsn, sizeof(pgm->usbsn));
+  memcpy(pgm->usbvendor, rec->usbvendor, sizeof(pgm->usbvendor));
+  memcpy(pgm->usbproduct, rec->usbproduct, sizeof(pgm->usbproduct));
+  pgm->bitclock = rec->bitclock;
+  pgm->ispdelay = rec->ispdelay;
+  pgm->page_size = rec->page_size;
+  memcpy(pgm->config_file, rec->config_file, sizeof(pgm->config_file));
+  pgm->lineno = rec->lineno;
+
+  /* programmer ids */
+  if (confcache_get_int(rd, &n) < 0)
+    goto fail;
+  for (i = 0; i < n; i++) {
+    if (confcache_get_int(rd, &len) < 0 || len <= 0 ||
+        (s = confcache_get(rd, len)) == NULL || s[len - 1] != 0)
+      goto fail;
+    ladd(pgm->id, strdup(s));
+  }
+
+  /* USB product ids */
+  if (confcache_get_int(rd, &n) < 0)
+    goto fail;
+  for (i = 0; i < n; i++) {
+    int * ip = malloc(sizeof(int));
+
+    if (ip == NULL || confcache_get_int(rd, ip) < 0) {
+      free(ip);
+      goto fail;
+    }
+    ladd(pgm->usbpid, ip);
+  }
+
+  return pgm;
+
+fail:
+  pgm_free(pgm);
+  return NULL;
+}
+
+
+/*
+ * Try to load the cached contents of configuration file "file".
+ * Returns 0 if the cache was valid and has been loaded, -1 otherwise.
+ */
+int confcache_load(const char * file)
+{
+  char cname[PATH_MAX];
+  struct stat sb;
+  struct confcache_hdr ref;
+  const struct confcache_hdr * hdr;
+  struct confcache_rd rd;
+  unsigned char * image = NULL;
+  LISTID parts = NULL, pgms = NULL;
+  FILE * f = NULL;
+  long len;
+  int i, rv = -1;
+  void * d;
+
+  if (stat(file, &sb) < 0 || confcache_name(file, cname, sizeof(cname), 0) < 0)
+    return -1;
+
+  if ((f = fopen(cname, "rb")) == NULL)
+    return -1;
+
+  if (fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < (long)sizeof(*hdr) ||
+      fseek(f, 0, SEEK_SET) < 0)
+    goto done;
+
+  if ((image = malloc(len)) == NULL ||
+      fread(image, 1, len, f) != (size_t)len)
+    goto done;
+
+  rd.p = image;
+  rd.left = len;
+  hdr = confcache_get(&rd, sizeof(*hdr));
+
+  confcache_fill_hdr(&ref, file, &sb);
+  if (memcmp(hdr->magic, ref.magic, sizeof(ref.magic)) != 0 ||
+      hdr->version != ref.version ||
+      strcmp(hdr->avrdude_version, ref.avrdude_version) != 0 ||
+      memcmp(hdr->build, ref.build, sizeof(ref.build)) != 0 ||
+      memcmp(hdr->sizes, ref.sizes, sizeof(ref.sizes)) != 0 ||
+      strcmp(hdr->path, ref.path) != 0 ||
+      hdr->mtime != ref.mtime || hdr->size != ref.size)
+    goto done;
+
+  parts = lcreat(NULL, 0);
+  pgms = lcreat(NULL, 0);
+
+  for (i = 0; i < hdr->nparts; i++) {
+    AVRPART * p = confcache_get_part(&rd);
+    if (p == NULL)
+      goto done;
+    ladd(parts, p);
+  }
+
+  for (i = 0; i < hdr->nprogrammers; i++) {
+    PROGRAMMER * pgm = confcache_get_programmer(&rd);
+    if (pgm == NULL)
+      goto done;
+    ladd(pgms, pgm);
+  }
+
+  if (rd.left != 0)
+    goto done;
+
+  /* everything loaded fine, hand it over */
+  while ((d = lrmv_n(parts, 1)) != NULL)
+    ladd(part_list, d);
+  while ((d = lrmv_n(pgms, 1)) != NULL)
+    ladd(programmers, d);
+
+  memcpy(default_programmer, hdr->default_programmer, MAX_STR_CONST);
+  default_programmer[MAX_STR_CONST-1] = 0;
+  memcpy(default_parallel, hdr->default_parallel, PATH_MAX);
+  default_parallel[PATH_MAX-1] = 0;
+  memcpy(default_serial, hdr->default_serial, PATH_MAX);
+  default_serial[PATH_MAX-1] = 0;
+  default_bitclock = hdr->default_bitclock;
+  default_safemode = hdr->default_safemode;
+
+  avrdude_message(MSG_NOTICE2, "%s: loaded configuration from cache \"%s\"\n",
+                  progname, cname);
+  rv = 0;
+
+done:
+  if (parts != NULL)
+    ldestroy_cb(parts, (void(*)(void*))avr_free_part);
+  if (pgms != NULL)
+    ldestroy_cb(pgms, (void(*)(void*))pgm_free);
+  free(image);
+  fclose(f);
+
+  return rv;
+}
+
+
+static void confcache_put_ops(FILE * f, OPCODE * op[AVR_OP_MAX])
+{
+  int i, mask;
+
+  for (i = 0, mask = 0; i < AVR_OP_MAX; i++)
+    if (op[i] != NULL)
+      mask |= 1 << i;
+  fwrite(&mask, sizeof(mask), 1, f);
+
+  for (i = 0; i < AVR_OP_MAX; i++)
+    if (op[i] != NULL)
+      fwrite(op[i], sizeof(OPCODE), 1, f);
+}
+
+static void confcache_put_string(FILE * f, const char * s)
+{
+  int len = strlen(s) + 1;
+
+  fwrite(&len, sizeof(len), 1, f);
+  fwrite(s, 1, len, f);
+}
+
+
+struct confcache_type_search {
+  void (*initpgm)(struct programmer_t * pgm);
+  const char * id;
+};
+
+static void confcache_type_cb(const char * id, const char * desc, void * cookie)
+{
+  struct confcache_type_search * ts = cookie;
+  const PROGRAMMER_TYPE * type;
+
+  if (ts->id == NULL && (type = locate_programmer_type(id)) != NULL &&
+      type->initpgm == ts->initpgm)
+    ts->id = id;
+}
+
+
+/*
+ * Write the current configuration, which results from reading "file"
+ * into an empty configuration, to the cache.  Failures are silently
+ * ignored, the cache is just not going to be used then.
+ */
+void confcache_save(const char * file)
+{
+  char cname[PATH_MAX], tname[PATH_MAX + 16];
+  struct stat sb;
+  struct confcache_hdr hdr;
+  LNODEID ln, ln2;
+  AVRPART * p;
+  AVRMEM * m;
+  PROGRAMMER * pgm;
+  FILE * f;
+  int n;
+
+  if (stat(file, &sb) < 0 || confcache_name(file, cname, sizeof(cname), 1) < 0)
+    return;
+
+  snprintf(tname, sizeof(tname), "%s.%ld", cname, (long)getpid());
+  if ((f = fopen(tname, "wb")) == NULL)
+    return;
+
+  confcache_fill_hdr(&hdr, file, &sb);
+  memcpy(hdr.default_programmer, default_programmer, MAX_STR_CONST);
+  memcpy(hdr.default_parallel, default_parallel, PATH_MAX);
+  memcpy(hdr.default_serial, default_serial, PATH_MAX);
+  hdr.default_bitclock = default_bitclock;
+  hdr.default_safemode = default_safemode;
+  hdr.nparts = lsize(part_list);
+  hdr.nprogrammers = lsize(programmers);
+  fwrite(&hdr, sizeof(hdr), 1, f);
+
+  for (ln = lfirst(part_list); ln; ln = lnext(ln)) {
+    p = ldata(ln);
+    fwrite(p, sizeof(AVRPART), 1, f);
+    confcache_put_ops(f, p->op);
+    n = lsize(p->mem);
+    fwrite(&n, sizeof(n), 1, f);
+    for (ln2 = lfirst(p->mem); ln2; ln2 = lnext(ln2)) {
+      m = ldata(ln2);
+      fwrite(m, sizeof(AVRMEM), 1, f);
+      confcache_put_ops(f, m->op);
+    }
+  }
+
+  for (ln = lfirst(programmers); ln; ln = lnext(ln)) {
+    struct confcache_type_search ts;
+
+    pgm = ldata(ln);
+    ts.initpgm = pgm->initpgm;
+    ts.id = NULL;
+    walk_programmer_types(confcache_type_cb, &ts);
+    if (ts.id == NULL)
+      goto fail;
+    confcache_put_string(f, ts.id);
+    fwrite(pgm, sizeof(PROGRAMMER), 1, f);
+
+    n = lsize(pgm->id);
+    fwrite(&n, sizeof(n), 1, f);
+    for (ln2 = lfirst(pgm->id); ln2; ln2 = lnext(ln2))
+      confcache_put_string(f, ldata(ln2));
+
+    n = lsize(pgm->usbpid);
+    fwrite(&n, sizeof(n), 1, f);
+    for (ln2 = lfirst(pgm->usbpid); ln2; ln2 = lnext(ln2))
+      fwrite(ldata(ln2), sizeof(int), 1, f);
+  }
+
+  if (ferror(f) || fclose(f) != 0) {
+    unlink(tname);
+    return;
+  }
+
+  if (rename(tname, cname) < 0)
+    unlink(tname);
+  else
+    avrdude_message(MSG_NOTICE2, "%s: wrote configuration cache \"%s\"\n",
+                    progname, cname);
+  return;
+
+fail:
+  fclose(f);
+  unlink(tname);
+}
+
+#else  /* WIN32NATIVE */
+
+int avrdude_cache_dir(char * buf, size_t buflen, int create)
+{
+  return -1;
+}
+
+int confcache_load(const char * file)
+{
+  return -1;
+}
+
+void confcache_save(const char * file)
+{
+}
+
+#endif /* WIN32NATIVE */
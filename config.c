@@ -58,6 +58,8 @@ extern char * yytext;
 
 void cleanup_config(void)
 {
+  index_avrparts(NULL);
+  index_programmers(NULL);
   ldestroy_cb(part_list, (void(*)(void*))avr_free_part);
   ldestroy_cb(programmers, (void(*)(void*))pgm_free);
   ldestroy_cb(string_list, (void(*)(void*))free_token);
@@ -326,6 +328,23 @@ int read_config(const char * file)
 {
   FILE * f;
   int r;
+  int cacheable;
+
+  /*
+   * A file read into an empty configuration does not depend on
+   * anything read before, so its result can be taken from (and
+   * stored into) the configuration cache.
+   */
+  cacheable = lsize(part_list) == 0 && lsize(programmers) == 0;
+  if (cacheable && confcache_load(file) == 0) {
+    index_avrparts(part_list);
+    index_programmers(programmers);
+    return 0;
+  }
+
+  /* the parser modifies the lists, don't let it use a stale index */
+  index_avrparts(NULL);
+  index_programmers(NULL);
 
   f = fopen(file, "r");
   if (f == NULL) {
@@ -347,5 +366,11 @@ int read_config(const char * file)
 
   fclose(f);
 
+  if (r == 0 && cacheable)
+    confcache_save(file);
+
+  index_avrparts(part_list);
+  index_programmers(programmers);
+
   return r;
 }
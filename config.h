@@ -96,6 +96,12 @@ void pyytext(void);
 
 char * dup_string(const char * str);
 
+int avrdude_cache_dir(char * buf, size_t buflen, int create);
+
+int confcache_load(const char * file);
+
+void confcache_save(const char * file);
+
 #ifdef __cplusplus
 }
 #endif
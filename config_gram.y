@@ -1271,6 +1271,7 @@ part_parm :
         YYABORT;
       }
       if(0 != parse_cmdbits(op)) YYABORT;
+      avr_compile_opcode(op);
       if (current_part->op[opnum] != NULL) {
         /*yywarning("operation redefined");*/
         avr_free_opcode(current_part->op[opnum]);
@@ -1402,6 +1403,7 @@ mem_spec :
         YYABORT;
       }
       if(0 != parse_cmdbits(op)) YYABORT;
+      avr_compile_opcode(op);
       if (current_mem->op[opnum] != NULL) {
         /*yywarning("operation redefined");*/
         avr_free_opcode(current_mem->op[opnum]);
@@ -89,7 +89,7 @@ int dfu_upload(struct dfu_dev *dfu, void * ptr, int size) {
  * is sent to the device.
  */
 
-static uint16_t wIndex = 0;
+static LIBAVRDUDE_TLS uint16_t wIndex = 0;
 
 /* INTERNAL FUNCTION PROTOTYPES
  */
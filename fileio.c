@@ -28,6 +28,14 @@
 #include <ctype.h>
 #include <stdint.h>
 
+#ifdef HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_SYS_STAT_H) && !defined(WIN32NATIVE)
+#  define FILEIO_MMAP
+#  include <sys/mman.h>
+#endif
+
 #ifdef HAVE_LIBELF
 #ifdef HAVE_LIBELF_H
 #include <libelf.h>
@@ -45,8 +53,15 @@
 
 #define IHEX_MAXDATA 256
 
-#define MAX_LINE_LEN 256  /* max line length for ASCII format input files */
+/* data bytes per Intel Hex / S-Record output record (-R) */
+LIBAVRDUDE_TLS int fileio_hexrecsize = 32;
 
+static int fio_recsize(void)
+{
+  if (fileio_hexrecsize < 1 || fileio_hexrecsize >= IHEX_MAXDATA)
+    return 32;
+  return fileio_hexrecsize;
+}
 
 struct ihexrec {
   unsigned char    reclen;
@@ -56,33 +71,68 @@ struct ihexrec {
   unsigned char    cksum;
 };
 
+/*
+ * Contents of an ASCII format input file, mapped or read into memory
+ * as a whole, so the records can be parsed without going through
+ * stdio line by line.
+ */
+struct fio_text {
+  char *           buf;
+  size_t           len;
+  int              mapped;
+};
+
+/*
+ * State of the Intel Hex and S-Record parsers between lines.
+ */
+struct fio_parse {
+  char *           infile;
+  AVRMEM *         mem;
+  int              bufsize;
+  unsigned int     fileoffset;
+  int              lineno;
+  unsigned int     baseaddr;    /* Intel Hex extended address */
+  unsigned int     maxaddr;
+  int              reccount;    /* S-Record data records so far */
+  int              end;         /* end of file record seen */
+  int              datarec;     /* last line was a data record: */
+  unsigned int     recaddr;     /*   its address within mem */
+  int              reclen;      /*   and its length */
+};
+
 
 static int b2ihex(unsigned char * inbuf, int bufsize, 
              int recsize, int startaddr,
              char * outfile, FILE * outf);
 
-static int ihex2b(char * infile, FILE * inf,
+static int ihex2b(char * infile, struct fio_text * text,
              AVRMEM * mem, int bufsize, unsigned int fileoffset);
 
 static int b2srec(unsigned char * inbuf, int bufsize, 
            int recsize, int startaddr,
            char * outfile, FILE * outf);
 
-static int srec2b(char * infile, FILE * inf,
+static int srec2b(char * infile, struct fio_text * text,
              AVRMEM * mem, int bufsize, unsigned int fileoffset);
 
-static int ihex_readrec(struct ihexrec * ihex, char * rec);
+static int ihex_readrec(struct ihexrec * ihex, const char * rec, int len);
+
+static int srec_readrec(struct ihexrec * srec, const char * rec, int len);
+
+static int fio_text_load(char * infile, FILE * f, struct fio_text * text);
 
-static int srec_readrec(struct ihexrec * srec, char * rec);
+static void fio_text_free(struct fio_text * text);
 
 static int fileio_rbin(struct fioparms * fio,
                   char * filename, FILE * f, AVRMEM * mem, int size);
 
 static int fileio_ihex(struct fioparms * fio, 
-                  char * filename, FILE * f, AVRMEM * mem, int size);
+                  char * filename, FILE * f, struct fio_text * text,
+                  AVRMEM * mem, int size);
 
 static int fileio_srec(struct fioparms * fio,
-                  char * filename, FILE * f, AVRMEM * mem, int size);
+                  char * filename, FILE * f, struct fio_text * text,
+                  AVRMEM * mem, int size);
 
 #ifdef HAVE_LIBELF
 static int elf2b(char * infile, FILE * inf,
@@ -98,7 +148,7 @@ static int fileio_num(struct fioparms * fio,
 		char * filename, FILE * f, AVRMEM * mem, int size,
 		FILEFMT fmt);
 
-static int fmt_autodetect(char * fname);
+static int fmt_autodetect(struct fio_text * text);
 
 
 
@@ -116,22 +166,114 @@ char * fmtstr(FILEFMT format)
 
 
 
+/*
+ * Output buffer for the ASCII formats.  Records are rendered into
+ * 'buf' and written out in large chunks rather than with a stdio call
+ * per field.
+ */
+#define FIO_OUT_SIZE  0x10000
+#define FIO_OUT_REC   (2 + 2*(1+4+255+1) + 1)  /* longest record + '\n' */
+
+struct fio_out {
+  FILE *           f;
+  char *           outfile;
+  size_t           len;
+  int              err;
+  char             buf[FIO_OUT_SIZE];
+};
+
+/* hex representation of each byte value */
+static const char hexpair[2*256+1] =
+  "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+  "202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+  "404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+  "606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+  "808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+  "A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+  "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+  "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+
+static void fio_out_flush(struct fio_out * o)
+{
+  if (o->len > 0 && !o->err &&
+      fwrite(o->buf, 1, o->len, o->f) != o->len) {
+    avrdude_message(MSG_INFO, "%s: error writing \"%s\": %s\n",
+                    progname, o->outfile, strerror(errno));
+    o->err = 1;
+  }
+  o->len = 0;
+}
+
+
+/*
+ * Append the hex digits of 'n' bytes at 'data' to the current record,
+ * and add them to the checksum.
+ */
+static void fio_out_hex(struct fio_out * o, const unsigned char * data,
+                        int n, unsigned char * cksum)
+{
+  char * p = o->buf + o->len;
+  unsigned char sum = *cksum;
+  int i;
+
+  for (i=0; i<n; i++) {
+    p[2*i]   = hexpair[2*data[i]];
+    p[2*i+1] = hexpair[2*data[i]+1];
+    sum += data[i];
+  }
+  o->len += 2*n;
+  *cksum = sum;
+}
+
+
+/*
+ * Append one record: 'lead' (":" or "S<n>"), the 'nhdr' header bytes
+ * and 'n' data bytes in hex, and the checksum byte, which is the two's
+ * complement of the sum for Intel Hex and the one's complement for
+ * S-Records.
+ */
+static void fio_out_rec(struct fio_out * o, const char * lead,
+                        const unsigned char * hdr, int nhdr,
+                        const unsigned char * data, int n, int srec)
+{
+  unsigned char cksum = 0;
+
+  if (o->len + FIO_OUT_REC > FIO_OUT_SIZE)
+    fio_out_flush(o);
+
+  while (*lead)
+    o->buf[o->len++] = *lead++;
+  fio_out_hex(o, hdr, nhdr, &cksum);
+  fio_out_hex(o, data, n, &cksum);
+  cksum = srec? 0xff - cksum: -cksum;
+  o->buf[o->len++] = hexpair[2*cksum];
+  o->buf[o->len++] = hexpair[2*cksum+1];
+  o->buf[o->len++] = '\n';
+}
+
+
 static int b2ihex(unsigned char * inbuf, int bufsize, 
            int recsize, int startaddr,
            char * outfile, FILE * outf)
 {
+  struct fio_out out;
   unsigned char * buf;
+  unsigned char hdr[4], ext[2];
   unsigned int nextaddr;
   int n, nbytes, n_64k;
-  int i;
-  unsigned char cksum;
 
-  if (recsize > 255) {
-    avrdude_message(MSG_INFO, "%s: recsize=%d, must be < 256\n",
+  if (recsize < 1 || recsize > 255) {
+    avrdude_message(MSG_INFO, "%s: recsize=%d, must be 1..255\n",
               progname, recsize);
     return -1;
   }
 
+  out.f       = outf;
+  out.outfile = outfile;
+  out.len     = 0;
+  out.err     = 0;
+
   n_64k    = 0;
   nextaddr = startaddr;
   buf      = inbuf;
@@ -146,31 +288,26 @@ static int b2ihex(unsigned char * inbuf, int bufsize,
       n = 0x10000 - nextaddr;
 
     if (n) {
-      cksum = 0;
-      fprintf(outf, ":%02X%04X00", n, nextaddr);
-      cksum += n + ((nextaddr >> 8) & 0x0ff) + (nextaddr & 0x0ff);
-      for (i=0; i<n; i++) {
-        fprintf(outf, "%02X", buf[i]);
-        cksum += buf[i];
-      }
-      cksum = -cksum;
-      fprintf(outf, "%02X\n", cksum);
-      
+      hdr[0] = n;
+      hdr[1] = (nextaddr >> 8) & 0x0ff;
+      hdr[2] = nextaddr & 0x0ff;
+      hdr[3] = 0;
+      fio_out_rec(&out, ":", hdr, 4, buf, n, 0);
+
       nextaddr += n;
       nbytes   += n;
     }
 
     if (nextaddr >= 0x10000) {
-      int lo, hi;
       /* output an extended address record */
       n_64k++;
-      lo = n_64k & 0xff;
-      hi = (n_64k >> 8) & 0xff;
-      cksum = 0;
-      fprintf(outf, ":02000004%02X%02X", hi, lo);
-      cksum += 2 + 0 + 4 + hi + lo;
-      cksum = -cksum;
-      fprintf(outf, "%02X\n", cksum);
+      hdr[0] = 2;
+      hdr[1] = 0;
+      hdr[2] = 0;
+      hdr[3] = 4;
+      ext[0] = (n_64k >> 8) & 0xff;
+      ext[1] = n_64k & 0xff;
+      fio_out_rec(&out, ":", hdr, 4, ext, 2, 0);
       nextaddr = 0;
     }
 
@@ -182,234 +319,375 @@ static int b2ihex(unsigned char * inbuf, int bufsize,
   /*-----------------------------------------------------------------
     add the end of record data line
     -----------------------------------------------------------------*/
-  cksum = 0;
-  n = 0;
-  nextaddr = 0;
-  fprintf(outf, ":%02X%04X01", n, nextaddr);
-  cksum += n + ((nextaddr >> 8) & 0x0ff) + (nextaddr & 0x0ff) + 1;
-  cksum = -cksum;
-  fprintf(outf, "%02X\n", cksum);
+  hdr[0] = 0;
+  hdr[1] = 0;
+  hdr[2] = 0;
+  hdr[3] = 1;
+  fio_out_rec(&out, ":", hdr, 4, NULL, 0, 0);
+  fio_out_flush(&out);
+
+  if (out.err)
+    return -1;
 
   return nbytes;
 }
 
 
-static int ihex_readrec(struct ihexrec * ihex, char * rec)
-{
-  int i, j;
-  char buf[8];
-  int offset, len;
-  char * e;
-  unsigned char cksum;
-  int rc;
+/*
+ * Value of each character as a hex digit, 0xff if it is none.
+ */
+#define HEX_NONE16 \
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, \
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+
+static const unsigned char hexval[256] = {
+  HEX_NONE16, HEX_NONE16, HEX_NONE16,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 10, 11, 12, 13, 14, 15, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  HEX_NONE16,
+  0xff, 10, 11, 12, 13, 14, 15, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  HEX_NONE16, HEX_NONE16, HEX_NONE16, HEX_NONE16, HEX_NONE16,
+  HEX_NONE16, HEX_NONE16, HEX_NONE16, HEX_NONE16,
+};
 
-  len    = strlen(rec);
-  offset = 1;
-  cksum  = 0;
 
-  /* reclen */
-  if (offset + 2 > len)
-    return -1;
-  for (i=0; i<2; i++)
-    buf[i] = rec[offset++];
-  buf[i] = 0;
-  ihex->reclen = strtoul(buf, &e, 16);
-  if (e == buf || *e != 0)
-    return -1;
+/*
+ * Decode the 2*n hex digits at 'src' into n bytes at 'dst', and add
+ * them to the checksum '*cksum'.  Invalid digits are collected over
+ * the whole run instead of being tested one by one, which keeps the
+ * loop free of branches.  Returns -1 if there was an invalid digit.
+ */
+static int hex_decode(unsigned char * dst, const char * src, int n,
+                      unsigned char * cksum)
+{
+  const unsigned char * s = (const unsigned char *)src;
+  unsigned char hi, lo, bad, sum;
+  int i;
 
-  /* load offset */
-  if (offset + 4 > len)
-    return -1;
-  for (i=0; i<4; i++)
-    buf[i] = rec[offset++];
-  buf[i] = 0;
-  ihex->loadofs = strtoul(buf, &e, 16);
-  if (e == buf || *e != 0)
+  bad = 0;
+  sum = *cksum;
+  for (i=0; i<n; i++) {
+    hi = hexval[s[2*i]];
+    lo = hexval[s[2*i+1]];
+    bad |= hi | lo;
+    dst[i] = hi << 4 | lo;
+    sum += dst[i];
+  }
+  if (bad & 0xf0)
     return -1;
 
-  /* record type */
-  if (offset + 2 > len)
+  *cksum = sum;
+  return 0;
+}
+
+
+static int ihex_readrec(struct ihexrec * ihex, const char * rec, int len)
+{
+  unsigned char hdr[4];
+  unsigned char cksum, dummy;
+
+  cksum = 0;
+
+  /* reclen, load offset, record type */
+  if (len < 1 + 2*4 || hex_decode(hdr, rec + 1, 4, &cksum) < 0)
     return -1;
-  for (i=0; i<2; i++)
-    buf[i] = rec[offset++];
-  buf[i] = 0;
-  ihex->rectyp = strtoul(buf, &e, 16);
-  if (e == buf || *e != 0)
+  ihex->reclen  = hdr[0];
+  ihex->loadofs = hdr[1] << 8 | hdr[2];
+  ihex->rectyp  = hdr[3];
+
+  /* data, cksum */
+  if (len < 1 + 2*4 + 2*ihex->reclen + 2 ||
+      hex_decode(ihex->data, rec + 1 + 2*4, ihex->reclen, &cksum) < 0 ||
+      hex_decode(&ihex->cksum, rec + 1 + 2*4 + 2*ihex->reclen, 1, &dummy) < 0)
     return -1;
 
-  cksum = ihex->reclen + ((ihex->loadofs >> 8) & 0x0ff) + 
-    (ihex->loadofs & 0x0ff) + ihex->rectyp;
+  return -cksum & 0x000000ff;
+}
 
-  /* data */
-  for (j=0; j<ihex->reclen; j++) {
-    if (offset + 2 > len)
-      return -1;
-    for (i=0; i<2; i++)
-      buf[i] = rec[offset++];
-    buf[i] = 0;
-    ihex->data[j] = strtoul(buf, &e, 16);
-    if (e == buf || *e != 0)
-      return -1;
-    cksum += ihex->data[j];
+
+
+/*
+ * Make the contents of the open input file 'f' available in 'text'.
+ * Regular files are mapped into memory where possible, anything else
+ * (stdin, pipes, systems without mmap()) is read into a buffer.
+ */
+static int fio_text_load(char * infile, FILE * f, struct fio_text * text)
+{
+  size_t n, size;
+  char * p;
+
+  text->buf    = NULL;
+  text->len    = 0;
+  text->mapped = 0;
+
+#ifdef FILEIO_MMAP
+  {
+    struct stat st;
+
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0 && ftell(f) == 0) {
+      p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+      if (p != MAP_FAILED) {
+        text->buf    = p;
+        text->len    = st.st_size;
+        text->mapped = 1;
+        return 0;
+      }
+    }
   }
+#endif
 
-  /* cksum */
-  if (offset + 2 > len)
-    return -1;
-  for (i=0; i<2; i++)
-    buf[i] = rec[offset++];
-  buf[i] = 0;
-  ihex->cksum = strtoul(buf, &e, 16);
-  if (e == buf || *e != 0)
+  size = 0;
+  do {
+    if (text->len == size) {
+      size = size? 2*size: 0x10000;
+      if ((p = realloc(text->buf, size)) == NULL) {
+        avrdude_message(MSG_INFO, "%s: out of memory reading \"%s\"\n",
+                        progname, infile);
+        fio_text_free(text);
+        return -1;
+      }
+      text->buf = p;
+    }
+    n = fread(text->buf + text->len, 1, size - text->len, f);
+    text->len += n;
+  } while (n > 0);
+
+  if (ferror(f)) {
+    avrdude_message(MSG_INFO, "%s: error reading \"%s\": %s\n",
+                    progname, infile, strerror(errno));
+    fio_text_free(text);
     return -1;
+  }
 
-  rc = -cksum & 0x000000ff;
+  return 0;
+}
 
-  return rc;
+
+static void fio_text_free(struct fio_text * text)
+{
+#ifdef FILEIO_MMAP
+  if (text->mapped)
+    munmap(text->buf, text->len);
+  else
+#endif
+    free(text->buf);
+
+  text->buf    = NULL;
+  text->len    = 0;
+  text->mapped = 0;
 }
 
 
+/*
+ * Return the line of 'text' at '*pos' and advance '*pos' past it.
+ * Its length without the newline goes into '*len'.  Returns NULL at
+ * the end of the text.
+ */
+static const char * fio_text_line(struct fio_text * text, size_t * pos,
+                                  int * len)
+{
+  const char * line, * nl;
+  size_t n;
+
+  if (*pos >= text->len)
+    return NULL;
+
+  line = text->buf + *pos;
+  n = text->len - *pos;
+  if ((nl = memchr(line, '\n', n)) != NULL)
+    n = nl - line;
+  *pos += n + (nl != NULL);
+  *len = n > INT_MAX? INT_MAX: (int)n;
+
+  return line;
+}
+
 
 /*
- * Intel Hex to binary buffer
- *
- * Given an open file 'inf' which contains Intel Hex formated data,
- * parse the file and lay it out within the memory buffer pointed to
- * by outbuf.  The size of outbuf, 'bufsize' is honored; if data would
- * fall outsize of the memory buffer outbuf, an error is generated.
- *
- * Return the maximum memory address within 'outbuf' that was written.
- * If an error occurs, return -1.
+ * Initialize the state for parsing a file into 'mem'.
+ */
+static void fio_parse_init(struct fio_parse * fp, char * infile,
+                           AVRMEM * mem, int bufsize, unsigned int fileoffset)
+{
+  memset(fp, 0, sizeof(*fp));
+  fp->infile     = infile;
+  fp->mem        = mem;
+  fp->bufsize    = bufsize;
+  fp->fileoffset = fileoffset;
+}
+
+
+/*
+ * Parse one line of an Intel Hex file, and lay its data out within
+ * the memory buffer.  The size of the buffer, 'bufsize' is honored; if
+ * data would fall outsize of the memory buffer, an error is generated.
  *
- * */
-static int ihex2b(char * infile, FILE * inf,
-             AVRMEM * mem, int bufsize, unsigned int fileoffset)
+ * Returns 0, or -1 if an error occurs.
+ */
+static int ihex_parse_line(struct fio_parse * fp, const char * line, int len)
 {
-  char buffer [ MAX_LINE_LEN ];
-  unsigned int nextaddr, baseaddr, maxaddr;
-  int i;
-  int lineno;
-  int len;
+  unsigned int nextaddr;
   struct ihexrec ihex;
   int rc;
 
-  lineno   = 0;
-  baseaddr = 0;
-  maxaddr  = 0;
-  nextaddr = 0;
-
-  while (fgets((char *)buffer,MAX_LINE_LEN,inf)!=NULL) {
-    lineno++;
-    len = strlen(buffer);
-    if (buffer[len-1] == '\n') 
-      buffer[--len] = 0;
-    if (buffer[0] != ':')
-      continue;
-    rc = ihex_readrec(&ihex, buffer);
-    if (rc < 0) {
-      avrdude_message(MSG_INFO, "%s: invalid record at line %d of \"%s\"\n",
-              progname, lineno, infile);
-      return -1;
-    }
-    else if (rc != ihex.cksum) {
-      avrdude_message(MSG_INFO, "%s: ERROR: checksum mismatch at line %d of \"%s\"\n",
-              progname, lineno, infile);
-      avrdude_message(MSG_INFO, "%s: checksum=0x%02x, computed checksum=0x%02x\n",
-              progname, ihex.cksum, rc);
-      return -1;
-    }
+  fp->lineno++;
+  fp->datarec = 0;
+  if (len == 0 || line[0] != ':')
+    return 0;
+  rc = ihex_readrec(&ihex, line, len);
+  if (rc < 0) {
+    avrdude_message(MSG_INFO, "%s: invalid record at line %d of \"%s\"\n",
+            progname, fp->lineno, fp->infile);
+    return -1;
+  }
+  else if (rc != ihex.cksum) {
+    avrdude_message(MSG_INFO, "%s: ERROR: checksum mismatch at line %d of \"%s\"\n",
+            progname, fp->lineno, fp->infile);
+    avrdude_message(MSG_INFO, "%s: checksum=0x%02x, computed checksum=0x%02x\n",
+            progname, ihex.cksum, rc);
+    return -1;
+  }
 
-    switch (ihex.rectyp) {
-      case 0: /* data record */
-        if (fileoffset != 0 && baseaddr < fileoffset) {
-          avrdude_message(MSG_INFO, "%s: ERROR: address 0x%04x out of range (below fileoffset 0x%x) at line %d of %s\n",
-                          progname, baseaddr, fileoffset, lineno, infile);
-          return -1;
-        }
-        nextaddr = ihex.loadofs + baseaddr - fileoffset;
-        if (nextaddr + ihex.reclen > bufsize) {
-          avrdude_message(MSG_INFO, "%s: ERROR: address 0x%04x out of range at line %d of %s\n",
-                          progname, nextaddr+ihex.reclen, lineno, infile);
-          return -1;
-        }
-        for (i=0; i<ihex.reclen; i++) {
-          mem->buf[nextaddr+i] = ihex.data[i];
-          mem->tags[nextaddr+i] = TAG_ALLOCATED;
-        }
-        if (nextaddr+ihex.reclen > maxaddr)
-          maxaddr = nextaddr+ihex.reclen;
-        break;
-
-      case 1: /* end of file record */
-        return maxaddr;
-        break;
-
-      case 2: /* extended segment address record */
-        baseaddr = (ihex.data[0] << 8 | ihex.data[1]) << 4;
-        break;
-
-      case 3: /* start segment address record */
-        /* we don't do anything with the start address */
-        break;
-
-      case 4: /* extended linear address record */
-        baseaddr = (ihex.data[0] << 8 | ihex.data[1]) << 16;
-        break;
-
-      case 5: /* start linear address record */
-        /* we don't do anything with the start address */
-        break;
-
-      default:
-        avrdude_message(MSG_INFO, "%s: don't know how to deal with rectype=%d "
-                        "at line %d of %s\n",
-                        progname, ihex.rectyp, lineno, infile);
+  switch (ihex.rectyp) {
+    case 0: /* data record */
+      if (fp->fileoffset != 0 && fp->baseaddr < fp->fileoffset) {
+        avrdude_message(MSG_INFO, "%s: ERROR: address 0x%04x out of range (below fileoffset 0x%x) at line %d of %s\n",
+                        progname, fp->baseaddr, fp->fileoffset, fp->lineno, fp->infile);
         return -1;
-        break;
-    }
+      }
+      nextaddr = ihex.loadofs + fp->baseaddr - fp->fileoffset;
+      if (nextaddr + ihex.reclen > fp->bufsize) {
+        avrdude_message(MSG_INFO, "%s: ERROR: address 0x%04x out of range at line %d of %s\n",
+                        progname, nextaddr+ihex.reclen, fp->lineno, fp->infile);
+        return -1;
+      }
+      memcpy(fp->mem->buf + nextaddr, ihex.data, ihex.reclen);
+      avr_mem_tag_range(fp->mem, nextaddr, ihex.reclen);
+      if (nextaddr+ihex.reclen > fp->maxaddr)
+        fp->maxaddr = nextaddr+ihex.reclen;
+      fp->datarec = 1;
+      fp->recaddr = nextaddr;
+      fp->reclen  = ihex.reclen;
+      break;
 
-  } /* while */
+    case 1: /* end of file record */
+      fp->end = 1;
+      break;
 
-  if (maxaddr == 0) {
+    case 2: /* extended segment address record */
+      fp->baseaddr = (ihex.data[0] << 8 | ihex.data[1]) << 4;
+      break;
+
+    case 3: /* start segment address record */
+      /* we don't do anything with the start address */
+      break;
+
+    case 4: /* extended linear address record */
+      fp->baseaddr = (ihex.data[0] << 8 | ihex.data[1]) << 16;
+      break;
+
+    case 5: /* start linear address record */
+      /* we don't do anything with the start address */
+      break;
+
+    default:
+      avrdude_message(MSG_INFO, "%s: don't know how to deal with rectype=%d "
+                      "at line %d of %s\n",
+                      progname, ihex.rectyp, fp->lineno, fp->infile);
+      return -1;
+      break;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Finish parsing an Intel Hex file.  Returns the maximum memory
+ * address that was written, or -1 if there was no data at all.
+ */
+static int ihex_parse_end(struct fio_parse * fp)
+{
+  if (fp->end)
+    return fp->maxaddr;
+
+  if (fp->maxaddr == 0) {
     avrdude_message(MSG_INFO, "%s: ERROR: No valid record found in Intel Hex "
                     "file \"%s\"\n",
-                    progname, infile);
+                    progname, fp->infile);
 
     return -1;
   }
   else {
     avrdude_message(MSG_INFO, "%s: WARNING: no end of file record found for Intel Hex "
                     "file \"%s\"\n",
-                    progname, infile);
+                    progname, fp->infile);
+
+    return fp->maxaddr;
+  }
+}
+
+
+/*
+ * Intel Hex to binary buffer
+ *
+ * Given the contents 'text' of a file with Intel Hex formated data,
+ * parse the file and lay it out within the memory buffer pointed to
+ * by outbuf.  The size of outbuf, 'bufsize' is honored; if data would
+ * fall outsize of the memory buffer outbuf, an error is generated.
+ *
+ * Return the maximum memory address within 'outbuf' that was written.
+ * If an error occurs, return -1.
+ *
+ * */
+static int ihex2b(char * infile, struct fio_text * text,
+             AVRMEM * mem, int bufsize, unsigned int fileoffset)
+{
+  struct fio_parse fp;
+  const char * line;
+  size_t pos;
+  int len;
+
+  fio_parse_init(&fp, infile, mem, bufsize, fileoffset);
+  pos = 0;
 
-    return maxaddr;
+  while ((line = fio_text_line(text, &pos, &len)) != NULL) {
+    if (ihex_parse_line(&fp, line, len) < 0)
+      return -1;
+    if (fp.end)
+      break;
   }
+
+  return ihex_parse_end(&fp);
 }
 
 static int b2srec(unsigned char * inbuf, int bufsize, 
            int recsize, int startaddr,
            char * outfile, FILE * outf)
 {
-  unsigned char * buf;
+  struct fio_out out;
+  unsigned char hdr[5];
   unsigned int nextaddr;
   int n, nbytes, addr_width;
   int i;
-  unsigned char cksum;
 
-  char * tmpl=0;
+  char * lead;
 
-  if (recsize > 255) {
-    avrdude_message(MSG_INFO, "%s: ERROR: recsize=%d, must be < 256\n",
+  if (recsize < 1 || recsize > 255) {
+    avrdude_message(MSG_INFO, "%s: ERROR: recsize=%d, must be 1..255\n",
             progname, recsize);
     return -1;
   }
-  
+
+  out.f       = outf;
+  out.outfile = outfile;
+  out.len     = 0;
+  out.err     = 0;
+
   nextaddr = startaddr;
-  buf = inbuf;
   nbytes = 0;    
 
-  addr_width = 0;
-
   while (bufsize) {
 
     n = recsize;
@@ -418,18 +696,17 @@ static int b2srec(unsigned char * inbuf, int bufsize,
       n = bufsize;
 
     if (n) {
-      cksum = 0;
       if (nextaddr + n <= 0xffff) {
         addr_width = 2;
-        tmpl="S1%02X%04X";
+        lead = "S1";
       }
       else if (nextaddr + n <= 0xffffff) {
         addr_width = 3;
-        tmpl="S2%02X%06X";
+        lead = "S2";
       }
       else if (nextaddr + n <= 0xffffffff) {
         addr_width = 4;
-        tmpl="S3%02X%08X";
+        lead = "S3";
       }
       else {
         avrdude_message(MSG_INFO, "%s: ERROR: address=%d, out of range\n",
@@ -437,20 +714,15 @@ static int b2srec(unsigned char * inbuf, int bufsize,
         return -1;
       }
 
-      fprintf(outf, tmpl, n + addr_width + 1, nextaddr);
-
-      cksum += n + addr_width + 1;
+      /* the byte count includes address and checksum */
+      if (n > 255 - addr_width - 1)
+        n = 255 - addr_width - 1;
 
+      hdr[0] = n + addr_width + 1;
       for (i=addr_width; i>0; i--) 
-        cksum += (nextaddr >> (i-1) * 8) & 0xff;
-
-      for (i=nextaddr; i<nextaddr + n; i++) {
-        fprintf(outf, "%02X", buf[i]);
-        cksum += buf[i];
-      }
-
-      cksum = 0xff - cksum;
-      fprintf(outf, "%02X\n", cksum);
+        hdr[1 + addr_width - i] = (nextaddr >> (i-1) * 8) & 0xff;
+      fio_out_rec(&out, lead, hdr, 1 + addr_width,
+                  inbuf + (nextaddr - startaddr), n, 1);
 
       nextaddr += n;
       nbytes +=n;
@@ -463,232 +735,206 @@ static int b2srec(unsigned char * inbuf, int bufsize,
   /*-----------------------------------------------------------------
     add the end of record data line
     -----------------------------------------------------------------*/
-  cksum = 0;
-  n = 0;
-  nextaddr = 0;
-
-  if (startaddr <= 0xffff) {
+  if (startaddr <= 0xffff)
     addr_width = 2;
-    tmpl="S9%02X%04X";
-  }
-  else if (startaddr <= 0xffffff) {
+  else if (startaddr <= 0xffffff)
     addr_width = 3;
-    tmpl="S9%02X%06X";
-  }
-  else if (startaddr <= 0xffffffff) {
+  else
     addr_width = 4;
-    tmpl="S9%02X%08X";
-  }
 
-  fprintf(outf, tmpl, n + addr_width + 1, nextaddr);
+  hdr[0] = addr_width + 1;
+  for (i=1; i<=addr_width; i++)
+    hdr[i] = 0;
+  fio_out_rec(&out, "S9", hdr, 1 + addr_width, NULL, 0, 1);
+  fio_out_flush(&out);
 
-  cksum += n + addr_width +1;
-  for (i=addr_width; i>0; i--) 
-    cksum += (nextaddr >> (i - 1) * 8) & 0xff;
-  cksum = 0xff - cksum;
-  fprintf(outf, "%02X\n", cksum);
+  if (out.err)
+    return -1;
 
   return nbytes; 
 }
 
 
-static int srec_readrec(struct ihexrec * srec, char * rec)
+static int srec_readrec(struct ihexrec * srec, const char * rec, int len)
 {
-  int i, j;
-  char buf[8];
-  int offset, len, addr_width;
-  char * e;
-  unsigned char cksum;
-  int rc;
+  unsigned char hdr[5];
+  unsigned char cksum, dummy;
+  int i, addr_width;
 
-  len = strlen(rec);
-  offset = 1;
   cksum = 0;
   addr_width = 2;
 
   /* record type */
-  if (offset + 1 > len) 
+  if (len < 2)
     return -1;
-  srec->rectyp = rec[offset++];
+  srec->rectyp = rec[1];
   if (srec->rectyp == 0x32 || srec->rectyp == 0x38) 
     addr_width = 3;	/* S2,S8-record */
   else if (srec->rectyp == 0x33 || srec->rectyp == 0x37) 
     addr_width = 4;	/* S3,S7-record */
 
-  /* reclen */
-  if (offset + 2 > len) 
-    return -1;
-  for (i=0; i<2; i++) 
-    buf[i] = rec[offset++];
-  buf[i] = 0;
-  srec->reclen = strtoul(buf, &e, 16);
-  cksum += srec->reclen;
-  srec->reclen -= (addr_width+1);
-  if (e == buf || *e != 0) 
-    return -1;
-
-  /* load offset */
-  if (offset + addr_width > len) 
+  /* reclen, load offset */
+  if (len < 2 + 2*(1+addr_width) ||
+      hex_decode(hdr, rec + 2, 1 + addr_width, &cksum) < 0 ||
+      hdr[0] < addr_width + 1)
     return -1;
-  for (i=0; i<addr_width*2; i++) 
-    buf[i] = rec[offset++];
-  buf[i] = 0;
-  srec->loadofs = strtoull(buf, &e, 16);
-  if (e == buf || *e != 0) 
+  srec->reclen = hdr[0] - (addr_width+1);
+  srec->loadofs = 0;
+  for (i=1; i<=addr_width; i++)
+    srec->loadofs = srec->loadofs << 8 | hdr[i];
+
+  /* data, cksum */
+  rec += 2 + 2*(1+addr_width);
+  len -= 2 + 2*(1+addr_width);
+  if (len < 2*srec->reclen + 2 ||
+      hex_decode(srec->data, rec, srec->reclen, &cksum) < 0 ||
+      hex_decode(&srec->cksum, rec + 2*srec->reclen, 1, &dummy) < 0)
     return -1;
 
-  for (i=addr_width; i>0; i--)
-    cksum += (srec->loadofs >> (i - 1) * 8) & 0xff;
-
-  /* data */
-  for (j=0; j<srec->reclen; j++) {
-    if (offset+2  > len) 
-      return -1;
-    for (i=0; i<2; i++) 
-      buf[i] = rec[offset++];
-    buf[i] = 0;
-    srec->data[j] = strtoul(buf, &e, 16);
-    if (e == buf || *e != 0) 
-      return -1;
-    cksum += srec->data[j];
-  }
-
-  /* cksum */
-  if (offset + 2 > len) 
-    return -1;
-  for (i=0; i<2; i++) 
-    buf[i] = rec[offset++];
-  buf[i] = 0;
-  srec->cksum = strtoul(buf, &e, 16);
-  if (e == buf || *e != 0) 
-    return -1;
-
-  rc = 0xff - cksum;
-  return rc;
+  return 0xff - cksum;
 }
 
 
-static int srec2b(char * infile, FILE * inf,
-           AVRMEM * mem, int bufsize, unsigned int fileoffset)
+/*
+ * Parse one line of a Motorola S-Record file, see ihex_parse_line().
+ */
+static int srec_parse_line(struct fio_parse * fp, const char * line, int len)
 {
-  char buffer [ MAX_LINE_LEN ];
-  unsigned int nextaddr, maxaddr;
-  int i;
-  int lineno;
-  int len;
+  unsigned int nextaddr;
   struct ihexrec srec;
   int rc;
-  int reccount;
   unsigned char datarec;
 
   char * msg = 0;
 
-  lineno   = 0;
-  maxaddr  = 0;
-  reccount = 0;
+  fp->lineno++;
+  fp->datarec = 0;
+  if (len == 0 || line[0] != 0x53)
+    return 0;
+  rc = srec_readrec(&srec, line, len);
 
-  while (fgets((char *)buffer,MAX_LINE_LEN,inf)!=NULL) {
-    lineno++;
-    len = strlen(buffer);
-    if (buffer[len-1] == '\n') 
-      buffer[--len] = 0;
-    if (buffer[0] != 0x53)
-      continue;
-    rc = srec_readrec(&srec, buffer);
+  if (rc < 0) {
+    avrdude_message(MSG_INFO, "%s: ERROR: invalid record at line %d of \"%s\"\n",
+            progname, fp->lineno, fp->infile);
+    return -1;
+  }
+  else if (rc != srec.cksum) {
+    avrdude_message(MSG_INFO, "%s: ERROR: checksum mismatch at line %d of \"%s\"\n",
+            progname, fp->lineno, fp->infile);
+    avrdude_message(MSG_INFO, "%s: checksum=0x%02x, computed checksum=0x%02x\n",
+            progname, srec.cksum, rc);
+    return -1;
+  }
 
-    if (rc < 0) {
-      avrdude_message(MSG_INFO, "%s: ERROR: invalid record at line %d of \"%s\"\n",
-              progname, lineno, infile);
+  datarec=0; 
+  switch (srec.rectyp) {
+    case 0x30: /* S0 - header record*/
+      /* skip */
+      break;
+
+    case 0x31: /* S1 - 16 bit address data record */
+      datarec=1;
+      msg="%s: ERROR: address 0x%04x out of range %sat line %d of %s\n";
+      break;
+
+    case 0x32: /* S2 - 24 bit address data record */
+      datarec=1;
+      msg="%s: ERROR: address 0x%06x out of range %sat line %d of %s\n";
+      break;
+
+    case 0x33: /* S3 - 32 bit address data record */
+      datarec=1;
+      msg="%s: ERROR: address 0x%08x out of range %sat line %d of %s\n";
+      break;
+
+    case 0x34: /* S4 - symbol record (LSI extension) */
+      avrdude_message(MSG_INFO, "%s: ERROR: not supported record at line %d of %s\n",
+                      progname, fp->lineno, fp->infile);
+      return -1;
+
+    case 0x35: /* S5 - count of S1,S2 and S3 records previously tx'd */
+      if (srec.loadofs != fp->reccount){
+        avrdude_message(MSG_INFO, "%s: ERROR: count of transmitted data records mismatch "
+                        "at line %d of \"%s\"\n",
+                        progname, fp->lineno, fp->infile);
+        avrdude_message(MSG_INFO, "%s: transmitted data records= %d, expected "
+                "value= %d\n",
+                progname, fp->reccount, srec.loadofs);
+        return -1;
+      }
+      break;
+
+    case 0x37: /* S7 Record - end record for 32 bit address data */
+    case 0x38: /* S8 Record - end record for 24 bit address data */
+    case 0x39: /* S9 Record - end record for 16 bit address data */
+      fp->end = 1;
+      return 0;
+
+    default:
+      avrdude_message(MSG_INFO, "%s: ERROR: don't know how to deal with rectype S%d "
+                      "at line %d of %s\n",
+                      progname, srec.rectyp, fp->lineno, fp->infile);
+      return -1;
+  }
+
+  if (datarec == 1) {
+    nextaddr = srec.loadofs;
+    if (nextaddr < fp->fileoffset) {
+      avrdude_message(MSG_INFO, msg, progname, nextaddr,
+              "(below fileoffset) ",
+              fp->lineno, fp->infile);
       return -1;
     }
-    else if (rc != srec.cksum) {
-      avrdude_message(MSG_INFO, "%s: ERROR: checksum mismatch at line %d of \"%s\"\n",
-              progname, lineno, infile);
-      avrdude_message(MSG_INFO, "%s: checksum=0x%02x, computed checksum=0x%02x\n",
-              progname, srec.cksum, rc);
+    nextaddr -= fp->fileoffset;
+    if (nextaddr + srec.reclen > fp->bufsize) {
+      avrdude_message(MSG_INFO, msg, progname, nextaddr+srec.reclen, "",
+              fp->lineno, fp->infile);
       return -1;
     }
+    memcpy(fp->mem->buf + nextaddr, srec.data, srec.reclen);
+    avr_mem_tag_range(fp->mem, nextaddr, srec.reclen);
+    if (nextaddr+srec.reclen > fp->maxaddr)
+      fp->maxaddr = nextaddr+srec.reclen;
+    fp->reccount++;      
+    fp->datarec = 1;
+    fp->recaddr = nextaddr;
+    fp->reclen  = srec.reclen;
+  }
 
-    datarec=0; 
-    switch (srec.rectyp) {
-      case 0x30: /* S0 - header record*/
-        /* skip */
-        break;
-
-      case 0x31: /* S1 - 16 bit address data record */
-        datarec=1;
-        msg="%s: ERROR: address 0x%04x out of range %sat line %d of %s\n";
-        break;
-
-      case 0x32: /* S2 - 24 bit address data record */
-        datarec=1;
-        msg="%s: ERROR: address 0x%06x out of range %sat line %d of %s\n";
-        break;
-
-      case 0x33: /* S3 - 32 bit address data record */
-        datarec=1;
-        msg="%s: ERROR: address 0x%08x out of range %sat line %d of %s\n";
-        break;
-
-      case 0x34: /* S4 - symbol record (LSI extension) */
-        avrdude_message(MSG_INFO, "%s: ERROR: not supported record at line %d of %s\n",
-                        progname, lineno, infile);
-        return -1;
+  return 0;
+}
 
-      case 0x35: /* S5 - count of S1,S2 and S3 records previously tx'd */
-        if (srec.loadofs != reccount){
-          avrdude_message(MSG_INFO, "%s: ERROR: count of transmitted data records mismatch "
-                          "at line %d of \"%s\"\n",
-                          progname, lineno, infile);
-          avrdude_message(MSG_INFO, "%s: transmitted data records= %d, expected "
-                  "value= %d\n",
-                  progname, reccount, srec.loadofs);
-          return -1;
-        }
-        break;
 
-      case 0x37: /* S7 Record - end record for 32 bit address data */
-      case 0x38: /* S8 Record - end record for 24 bit address data */
-      case 0x39: /* S9 Record - end record for 16 bit address data */
-        return maxaddr;
+static int srec_parse_end(struct fio_parse * fp)
+{
+  if (!fp->end)
+    avrdude_message(MSG_INFO, "%s: WARNING: no end of file record found for Motorola S-Records "
+                    "file \"%s\"\n",
+                    progname, fp->infile);
 
-      default:
-        avrdude_message(MSG_INFO, "%s: ERROR: don't know how to deal with rectype S%d "
-                        "at line %d of %s\n",
-                        progname, srec.rectyp, lineno, infile);
-        return -1;
-    }
+  return fp->maxaddr;
+}
 
-    if (datarec == 1) {
-      nextaddr = srec.loadofs;
-      if (nextaddr < fileoffset) {
-        avrdude_message(MSG_INFO, msg, progname, nextaddr,
-                "(below fileoffset) ",
-                lineno, infile);
-        return -1;
-      }
-      nextaddr -= fileoffset;
-      if (nextaddr + srec.reclen > bufsize) {
-        avrdude_message(MSG_INFO, msg, progname, nextaddr+srec.reclen, "",
-                lineno, infile);
-        return -1;
-      }
-      for (i=0; i<srec.reclen; i++) {
-        mem->buf[nextaddr+i] = srec.data[i];
-        mem->tags[nextaddr+i] = TAG_ALLOCATED;
-      }
-      if (nextaddr+srec.reclen > maxaddr)
-        maxaddr = nextaddr+srec.reclen;
-      reccount++;      
-    }
 
-  }
+static int srec2b(char * infile, struct fio_text * text,
+           AVRMEM * mem, int bufsize, unsigned int fileoffset)
+{
+  struct fio_parse fp;
+  const char * line;
+  size_t pos;
+  int len;
 
-  avrdude_message(MSG_INFO, "%s: WARNING: no end of file record found for Motorola S-Records "
-                  "file \"%s\"\n",
-                  progname, infile);
+  fio_parse_init(&fp, infile, mem, bufsize, fileoffset);
+  pos = 0;
 
-  return maxaddr;
+  while ((line = fio_text_line(text, &pos, &len)) != NULL) {
+    if (srec_parse_line(&fp, line, len) < 0)
+      return -1;
+    if (fp.end)
+      break;
+  }
+
+  return srec_parse_end(&fp);
 }
 
 #ifdef HAVE_LIBELF
@@ -780,7 +1026,8 @@ static int elf_mem_limits(AVRMEM *mem, struct avrpart * p,
       *lowbound = 0x810000;
       *highbound = 0x81ffff;      /* max 64 KiB */
       *fileoff = 0;
-    } else if (strcmp(mem->desc, "lfuse") == 0) {
+    } else if (strcmp(mem->desc, "fuse") == 0 ||
+               strcmp(mem->desc, "lfuse") == 0) {
       *lowbound = 0x820000;
       *highbound = 0x82ffff;
       *fileoff = 0;
@@ -802,6 +1049,14 @@ static int elf_mem_limits(AVRMEM *mem, struct avrpart * p,
       *lowbound = 0x830000;
       *highbound = 0x83ffff;
       *fileoff = 0;
+    } else if (strcmp(mem->desc, "signature") == 0) {
+      *lowbound = 0x840000;
+      *highbound = 0x84ffff;
+      *fileoff = 0;
+    } else if (strcmp(mem->desc, "usersig") == 0) {
+      *lowbound = 0x850000;
+      *highbound = 0x85ffff;
+      *fileoff = 0;
     } else {
       rv = -1;
     }
@@ -811,19 +1066,27 @@ static int elf_mem_limits(AVRMEM *mem, struct avrpart * p,
 }
 
 
-static int elf2b(char * infile, FILE * inf,
-                 AVRMEM * mem, struct avrpart * p,
-                 int bufsize, unsigned int fileoffset)
-{
-  Elf *e;
-  int rv = -1;
-  unsigned int low, high, foff;
+/*
+ * A memory region that an ELF file is being loaded into, see
+ * elf_load().
+ */
+struct elf_target {
+  AVRMEM *      mem;
+  unsigned int  low, high;      /* LMA range of the memory */
+  unsigned int  foff;           /* byte to take from a fuse section */
+  int           rv;             /* highest offset loaded + 1, or -1 */
+};
 
-  if (elf_mem_limits(mem, p, &low, &high, &foff) != 0) {
-    avrdude_message(MSG_INFO, "%s: ERROR: Cannot handle \"%s\" memory region from ELF file\n",
-                    progname, mem->desc);
+
+/*
+ * Set up 't' for loading memory 'mem'.  Returns -1 if ELF files
+ * cannot carry data for this memory.
+ */
+static int elf_target_init(struct elf_target * t, AVRMEM * mem,
+                           struct avrpart * p)
+{
+  if (elf_mem_limits(mem, p, &t->low, &t->high, &t->foff) != 0)
     return -1;
-  }
 
   /*
    * The Xmega memory regions for "boot", "application", and
@@ -844,10 +1107,90 @@ static int elf2b(char * infile, FILE * inf,
       return -1;
     }
     /* The config file offsets are PDI offsets, rebase to 0. */
-    low = mem->offset - flashmem->offset;
-    high = low + mem->size - 1;
+    t->low = mem->offset - flashmem->offset;
+    t->high = t->low + mem->size - 1;
   }
 
+  t->mem = mem;
+  t->rv = -1;
+
+  return 0;
+}
+
+
+/*
+ * Copy the data of section 's' at 'lma' into target 't'.
+ */
+static void elf_load_section(struct elf_target * t, Elf_Scn * s,
+                             Elf32_Shdr * sh, const char * sname,
+                             unsigned int lma)
+{
+  AVRMEM * mem = t->mem;
+
+  /*
+   * 1-byte sized memory regions are special: they are used for fuse
+   * bits, where multiple regions (in the config file) map to a
+   * single, larger region in the ELF file (e.g. "lfuse", "hfuse",
+   * and "efuse" all map to ".fuse").  We silently accept a larger
+   * ELF file region for these, and extract the actual byte to write
+   * from it, using the "foff" offset obtained above.
+   */
+  if (mem->size != 1 &&
+      sh->sh_size > mem->size) {
+    avrdude_message(MSG_INFO, "%s: ERROR: section \"%s\" does not fit into \"%s\" memory:\n"
+                    "    0x%x + %u > %u\n",
+                    progname, sname, mem->desc,
+                    lma, sh->sh_size, mem->size);
+    return;
+  }
+
+  Elf_Data *d = NULL;
+  while ((d = elf_getdata(s, d)) != NULL) {
+    avrdude_message(MSG_NOTICE2, "    Data block: d_buf %p, d_off 0x%x, d_size %d\n",
+                    d->d_buf, (unsigned int)d->d_off, d->d_size);
+    if (mem->size == 1) {
+      if (d->d_off != 0) {
+        avrdude_message(MSG_INFO, "%s: ERROR: unexpected data block at offset != 0\n",
+                        progname);
+      } else if (t->foff >= d->d_size) {
+        avrdude_message(MSG_INFO, "%s: ERROR: ELF file section does not contain byte at offset %d\n",
+                        progname, t->foff);
+      } else {
+        avrdude_message(MSG_NOTICE2, "    Extracting one byte from file offset %d\n",
+                        t->foff);
+        mem->buf[0] = ((unsigned char *)d->d_buf)[t->foff];
+        avr_mem_tag_range(mem, 0, 1);
+        t->rv = 1;
+      }
+    } else {
+      unsigned int idx;
+
+      idx = lma - t->low + d->d_off;
+      if ((int)(idx + d->d_size) > t->rv)
+        t->rv = idx + d->d_size;
+      avrdude_message(MSG_DEBUG, "    Writing %d bytes to mem offset 0x%x\n",
+                      d->d_size, idx);
+      memcpy(mem->buf + idx, d->d_buf, d->d_size);
+      avr_mem_tag_range(mem, idx, d->d_size);
+    }
+  }
+}
+
+
+/*
+ * Load the ELF file 'inf' into the 'nt' memories described by 't',
+ * walking its program headers and sections once.  Each section goes
+ * to every memory whose address range holds it.  Returns -1 if the
+ * file cannot be used, 0 otherwise; what has been loaded into each
+ * memory is recorded in its rv.
+ */
+static int elf_load(char * infile, FILE * inf, struct avrpart * p,
+                    struct elf_target * t, int nt)
+{
+  Elf *e;
+  int rv = -1;
+  int j, found;
+
   if (elf_version(EV_CURRENT) == EV_NONE) {
     avrdude_message(MSG_INFO, "%s: ERROR: ELF library initialization failed: %s\n",
                     progname, elf_errmsg(-1));
@@ -971,67 +1314,46 @@ static int elf2b(char * infile, FILE * inf,
       avrdude_message(MSG_NOTICE2, "%s: Found section \"%s\", LMA 0x%x, sh_size %u\n",
                       progname, sname, lma, sh->sh_size);
 
-      if (lma >= low &&
-          lma + sh->sh_size < high) {
-        /* OK */
-      } else {
-        avrdude_message(MSG_NOTICE2, "    => skipping, inappropriate for \"%s\" memory region\n",
-                        mem->desc);
-        continue;
-      }
-      /*
-       * 1-byte sized memory regions are special: they are used for fuse
-       * bits, where multiple regions (in the config file) map to a
-       * single, larger region in the ELF file (e.g. "lfuse", "hfuse",
-       * and "efuse" all map to ".fuse").  We silently accept a larger
-       * ELF file region for these, and extract the actual byte to write
-       * from it, using the "foff" offset obtained above.
-       */
-      if (mem->size != 1 &&
-          sh->sh_size > mem->size) {
-        avrdude_message(MSG_INFO, "%s: ERROR: section \"%s\" does not fit into \"%s\" memory:\n"
-                        "    0x%x + %u > %u\n",
-                        progname, sname, mem->desc,
-                        lma, sh->sh_size, mem->size);
-        continue;
-      }
-
-      Elf_Data *d = NULL;
-      while ((d = elf_getdata(s, d)) != NULL) {
-        avrdude_message(MSG_NOTICE2, "    Data block: d_buf %p, d_off 0x%x, d_size %d\n",
-                        d->d_buf, (unsigned int)d->d_off, d->d_size);
-        if (mem->size == 1) {
-          if (d->d_off != 0) {
-            avrdude_message(MSG_INFO, "%s: ERROR: unexpected data block at offset != 0\n",
-                            progname);
-          } else if (foff >= d->d_size) {
-            avrdude_message(MSG_INFO, "%s: ERROR: ELF file section does not contain byte at offset %d\n",
-                            progname, foff);
-          } else {
-            avrdude_message(MSG_NOTICE2, "    Extracting one byte from file offset %d\n",
-                            foff);
-            mem->buf[0] = ((unsigned char *)d->d_buf)[foff];
-            mem->tags[0] = TAG_ALLOCATED;
-            rv = 1;
-          }
-        } else {
-          unsigned int idx;
-
-          idx = lma - low + d->d_off;
-          if ((int)(idx + d->d_size) > rv)
-            rv = idx + d->d_size;
-          avrdude_message(MSG_DEBUG, "    Writing %d bytes to mem offset 0x%x\n",
-                          d->d_size, idx);
-          memcpy(mem->buf + idx, d->d_buf, d->d_size);
-          memset(mem->tags + idx, TAG_ALLOCATED, d->d_size);
+      for (j = found = 0; j < nt; j++) {
+        if (lma >= t[j].low &&
+            lma + sh->sh_size < t[j].high) {
+          elf_load_section(t + j, s, sh, sname, lma);
+          found = 1;
         }
       }
+      if (!found) {
+        if (nt == 1)
+          avrdude_message(MSG_NOTICE2, "    => skipping, inappropriate for \"%s\" memory region\n",
+                          t[0].mem->desc);
+        else
+          avrdude_message(MSG_NOTICE2, "    => skipping, no memory region for it\n");
+      }
     }
   }
+  rv = 0;
 done:
   (void)elf_end(e);
   return rv;
 }
+
+
+static int elf2b(char * infile, FILE * inf,
+                 AVRMEM * mem, struct avrpart * p,
+                 int bufsize, unsigned int fileoffset)
+{
+  struct elf_target t;
+
+  if (elf_target_init(&t, mem, p) != 0) {
+    avrdude_message(MSG_INFO, "%s: ERROR: Cannot handle \"%s\" memory region from ELF file\n",
+                    progname, mem->desc);
+    return -1;
+  }
+
+  if (elf_load(infile, inf, p, &t, 1) < 0)
+    return -1;
+
+  return t.rv;
+}
 #endif  /* HAVE_LIBELF */
 
 /*
@@ -1084,7 +1406,7 @@ static int fileio_rbin(struct fioparms * fio,
     case FIO_READ:
       rc = fread(buf, 1, size, f);
       if (rc > 0)
-        memset(mem->tags, TAG_ALLOCATED, rc);
+        avr_mem_tag_range(mem, 0, rc);
       break;
     case FIO_WRITE:
       rc = fwrite(buf, 1, size, f);
@@ -1130,7 +1452,7 @@ static int fileio_imm(struct fioparms * fio,
           return -1;
         }
         mem->buf[loc] = b;
-        mem->tags[loc++] = TAG_ALLOCATED;
+        avr_mem_tag_range(mem, loc++, 1);
         p = strtok(NULL, " ,");
         rc = loc;
       }
@@ -1153,20 +1475,22 @@ static int fileio_imm(struct fioparms * fio,
 
 
 static int fileio_ihex(struct fioparms * fio, 
-                  char * filename, FILE * f, AVRMEM * mem, int size)
+                  char * filename, FILE * f, struct fio_text * text,
+                  AVRMEM * mem, int size)
 {
   int rc;
 
   switch (fio->op) {
     case FIO_WRITE:
-      rc = b2ihex(mem->buf, size, 32, fio->fileoffset, filename, f);
+      rc = b2ihex(mem->buf, size, fio_recsize(),
+                  fio->fileoffset, filename, f);
       if (rc < 0) {
         return -1;
       }
       break;
 
     case FIO_READ:
-      rc = ihex2b(filename, f, mem, size, fio->fileoffset);
+      rc = ihex2b(filename, text, mem, size, fio->fileoffset);
       if (rc < 0)
         return -1;
       break;
@@ -1183,20 +1507,22 @@ static int fileio_ihex(struct fioparms * fio,
 
 
 static int fileio_srec(struct fioparms * fio,
-                  char * filename, FILE * f, AVRMEM * mem, int size)
+                  char * filename, FILE * f, struct fio_text * text,
+                  AVRMEM * mem, int size)
 {
   int rc;
 
   switch (fio->op) {
     case FIO_WRITE:
-      rc = b2srec(mem->buf, size, 32, fio->fileoffset, filename, f);
+      rc = b2srec(mem->buf, size, fio_recsize(),
+                  fio->fileoffset, filename, f);
       if (rc < 0) {
         return -1;
       }
       break;
 
     case FIO_READ:
-      rc = srec2b(filename, f, mem, size, fio->fileoffset);
+      rc = srec2b(filename, text, mem, size, fio->fileoffset);
       if (rc < 0)
         return -1;
       break;
@@ -1360,92 +1686,63 @@ int fileio_setparms(int op, struct fioparms * fp,
 
 
 
-static int fmt_autodetect(char * fname)
+static int fmt_autodetect(struct fio_text * text)
 {
-  FILE * f;
-  unsigned char buf[MAX_LINE_LEN];
+  const unsigned char * buf;
+  size_t pos;
   int i;
   int len;
-  int found;
-  int first = 1;
-
-#if defined(WIN32NATIVE)
-  f = fopen(fname, "r");
-#else
-  f = fopen(fname, "rb");
-#endif
-  if (f == NULL) {
-    avrdude_message(MSG_INFO, "%s: error opening %s: %s\n",
-            progname, fname, strerror(errno));
-    return -1;
-  }
 
-  while (fgets((char *)buf, MAX_LINE_LEN, f)!=NULL) {
-    /* check for ELF file */
-    if (first &&
-        (buf[0] == 0177 && buf[1] == 'E' &&
-         buf[2] == 'L' && buf[3] == 'F')) {
-      fclose(f);
-      return FMT_ELF;
-    }
-
-    buf[MAX_LINE_LEN-1] = 0;
-    len = strlen((char *)buf);
-    if (buf[len-1] == '\n')
-      buf[--len] = 0;
+  /* check for ELF file */
+  if (text->len >= 4 && memcmp(text->buf, "\177ELF", 4) == 0)
+    return FMT_ELF;
 
+  pos = 0;
+  while ((buf = (const unsigned char *)fio_text_line(text, &pos, &len)) != NULL) {
     /* check for binary data */
-    found = 0;
     for (i=0; i<len; i++) {
-      if (buf[i] > 127) {
-        found = 1;
-        break;
-      }
-    }
-    if (found) {
-      fclose(f);
-      return FMT_RBIN;
+      if (buf[i] > 127)
+        return FMT_RBIN;
     }
 
     /* check for lines that look like intel hex */
-    if ((buf[0] == ':') && (len >= 11)) {
-      found = 1;
-      for (i=1; i<len; i++) {
-        if (!isxdigit(buf[1])) {
-          found = 0;
-          break;
-        }
-      }
-      if (found) {
-        fclose(f);
-        return FMT_IHEX;
-      }
-    }
+    if ((buf[0] == ':') && (len >= 11) && isxdigit(buf[1]))
+      return FMT_IHEX;
 
     /* check for lines that look like motorola s-record */
-    if ((buf[0] == 'S') && (len >= 10) && isdigit(buf[1])) {
-      found = 1;
-      for (i=1; i<len; i++) {
-        if (!isxdigit(buf[1])) {
-          found = 0;
-          break;
-        }
-      }
-      if (found) {
-        fclose(f);
-        return FMT_SREC;
-      }
-    }
-
-    first = 0;
+    if ((buf[0] == 'S') && (len >= 10) && isdigit(buf[1]))
+      return FMT_SREC;
   }
 
-  fclose(f);
   return -1;
 }
 
 
 
+/*
+ * Size of the data that has been read into 'mem', given the highest
+ * address 'rc' the parser saw.
+ */
+static int fio_read_size(AVRMEM * mem, int rc)
+{
+  if (rc > 0) {
+    if (strcasecmp(mem->desc, "flash") == 0 ||
+        strcasecmp(mem->desc, "application") == 0 ||
+        strcasecmp(mem->desc, "apptable") == 0 ||
+        strcasecmp(mem->desc, "boot") == 0) {
+      /*
+       * if we are reading flash, just mark the size as being the
+       * highest non-0xff byte
+       */
+      rc = avr_mem_hiaddr(mem);
+    }
+  }
+
+  return rc;
+}
+
+
+
 int fileio(int op, char * filename, FILEFMT format, 
              struct avrpart * p, char * memtype, int size)
 {
@@ -1453,6 +1750,7 @@ int fileio(int op, char * filename, FILEFMT format,
   FILE * f;
   char * fname;
   struct fioparms fio;
+  struct fio_text text;
   AVRMEM * mem;
   int using_stdio;
 
@@ -1473,10 +1771,11 @@ int fileio(int op, char * filename, FILEFMT format,
   if (fio.op == FIO_READ) {
     /* 0xff fill unspecified memory */
     memset(mem->buf, 0xff, size);
+    avr_mem_clear_tags(mem);
   }
-  memset(mem->tags, 0, size);
 
   using_stdio = 0;
+  memset(&text, 0, sizeof(text));
 
   if (strcmp(filename, "-")==0) {
     if (fio.op == FIO_READ) {
@@ -1504,14 +1803,41 @@ int fileio(int op, char * filename, FILEFMT format,
       return -1;
     }
 
-    format_detect = fmt_autodetect(fname);
+    /*
+     * Open the file only once: the text read for detection is parsed
+     * right away if it turns out to be Intel Hex or S-Records.
+     */
+    f = fopen(fname, "rb");
+    if (f == NULL) {
+      avrdude_message(MSG_INFO, "%s: error opening %s: %s\n",
+                      progname, fname, strerror(errno));
+      return -1;
+    }
+    if (fio_text_load(fname, f, &text) < 0) {
+      fclose(f);
+      return -1;
+    }
+
+    format_detect = fmt_autodetect(&text);
     if (format_detect < 0) {
       avrdude_message(MSG_INFO, "%s: can't determine file format for %s, specify explicitly\n",
                       progname, fname);
+      fio_text_free(&text);
+      fclose(f);
       return -1;
     }
     format = format_detect;
 
+    if (fio.op != FIO_READ) {
+      fio_text_free(&text);
+      fclose(f);
+      f = NULL;
+    }
+    else if (format != FMT_IHEX && format != FMT_SREC) {
+      fio_text_free(&text);
+      rewind(f);
+    }
+
     if (quell_progress < 2) {
       avrdude_message(MSG_INFO, "%s: %s file %s auto detected as %s\n",
               progname, fio.iodesc, fname, fmtstr(format));
@@ -1534,7 +1860,7 @@ int fileio(int op, char * filename, FILEFMT format,
 #endif
 
   if (format != FMT_IMM) {
-    if (!using_stdio) {
+    if (!using_stdio && f == NULL) {
       f = fopen(fname, fio.mode);
       if (f == NULL) {
         avrdude_message(MSG_INFO, "%s: can't open %s file %s: %s\n",
@@ -1544,13 +1870,20 @@ int fileio(int op, char * filename, FILEFMT format,
     }
   }
 
+  if (fio.op == FIO_READ && (format == FMT_IHEX || format == FMT_SREC) &&
+      text.buf == NULL && fio_text_load(fname, f, &text) < 0) {
+    if (!using_stdio)
+      fclose(f);
+    return -1;
+  }
+
   switch (format) {
     case FMT_IHEX:
-      rc = fileio_ihex(&fio, fname, f, mem, size);
+      rc = fileio_ihex(&fio, fname, f, &text, mem, size);
       break;
 
     case FMT_SREC:
-      rc = fileio_srec(&fio, fname, f, mem, size);
+      rc = fileio_srec(&fio, fname, f, &text, mem, size);
       break;
 
     case FMT_RBIN:
@@ -1585,18 +1918,9 @@ int fileio(int op, char * filename, FILEFMT format,
       return -1;
   }
 
-  if (rc > 0) {
-    if ((op == FIO_READ) && (strcasecmp(mem->desc, "flash") == 0 ||
-                             strcasecmp(mem->desc, "application") == 0 ||
-                             strcasecmp(mem->desc, "apptable") == 0 ||
-                             strcasecmp(mem->desc, "boot") == 0)) {
-      /*
-       * if we are reading flash, just mark the size as being the
-       * highest non-0xff byte
-       */
-      rc = avr_mem_hiaddr(mem);
-    }
-  }
+  if (op == FIO_READ)
+    rc = fio_read_size(mem, rc);
+  fio_text_free(&text);
   if (format != FMT_IMM && !using_stdio) {
     fclose(f);
   }
@@ -1604,3 +1928,379 @@ int fileio(int op, char * filename, FILEFMT format,
   return rc;
 }
 
+
+
+/*
+ * Read every memory of p that an ELF file holds data for, walking the
+ * file only once: flash, eeprom, fuses, lock bits and the user
+ * signature.  The Xmega flash sub-regions are covered by "flash", and
+ * the signature is left alone, as it is what has been read from the
+ * device.  The memories loaded and the size of their data are
+ * returned in mems[] and sizes[], which have room for nmax entries.
+ * Returns the number of memories loaded, or -1 on error.
+ */
+int fileio_all(char * filename, FILEFMT format, struct avrpart * p,
+               AVRMEM ** mems, int * sizes, int nmax)
+{
+#ifdef HAVE_LIBELF
+  struct elf_target * t;
+  LNODEID ln;
+  AVRMEM * m;
+  FILE * f;
+  char * fname, magic[4];
+  int nt, n, i, using_stdio;
+
+  using_stdio = strcmp(filename, "-") == 0;
+  if (using_stdio) {
+    if (format == FMT_AUTO) {
+      avrdude_message(MSG_INFO, "%s: can't auto detect file format when using stdin/out.\n"
+                      "%s  Please specify a file format and try again.\n",
+                      progname, progbuf);
+      return -1;
+    }
+    fname = "<stdin>";
+    f = stdin;
+  }
+  else {
+    fname = filename;
+    f = fopen(fname, "rb");
+    if (f == NULL) {
+      avrdude_message(MSG_INFO, "%s: can't open input file %s: %s\n",
+              progname, fname, strerror(errno));
+      return -1;
+    }
+    if (format == FMT_AUTO) {
+      if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+          memcmp(magic, "\177ELF", 4) == 0)
+        format = FMT_ELF;
+      rewind(f);
+      if (format == FMT_ELF && quell_progress < 2)
+        avrdude_message(MSG_INFO, "%s: input file %s auto detected as %s\n",
+                        progname, fname, fmtstr(format));
+    }
+  }
+
+  if (format != FMT_ELF) {
+    avrdude_message(MSG_INFO, "%s: memory type \"all\" needs an ELF input file, "
+                    "%s is not one\n",
+                    progname, fname);
+    if (!using_stdio)
+      fclose(f);
+    return -1;
+  }
+
+  t = calloc(lsize(p->mem) + 1, sizeof(*t));
+  if (t == NULL) {
+    avrdude_message(MSG_INFO, "%s: out of memory\n", progname);
+    if (!using_stdio)
+      fclose(f);
+    return -1;
+  }
+
+  for (nt = 0, ln = lfirst(p->mem); ln; ln = lnext(ln)) {
+    m = ldata(ln);
+    if (strcmp(m->desc, "boot") == 0 ||
+        strcmp(m->desc, "application") == 0 ||
+        strcmp(m->desc, "apptable") == 0 ||
+        strcmp(m->desc, "signature") == 0 ||
+        m->buf == NULL)
+      continue;
+    if (elf_target_init(t + nt, m, p) != 0)
+      continue;
+    /* 0xff fill unspecified memory */
+    memset(m->buf, 0xff, m->size);
+    avr_mem_clear_tags(m);
+    nt++;
+  }
+
+  n = -1;
+  if (elf_load(fname, f, p, t, nt) == 0) {
+    for (n = i = 0; i < nt && n < nmax; i++) {
+      if (t[i].rv <= 0)
+        continue;
+      mems[n] = t[i].mem;
+      sizes[n] = fio_read_size(t[i].mem, t[i].rv);
+      n++;
+    }
+  }
+
+  free(t);
+  if (!using_stdio)
+    fclose(f);
+
+  return n;
+#else
+  avrdude_message(MSG_INFO, "%s: can't handle ELF file %s, "
+                  "ELF file support was not compiled in\n",
+                  progname, filename);
+  return -1;
+#endif
+}
+
+
+/*
+ * Streaming input: an Intel Hex or S-Record file that is parsed while
+ * its memory is being written (see avr_write_stream()).  The writer
+ * asks for everything below an address to be complete, and only as
+ * many lines are read as are needed for that.  Records are expected
+ * in ascending address order, so the data below the start of the
+ * latest data record is taken as complete.  Records that go back into
+ * data the writer has already consumed, i. e. written or skipped over,
+ * are remembered, so the writer can write these pages (again).
+ */
+struct fileio_stream {
+  struct fio_parse  parse;
+  FILEFMT           format;
+  FILE *            f;
+  int               using_stdio;
+  char *            line;
+  int               linesize;
+  unsigned int      ready;      /* data below is complete */
+  unsigned int      consumed;   /* data below has been written or skipped */
+  unsigned int      redo_lo;    /* range below 'consumed' that */
+  unsigned int      redo_hi;    /*   changed after being written */
+  int               eof;
+  int               rc;         /* result of the parser at eof */
+};
+
+
+/*
+ * Tell whether 'filename' is worth streaming: Intel Hex or S-Records
+ * coming from stdin or a pipe, where the end of the input may be some
+ * time away.
+ */
+int fileio_is_stream(char * filename, FILEFMT format)
+{
+  if (format != FMT_IHEX && format != FMT_SREC)
+    return 0;
+
+  if (strcmp(filename, "-") == 0)
+    return 1;
+
+#if defined(HAVE_SYS_STAT_H) && !defined(WIN32NATIVE)
+  {
+    struct stat st;
+
+    if (stat(filename, &st) == 0 &&
+        (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode)))
+      return 1;
+  }
+#endif
+
+  return 0;
+}
+
+
+FILEIO_STREAM * fileio_stream_open(char * filename, FILEFMT format,
+                                   struct avrpart * p, char * memtype)
+{
+  FILEIO_STREAM * s;
+  struct fioparms fio;
+  AVRMEM * mem;
+
+  if (format != FMT_IHEX && format != FMT_SREC) {
+    avrdude_message(MSG_INFO, "%s: can't stream %s files\n",
+                    progname, fmtstr(format));
+    return NULL;
+  }
+
+  mem = avr_locate_mem(p, memtype);
+  if (mem == NULL) {
+    avrdude_message(MSG_INFO, "fileio_stream_open(): memory type \"%s\" not configured for device \"%s\"\n",
+                    memtype, p->desc);
+    return NULL;
+  }
+
+  if (fileio_setparms(FIO_READ, &fio, p, mem) < 0)
+    return NULL;
+
+  s = calloc(1, sizeof(*s));
+  if (s == NULL) {
+    avrdude_message(MSG_INFO, "%s: out of memory\n", progname);
+    return NULL;
+  }
+
+  if (strcmp(filename, "-") == 0) {
+    filename = "<stdin>";
+    s->f = stdin;
+    s->using_stdio = 1;
+  }
+  else {
+    s->f = fopen(filename, fio.mode);
+    if (s->f == NULL) {
+      avrdude_message(MSG_INFO, "%s: can't open %s file %s: %s\n",
+              progname, fio.iodesc, filename, strerror(errno));
+      free(s);
+      return NULL;
+    }
+  }
+
+  /* 0xff fill unspecified memory */
+  memset(mem->buf, 0xff, mem->size);
+  avr_mem_clear_tags(mem);
+
+  fio_parse_init(&s->parse, filename, mem, mem->size, fio.fileoffset);
+  s->format = format;
+
+  return s;
+}
+
+
+/*
+ * Read the next line of the stream into s->line.  Returns 1 if there
+ * is a line, 0 at the end of the input, and -1 on errors.
+ */
+static int fio_stream_line(FILEIO_STREAM * s, int * len)
+{
+  char * p;
+  int n = 0;
+
+  for (;;) {
+    if (s->linesize - n < 2) {
+      p = realloc(s->line, s->linesize? 2*s->linesize: 1024);
+      if (p == NULL) {
+        avrdude_message(MSG_INFO, "%s: out of memory\n", progname);
+        return -1;
+      }
+      s->line = p;
+      s->linesize = s->linesize? 2*s->linesize: 1024;
+    }
+    if (fgets(s->line + n, s->linesize - n, s->f) == NULL)
+      break;
+    n += strlen(s->line + n);
+    if (n > 0 && s->line[n-1] == '\n') {
+      *len = n - 1;
+      return 1;
+    }
+  }
+
+  if (ferror(s->f)) {
+    avrdude_message(MSG_INFO, "%s: error reading \"%s\": %s\n",
+                    progname, s->parse.infile, strerror(errno));
+    return -1;
+  }
+
+  *len = n;
+  return n > 0;
+}
+
+
+/*
+ * Parse the input until all data below 'addr' is complete.  Returns
+ * the address below which the data is complete.  This is at least
+ * 'addr', unless the input has ended, in which case it is the end of
+ * the data.  Returns -1 if the input could not be parsed.
+ */
+int fileio_stream_fill(FILEIO_STREAM * s, unsigned int addr)
+{
+  struct fio_parse * fp = &s->parse;
+  unsigned int hi;
+  int rc, len;
+
+  while (!s->eof && s->ready < addr) {
+    if ((rc = fio_stream_line(s, &len)) < 0) {
+      s->eof = 1;
+      s->rc = -1;
+      break;
+    }
+    if (rc == 0) {
+      s->eof = 1;
+      s->rc = s->format == FMT_IHEX? ihex_parse_end(fp): srec_parse_end(fp);
+      break;
+    }
+
+    if (s->format == FMT_IHEX)
+      rc = ihex_parse_line(fp, s->line, len);
+    else
+      rc = srec_parse_line(fp, s->line, len);
+    if (rc < 0) {
+      s->eof = 1;
+      s->rc = -1;
+      break;
+    }
+
+    if (fp->datarec && fp->reclen > 0) {
+      if (fp->recaddr < s->consumed) {
+        /* out of order, into data that has already been written */
+        hi = fp->recaddr + fp->reclen;
+        if (hi > s->consumed)
+          hi = s->consumed;
+        if (s->redo_hi == 0 || fp->recaddr < s->redo_lo)
+          s->redo_lo = fp->recaddr;
+        if (hi > s->redo_hi)
+          s->redo_hi = hi;
+      }
+      if (fp->recaddr > s->ready)
+        s->ready = fp->recaddr;
+    }
+
+    if (fp->end) {
+      s->eof = 1;
+      s->rc = fp->maxaddr;
+    }
+  }
+
+  if (s->eof) {
+    if (s->rc < 0)
+      return -1;
+    s->ready = fp->maxaddr;
+  }
+
+  return s->ready;
+}
+
+
+int fileio_stream_eof(FILEIO_STREAM * s)
+{
+  return s->eof;
+}
+
+
+/*
+ * The writer has written all data below 'addr', or has moved past it
+ * and will not look at it again.
+ */
+void fileio_stream_consumed(FILEIO_STREAM * s, unsigned int addr)
+{
+  if (addr > s->consumed)
+    s->consumed = addr;
+}
+
+
+/*
+ * Get the range of data that changed after it had been written, if
+ * any.  Returns 1 if there is such a range, and forgets about it.
+ */
+int fileio_stream_redo(FILEIO_STREAM * s, unsigned int * lo, unsigned int * hi)
+{
+  if (s->redo_hi == 0)
+    return 0;
+
+  *lo = s->redo_lo;
+  *hi = s->redo_hi;
+  s->redo_lo = s->redo_hi = 0;
+
+  return 1;
+}
+
+
+/*
+ * Close the stream.  Returns what fileio() would have returned for
+ * the input, or -1 if it has not been read completely.
+ */
+int fileio_stream_close(FILEIO_STREAM * s)
+{
+  int rc;
+
+  if (s->eof && s->rc >= 0)
+    rc = fio_read_size(s->parse.mem, s->rc);
+  else
+    rc = -1;
+
+  if (!s->using_stdio)
+    fclose(s->f);
+  free(s->line);
+  free(s);
+
+  return rc;
+}
@@ -122,22 +122,9 @@ void ft245r_initpgm(PROGRAMMER * pgm) {
 
 #include <pthread.h>
 
-#ifdef __APPLE__
-/* Mac OS X defines sem_init but actually does not implement them */
-#include <dispatch/dispatch.h>
-
-typedef dispatch_semaphore_t	sem_t;
-
-#define sem_init(psem,x,val)	*psem = dispatch_semaphore_create(val)
-#define sem_post(psem)		dispatch_semaphore_signal(*psem)
-#define sem_wait(psem)		dispatch_semaphore_wait(*psem, DISPATCH_TIME_FOREVER)
-#else
-#include <semaphore.h>
-#endif
-
 #define FT245R_CYCLES	2
 #define FT245R_FRAGMENT_SIZE  512
-#define REQ_OUTSTANDINGS	10
+#define FT245R_TX_SLOTS	64	/* write transfers in flight */
 //#define USE_INLINE_WRITE_PAGE
 
 #define FT245R_DEBUG	0
@@ -148,41 +135,141 @@ static unsigned char ft245r_ddr;
 static unsigned char ft245r_out;
 static unsigned char ft245r_in;
 
-#define BUFSIZE 0x2000
+#define BUFSIZE 0x10000		/* must be a power of 2 */
+#define FT245R_RX_TIMEOUT 5000	/* default receive timeout, ms */
+#define FT245R_MAX_PENDING (BUFSIZE / 2) /* read back bytes of queued requests */
 
 // libftdi / libftd2xx compatibility functions.
 
+/*
+ * The data read back from the FTDI is passed from the reader thread
+ * to the main thread through a single-producer single-consumer ring
+ * buffer.  Only the reader thread advances head, and only the main
+ * thread advances tail, so both sides copy whole blocks without any
+ * locking.  The mutex and condition variables are only used to sleep
+ * when the ring is empty (main thread) or full (reader thread); the
+ * other side only signals if the "waiting" flag is set.  Without GCC
+ * atomics, the shared variables are accessed under a mutex of their
+ * own, as they are also accessed while ring_lock is held.
+ */
+#if defined(__GNUC__)
+# define RING_LOAD(v)		__atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+# define RING_STORE(v, x)	__atomic_store_n(&(v), (x), __ATOMIC_SEQ_CST)
+#else
+# define RING_LOAD(v)		ring_load(&(v))
+# define RING_STORE(v, x)	ring_store(&(v), (x))
+#endif
+
 static pthread_t readerthread;
-static sem_t buf_data, buf_space;
+static pthread_mutex_t ring_lock;
+static pthread_cond_t ring_data, ring_space;
 static unsigned char buffer[BUFSIZE];
-static int head, tail;
+static unsigned int head, tail;		/* free running, masked on access */
+static unsigned int rx_waiting, tx_waiting;
+static int ft245r_rx_timeout = FT245R_RX_TIMEOUT;
 
-static void add_to_buf (unsigned char c) {
-    int nh;
+#if defined(HAVE_LIBFTDI1)
+struct ft245r_tx {
+    struct ftdi_transfer_control *tc;
+    unsigned char buf[FT245R_FRAGMENT_SIZE+1+128];
+};
+#endif
 
-    sem_wait (&buf_space);
-    if (head == (BUFSIZE -1)) nh = 0;
-    else                      nh = head + 1;
+/*
+ * Private data of the programmer.
+ */
+struct pdata {
+#if defined(HAVE_LIBFTDI1)
+    struct ft245r_tx tx_slots[FT245R_TX_SLOTS]; /* see ft245r_send_async() */
+    int tx_first, tx_count;
+#endif
+    int req_pending;                    /* see put_request() */
+    unsigned char *prefetch_buf;        /* see ft245r_paged_load_flash() */
+    unsigned int prefetch_size;
+    AVRMEM *prefetch_m;
+    unsigned int prefetch_addr, prefetch_len;
+    int prefetch_valid;
+    struct avr_thread_state reader_state; /* of the thread that opened it */
+};
 
-    if (nh == tail) {
-        avrdude_message(MSG_INFO, "buffer overflow. Cannot happen!\n");
+#define PDATA(pgm) ((struct pdata *)(pgm->cookie))
+
+#if !defined(__GNUC__)
+static pthread_mutex_t ring_var_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int ring_load(unsigned int *v) {
+    unsigned int x;
+
+    pthread_mutex_lock(&ring_var_lock);
+    x = *v;
+    pthread_mutex_unlock(&ring_var_lock);
+    return x;
+}
+
+static void ring_store(unsigned int *v, unsigned int x) {
+    pthread_mutex_lock(&ring_var_lock);
+    *v = x;
+    pthread_mutex_unlock(&ring_var_lock);
+}
+#endif
+
+static void ring_wakeup(pthread_cond_t *cond) {
+    int state;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&ring_lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&ring_lock);
+    pthread_setcancelstate(state, NULL);
+}
+
+static void add_to_buf (const unsigned char *data, int len) {
+    unsigned int h, n, off;
+    int state;
+
+    while (len > 0) {
+        h = head;
+        n = BUFSIZE - (h - RING_LOAD(tail));
+        if (n == 0) {
+            // ring full, wait for the main thread to catch up
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+            pthread_mutex_lock(&ring_lock);
+            RING_STORE(tx_waiting, 1);
+            while (h - RING_LOAD(tail) == BUFSIZE)
+                pthread_cond_wait(&ring_space, &ring_lock);
+            RING_STORE(tx_waiting, 0);
+            pthread_mutex_unlock(&ring_lock);
+            pthread_setcancelstate(state, NULL);
+            continue;
+        }
+        if (n > (unsigned int)len)
+            n = len;
+        off = h & (BUFSIZE - 1);
+        if (n > BUFSIZE - off)
+            n = BUFSIZE - off;
+        memcpy(buffer + off, data, n);
+        RING_STORE(head, h + n);
+        data += n;
+        len -= n;
+
+        if (RING_LOAD(rx_waiting))
+            ring_wakeup(&ring_data);
     }
-    buffer[head] = c;
-    head = nh;
-    sem_post (&buf_data);
 }
 
 static void *reader (void *arg) {
     pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS,NULL);
-    struct ftdi_context *handle = (struct ftdi_context *)(arg);
+    PROGRAMMER *pgm = (PROGRAMMER *)(arg);
     unsigned char buf[0x1000];
-    int br, i;
+    int br;
+
+    avr_thread_state_restore(&PDATA(pgm)->reader_state);
 
     while (1) {
         pthread_testcancel();
         br = ftdi_read_data (handle, buf, sizeof(buf));
-        for (i=0; i<br; i++)
-            add_to_buf (buf[i]);
+        if (br > 0)
+            add_to_buf (buf, br);
     }
     return NULL;
 }
@@ -195,27 +282,139 @@ static int ft245r_send(PROGRAMMER * pgm, unsigned char * buf, size_t len) {
     return 0;
 }
 
-static int ft245r_recv(PROGRAMMER * pgm, unsigned char * buf, size_t len) {
-    int i;
+/*
+ * Paged reads and writes hand their bit streams to the FTDI as
+ * asynchronous transfers, so that the next fragment is generated while
+ * the previous ones are still on the bus.  Each transfer needs its own
+ * buffer until it has completed; completed transfers are reaped
+ * without waiting whenever a new one is submitted.
+ */
+#if defined(HAVE_LIBFTDI1)
+static int ft245r_tx_reap(PROGRAMMER * pgm) {
+    struct pdata *pd = PDATA(pgm);
+    struct ft245r_tx *t = &pd->tx_slots[pd->tx_first];
+    int rv;
 
-    // Copy over data from the circular buffer..
-    // XXX This should timeout, and return error if there isn't enough
-    // data.
-    for (i=0; i<len; i++) {
-        sem_wait (&buf_data);
-        buf[i] = buffer[tail];
-        if (tail == (BUFSIZE -1)) tail = 0;
-        else                      tail++;
-        sem_post (&buf_space);
+    rv = ftdi_transfer_data_done(t->tc);
+    t->tc = NULL;
+    pd->tx_first = (pd->tx_first + 1) % FT245R_TX_SLOTS;
+    pd->tx_count--;
+    if (rv < 0) {
+        avrdude_message(MSG_INFO, "%s: ft245r_tx_reap(): write failed (%s)\n",
+                        progname, ftdi_get_error_string(handle));
+        return -1;
     }
+    return 0;
+}
+
+static int ft245r_tx_flush(PROGRAMMER * pgm) {
+    struct pdata *pd = PDATA(pgm);
+    int rv = 0;
+
+    while (pd->tx_count > 0)
+        if (ft245r_tx_reap(pgm) < 0)
+            rv = -1;
+    return rv;
+}
 
+static int ft245r_send_async(PROGRAMMER * pgm, unsigned char * buf, size_t len) {
+    struct pdata *pd = PDATA(pgm);
+    struct ft245r_tx *t;
+
+    if (pd->tx_count == FT245R_TX_SLOTS && ft245r_tx_reap(pgm) < 0)
+        return -1;
+
+    t = &pd->tx_slots[(pd->tx_first + pd->tx_count) % FT245R_TX_SLOTS];
+    memcpy(t->buf, buf, len);
+    if ((t->tc = ftdi_write_data_submit(handle, t->buf, len)) == NULL) {
+        avrdude_message(MSG_INFO, "%s: ft245r_send_async(): cannot submit write (%s)\n",
+                        progname, ftdi_get_error_string(handle));
+        return -1;
+    }
+    pd->tx_count++;
+
+    while (pd->tx_count > 0 && pd->tx_slots[pd->tx_first].tc->completed)
+        if (ft245r_tx_reap(pgm) < 0)
+            return -1;
     return 0;
 }
+#else
+static int ft245r_tx_flush(PROGRAMMER * pgm) {
+    return 0;
+}
+
+static int ft245r_send_async(PROGRAMMER * pgm, unsigned char * buf, size_t len) {
+    return ft245r_send(pgm, buf, len);
+}
+#endif /* HAVE_LIBFTDI1 */
+
+static int ft245r_recv(PROGRAMMER * pgm, unsigned char * buf, size_t len) {
+    struct timeval tv;
+    struct timespec deadline;
+    unsigned int t, n, off;
+    int rc = 0;
+
+    deadline.tv_sec = 0;
+    while (len > 0) {
+        t = tail;
+        n = RING_LOAD(head) - t;
+        if (n == 0) {
+            // ring empty, sleep until the reader thread has more data
+            if (deadline.tv_sec == 0) {
+                gettimeofday(&tv, NULL);
+                deadline.tv_sec = tv.tv_sec + ft245r_rx_timeout / 1000;
+                deadline.tv_nsec = tv.tv_usec * 1000L +
+                                   (ft245r_rx_timeout % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+            }
+            pthread_mutex_lock(&ring_lock);
+            RING_STORE(rx_waiting, 1);
+            while (rc == 0 && RING_LOAD(head) == t)
+                rc = pthread_cond_timedwait(&ring_data, &ring_lock, &deadline);
+            RING_STORE(rx_waiting, 0);
+            pthread_mutex_unlock(&ring_lock);
+            if (RING_LOAD(head) != t)
+                continue;
+            avrdude_message(MSG_INFO, "%s: ft245r_recv(): timeout waiting for data\n",
+                            progname);
+            return -1;
+        }
+        if (n > len)
+            n = len;
+        off = t & (BUFSIZE - 1);
+        if (n > BUFSIZE - off)
+            n = BUFSIZE - off;
+        memcpy(buf, buffer + off, n);
+        RING_STORE(tail, t + n);
+        buf += n;
+        len -= n;
+
+        if (RING_LOAD(tx_waiting))
+            ring_wakeup(&ring_space);
+    }
 
+    return 0;
+}
+
+/*
+ * discard all data received so far
+ */
+static void ft245r_flush(PROGRAMMER * pgm) {
+    RING_STORE(tail, RING_LOAD(head));
+    if (RING_LOAD(tx_waiting))
+        ring_wakeup(&ring_space);
+}
+
+
+static int ft245r_finish_requests(PROGRAMMER * pgm);
 
 static int ft245r_drain(PROGRAMMER * pgm, int display) {
     int r;
-    unsigned char t;
+
+    ft245r_finish_requests(pgm);
 
     // flush the buffer in the chip by changing the mode.....
     r = ftdi_set_bitmode(handle, 0, BITMODE_RESET); 	// reset
@@ -224,9 +423,7 @@ static int ft245r_drain(PROGRAMMER * pgm, int display) {
     if (r) return -1;
 
     // drain our buffer.
-    while (head != tail) {
-        ft245r_recv (pgm, &t, 1);
-    }
+    ft245r_flush(pgm);
     return 0;
 }
 
@@ -282,11 +479,15 @@ static int set_pin(PROGRAMMER * pgm, int pinname, int val) {
         return 0;
     }
 
+    if (ft245r_finish_requests(pgm) < 0)
+        return -1;
+
     ft245r_out = SET_BITS_0(ft245r_out,pgm,pinname,val);
     buf[0] = ft245r_out;
 
-    ft245r_send (pgm, buf, 1);
-    ft245r_recv (pgm, buf, 1);
+    if (ft245r_send (pgm, buf, 1) < 0 ||
+        ft245r_recv (pgm, buf, 1) < 0)
+        return -1;
 
     ft245r_in = buf[0];
     return 0;
@@ -402,7 +603,7 @@ static int ft245r_program_enable(PROGRAMMER * pgm, AVRPART * p) {
 
         if (i == 3) {
             ft245r_drain(pgm, 0);
-            tail = head;
+            ft245r_flush(pgm);
         }
     }
 
@@ -508,6 +709,9 @@ static int ft245r_cmd(PROGRAMMER * pgm, const unsigned char *cmd,
     int i,buf_pos;
     unsigned char buf[128];
 
+    if (ft245r_finish_requests(pgm) < 0)
+        return -1;
+
     buf_pos = 0;
     for (i=0; i<4; i++) {
         buf_pos += set_data(pgm, buf+buf_pos, cmd[i]);
@@ -515,8 +719,9 @@ static int ft245r_cmd(PROGRAMMER * pgm, const unsigned char *cmd,
     buf[buf_pos] = 0;
     buf_pos++;
 
-    ft245r_send (pgm, buf, buf_pos);
-    ft245r_recv (pgm, buf, buf_pos);
+    if (ft245r_send (pgm, buf, buf_pos) < 0 ||
+        ft245r_recv (pgm, buf, buf_pos) < 0)
+        return -1;
     res[0] = extract_data(pgm, buf, 0);
     res[1] = extract_data(pgm, buf, 1);
     res[2] = extract_data(pgm, buf, 2);
@@ -656,9 +861,13 @@ static int ft245r_open(PROGRAMMER * pgm, char * port) {
      * writing because the ftdi cannot send the results because we
      * haven't provided a read buffer yet. */
 
-    sem_init (&buf_data, 0, 0);
-    sem_init (&buf_space, 0, BUFSIZE);
-    pthread_create (&readerthread, NULL, reader, handle);
+    head = tail = 0;
+    rx_waiting = tx_waiting = 0;
+    pthread_mutex_init (&ring_lock, NULL);
+    pthread_cond_init (&ring_data, NULL);
+    pthread_cond_init (&ring_space, NULL);
+    avr_thread_state_save(&PDATA(pgm)->reader_state);
+    pthread_create (&readerthread, NULL, reader, pgm);
 
     /*
      * drain any extraneous input
@@ -683,6 +892,7 @@ cleanup_no_usb:
 static void ft245r_close(PROGRAMMER * pgm) {
     int retry_times = 0;
     if (handle) {
+        ft245r_finish_requests(pgm);
         // I think the switch to BB mode and back flushes the buffer.
         ftdi_set_bitmode(handle, 0, BITMODE_SYNCBB); // set Synchronous BitBang, all in puts
         ftdi_set_bitmode(handle, 0, BITMODE_RESET); // disable Synchronous BitBang
@@ -696,10 +906,40 @@ static void ft245r_close(PROGRAMMER * pgm) {
         }
 
         pthread_join(readerthread, NULL);
+        pthread_cond_destroy(&ring_data);
+        pthread_cond_destroy(&ring_space);
+        pthread_mutex_destroy(&ring_lock);
         ftdi_deinit (handle);
         free(handle);
         handle = NULL;
     }
+    free(PDATA(pgm)->prefetch_buf);
+    PDATA(pgm)->prefetch_buf = NULL;
+    PDATA(pgm)->prefetch_size = 0;
+    PDATA(pgm)->prefetch_valid = 0;
+}
+
+static int ft245r_parseextparams(PROGRAMMER * pgm, LISTID extparms) {
+    LNODEID ln;
+    const char *extended_param;
+    int timeout, rv = 0;
+
+    for (ln = lfirst(extparms); ln; ln = lnext(ln)) {
+        extended_param = ldata(ln);
+
+        if (sscanf(extended_param, "timeout=%i", &timeout) == 1 && timeout > 0) {
+            avrdude_message(MSG_NOTICE2, "%s: ft245r_parseextparams(): receive timeout %d ms\n",
+                            progname, timeout);
+            ft245r_rx_timeout = timeout;
+            continue;
+        }
+
+        avrdude_message(MSG_INFO, "%s: ft245r_parseextparams(): invalid extended parameter '%s'\n",
+                        progname, extended_param);
+        rv = -1;
+    }
+
+    return rv;
 }
 
 static void ft245r_display(PROGRAMMER * pgm, const char * p) {
@@ -741,14 +981,28 @@ static int ft245r_paged_write_gen(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     return i;
 }
 
+/*
+ * Queue of the fragments sent to the FTDI whose read back data has not
+ * been fetched from the ring yet.  The data of a fragment is extracted
+ * to "dest"; n is the number of bytes read from the AVR in it (0 for
+ * writes).  At most FT245R_MAX_PENDING bytes are kept outstanding, so
+ * the read back data always fits into the ring.
+ *
+ * Reading flash reads ahead one page: the fragments for the next page
+ * are queued ("prefetch") with their data going to prefetch_buf, and
+ * are taken over if the next call asks for that page.  Anything else
+ * talking to the device finishes all queued requests first.
+ */
 static struct ft245r_request {
-    int addr;
+    unsigned char *dest;
     int bytes;
     int n;
+    int prefetch;
     struct ft245r_request *next;
 } *req_head,*req_tail,*req_pool;
 
-static void put_request(int addr, int bytes, int n) {
+static void put_request(PROGRAMMER * pgm, unsigned char *dest, int bytes, int n,
+                        int prefetch) {
     struct ft245r_request *p;
     if (req_pool) {
         p = req_pool;
@@ -761,9 +1015,11 @@ static void put_request(int addr, int bytes, int n) {
         }
     }
     memset(p, 0, sizeof(struct ft245r_request));
-    p->addr = addr;
+    p->dest = dest;
     p->bytes = bytes;
     p->n = n;
+    p->prefetch = prefetch;
+    PDATA(pgm)->req_pending += bytes;
     if (req_tail) {
         req_tail->next = p;
         req_tail = p;
@@ -772,9 +1028,10 @@ static void put_request(int addr, int bytes, int n) {
     }
 }
 
-static int do_request(PROGRAMMER * pgm, AVRMEM *m) {
+static int do_request(PROGRAMMER * pgm) {
     struct ft245r_request *p;
-    int addr, bytes, j, n;
+    int bytes, j, n;
+    unsigned char *dest;
     unsigned char buf[FT245R_FRAGMENT_SIZE+1+128];
 
     if (!req_head) return 0;
@@ -782,27 +1039,68 @@ static int do_request(PROGRAMMER * pgm, AVRMEM *m) {
     req_head = p->next;
     if (!req_head) req_tail = req_head;
 
-    addr = p->addr;
+    dest = p->dest;
     bytes = p->bytes;
     n = p->n;
+    PDATA(pgm)->req_pending -= bytes;
     memset(p, 0, sizeof(struct ft245r_request));
     p->next = req_pool;
     req_pool = p;
 
-    ft245r_recv(pgm, buf, bytes);
+    if (ft245r_recv(pgm, buf, bytes) < 0) {
+        // drop all outstanding requests, their data will not arrive
+        while (req_head) {
+            p = req_head;
+            req_head = p->next;
+            p->next = req_pool;
+            req_pool = p;
+        }
+        req_tail = NULL;
+        PDATA(pgm)->req_pending = 0;
+        PDATA(pgm)->prefetch_valid = 0;
+        return -1;
+    }
     for (j=0; j<n; j++) {
-        m->buf[addr++] = extract_data(pgm, buf , (j * 4 + 3));
+        dest[j] = extract_data(pgm, buf , (j * 4 + 3));
     }
     return 1;
 }
 
+/*
+ * send a fragment, keeping the read back data of all outstanding
+ * fragments within FT245R_MAX_PENDING
+ */
+static int send_request(PROGRAMMER * pgm, unsigned char *buf, int bytes,
+                        unsigned char *dest, int n, int prefetch) {
+    while (PDATA(pgm)->req_pending > 0 && PDATA(pgm)->req_pending + bytes > FT245R_MAX_PENDING)
+        if (do_request(pgm) < 0)
+            return -1;
+    if (ft245r_send_async(pgm, buf, bytes) < 0)
+        return -1;
+    put_request(pgm, dest, bytes, n, prefetch);
+    return 0;
+}
+
+static int ft245r_finish_requests(PROGRAMMER * pgm) {
+    int rc;
+
+    PDATA(pgm)->prefetch_valid = 0;
+    while ((rc = do_request(pgm)) > 0)
+        ;
+    if (ft245r_tx_flush(pgm) < 0)
+        rc = -1;
+    return rc;
+}
+
 static int ft245r_paged_write_flash(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                     int page_size, int addr, int n_bytes) {
     unsigned int    i,j;
-    int addr_save,buf_pos,do_page_write,req_count;
+    int addr_save,buf_pos,do_page_write,rc;
     unsigned char buf[FT245R_FRAGMENT_SIZE+1+128];
 
-    req_count = 0;
+    if (ft245r_finish_requests(pgm) < 0)
+        return -1;
+
     for (i=0; i<n_bytes; ) {
         addr_save = addr;
         buf_pos = 0;
@@ -846,8 +1144,8 @@ static int ft245r_paged_write_flash(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
             ft245r_out = SET_BITS_0(ft245r_out,pgm,PIN_AVR_SCK,0); // sck down
             buf[buf_pos++] = ft245r_out;
         }
-        ft245r_send(pgm, buf, buf_pos);
-        put_request(addr_save, buf_pos, 0);
+        if (send_request(pgm, buf, buf_pos, NULL, 0, 0) < 0)
+            return -1;
         //ft245r_sync(pgm);
 #if 0
         avrdude_message(MSG_INFO, "send addr 0x%04x bufsize %d [%02x %02x] page_write %d\n",
@@ -856,29 +1154,24 @@ static int ft245r_paged_write_flash(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                 extract_data_out(pgm, buf , (1*4 + 3) ),
                 do_page_write);
 #endif
-        req_count++;
-        if (req_count > REQ_OUTSTANDINGS)
-            do_request(pgm, m);
         if (do_page_write) {
 #if defined(USE_INLINE_WRITE_PAGE)
-            while (do_request(pgm, m))
-                ;
+            if (ft245r_finish_requests(pgm) < 0)
+                return -1;
             usleep(m->max_write_delay);
 #else
             int addr_wk = addr_save - (addr_save % m->page_size);
-            int rc;
-            while (do_request(pgm, m))
-                ;
+            if (ft245r_finish_requests(pgm) < 0)
+                return -1;
             rc = avr_write_page(pgm, p, m, addr_wk);
             if (rc != 0) {
                 return -2;
             }
 #endif
-            req_count = 0;
         }
     }
-    while (do_request(pgm, m))
-        ;
+    if (ft245r_finish_requests(pgm) < 0)
+        return -1;
     return i;
 }
 
@@ -911,17 +1204,19 @@ static int ft245r_paged_load_gen(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     return 0;
 }
 
-static int ft245r_paged_load_flash(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
-                                   unsigned int page_size, unsigned int addr,
-                                   unsigned int n_bytes) {
-    unsigned long    i,j,n;
-    int addr_save,buf_pos;
-    int req_count = 0;
+/*
+ * queue the read commands for n_bytes of flash at addr, the data going
+ * to dest
+ */
+static int ft245r_queue_load_flash(PROGRAMMER * pgm, unsigned char *dest,
+                                   unsigned int addr, unsigned int n_bytes,
+                                   int prefetch) {
+    unsigned long    i,j;
+    int buf_pos;
     unsigned char buf[FT245R_FRAGMENT_SIZE+1];
 
     for (i=0; i<n_bytes; ) {
         buf_pos = 0;
-        addr_save = addr;
         for (j=0; j< FT245R_FRAGMENT_SIZE/8/FT245R_CYCLES/4; j++) {
             if (i >= n_bytes) break;
             buf_pos += set_data(pgm, buf+buf_pos, (addr & 1)?0x28:0x20 );
@@ -935,16 +1230,57 @@ static int ft245r_paged_load_flash(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
             ft245r_out = SET_BITS_0(ft245r_out,pgm,PIN_AVR_SCK,0); // sck down
             buf[buf_pos++] = ft245r_out;
         }
-        n = j;
-        ft245r_send(pgm, buf, buf_pos);
-        put_request(addr_save, buf_pos, n);
-        req_count++;
-        if (req_count > REQ_OUTSTANDINGS)
-            do_request(pgm, m);
+        if (send_request(pgm, buf, buf_pos, dest, j, prefetch) < 0)
+            return -1;
+        dest += j;
+    }
+    return 0;
+}
+
+static int ft245r_paged_load_flash(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                                   unsigned int page_size, unsigned int addr,
+                                   unsigned int n_bytes) {
+    struct pdata *pd = PDATA(pgm);
+    struct ft245r_request *r;
+
+    if (pd->prefetch_valid && pd->prefetch_m == m &&
+        pd->prefetch_addr == addr && pd->prefetch_len == n_bytes) {
+        /* this page has been read ahead, move its data to m->buf */
+        pd->prefetch_valid = 0;
+        memcpy(m->buf + addr, pd->prefetch_buf, n_bytes);
+        for (r = req_head; r != NULL; r = r->next) {
+            r->dest = m->buf + addr + (r->dest - pd->prefetch_buf);
+            r->prefetch = 0;
+        }
+    } else {
+        if (ft245r_finish_requests(pgm) < 0)
+            return -1;
+        if (ft245r_queue_load_flash(pgm, m->buf + addr, addr, n_bytes, 0) < 0)
+            return -1;
+    }
 
+    /* read ahead the next page while waiting for this one */
+    if (n_bytes == page_size && addr + 2 * n_bytes <= m->size) {
+        if (pd->prefetch_size < n_bytes) {
+            free(pd->prefetch_buf);
+            pd->prefetch_size = 0;
+            if ((pd->prefetch_buf = malloc(n_bytes)) != NULL)
+                pd->prefetch_size = n_bytes;
+        }
+        if (pd->prefetch_buf != NULL) {
+            if (ft245r_queue_load_flash(pgm, pd->prefetch_buf, addr + n_bytes,
+                                        n_bytes, 1) < 0)
+                return -1;
+            pd->prefetch_m = m;
+            pd->prefetch_addr = addr + n_bytes;
+            pd->prefetch_len = n_bytes;
+            pd->prefetch_valid = 1;
+        }
     }
-    while (do_request(pgm, m))
-        ;
+
+    while (req_head != NULL && !req_head->prefetch)
+        if (do_request(pgm) < 0)
+            return -1;
     return 0;
 }
 
@@ -960,6 +1296,20 @@ static int ft245r_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     }
 }
 
+static void ft245r_setup(PROGRAMMER * pgm) {
+    if ((pgm->cookie = malloc(sizeof(struct pdata))) == 0) {
+        avrdude_message(MSG_INFO, "%s: ft245r_setup(): Out of memory allocating private data\n",
+                        progname);
+        exit(1);
+    }
+    memset(pgm->cookie, 0, sizeof(struct pdata));
+}
+
+static void ft245r_teardown(PROGRAMMER * pgm) {
+    free(PDATA(pgm)->prefetch_buf);
+    free(pgm->cookie);
+}
+
 void ft245r_initpgm(PROGRAMMER * pgm) {
     strcpy(pgm->type, "ftdi_syncbb");
 
@@ -990,8 +1340,12 @@ void ft245r_initpgm(PROGRAMMER * pgm) {
     pgm->vfy_led        = set_led_vfy;
     pgm->powerup        = ft245r_powerup;
     pgm->powerdown      = ft245r_powerdown;
+    pgm->parseextparams = ft245r_parseextparams;
+    pgm->setup          = ft245r_setup;
+    pgm->teardown       = ft245r_teardown;
 
     handle = NULL;
+    ft245r_rx_timeout = FT245R_RX_TIMEOUT;
 }
 
 #endif
@@ -62,6 +62,9 @@ struct pdata
   unsigned long eeprom_pageaddr;
   unsigned int eeprom_pagesize;
 
+  /* Signature bytes 1 and 2, see jtag3_read_byte() */
+  unsigned char signature_cache[2];
+
   int prog_enabled;	     /* Cached value of PROGRAMMING status. */
 
   /* JTAG chain stuff */
@@ -1955,14 +1958,12 @@ static int jtag3_read_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
     if (pgm->flag & PGM_FL_IS_DW)
       unsupp = 1;
   } else if (strcmp(mem->desc, "signature") == 0) {
-    static unsigned char signature_cache[2];
-
     cmd[3] = MTYPE_SIGN_JTAG;
 
     /*
      * dW can read out the signature on JTAGICE3, but only allows
-     * for a full three-byte read.  We cache them in a local
-     * variable to avoid multiple reads.  This optimization does not
+     * for a full three-byte read.  We cache them in the private
+     * data to avoid multiple reads.  This optimization does not
      * harm for other connection types either.
      */
     u32_to_b4(cmd + 8, 3);
@@ -1972,13 +1973,13 @@ static int jtag3_read_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
       if ((status = jtag3_command(pgm, cmd, 12, &resp, "read memory")) < 0)
 	return status;
 
-      signature_cache[0] = resp[4];
-      signature_cache[1] = resp[5];
+      PDATA(pgm)->signature_cache[0] = resp[4];
+      PDATA(pgm)->signature_cache[1] = resp[5];
       *value = resp[3];
       free(resp);
       return 0;
     } else if (addr <= 2) {
-      *value = signature_cache[addr - 1];
+      *value = PDATA(pgm)->signature_cache[addr - 1];
       return 0;
     } else {
       /* should not happen */
@@ -250,7 +250,7 @@ static const char *
 jtagmkII_get_rc(unsigned int rc)
 {
   int i;
-  static char msg[50];
+  static LIBAVRDUDE_TLS char msg[50];
 
   for (i = 0; i < sizeof jtagresults / sizeof jtagresults[0]; i++)
     if (jtagresults[i].code == rc)
@@ -28,6 +28,35 @@
 #include <limits.h>
 #include <stdbool.h>
 
+#include "libavrdude_tls.h"
+
+/*
+ * LIBAVRDUDE_TLS, from the generated libavrdude_tls.h, is the storage
+ * class of the library state that belongs to one programming session
+ * (messages, progress reporting, the serial layer in use, and buffers
+ * of the communication layers).  Where the compiler supports
+ * thread-local storage, each thread gets its own copy of that state,
+ * so several threads can each drive a programmer of their own.  The
+ * configuration has to be read before any such thread is started, and
+ * each thread must work on its own copies of the programmer and part
+ * (pgm_dup(), avr_dup_part()) taken from the shared lists.  Threads
+ * that the library starts itself take over the message settings of
+ * their session through avr_thread_state_save() and
+ * avr_thread_state_restore().
+ *
+ * The following backends still keep state at file scope, so only one
+ * session per process may use each of them at a time:
+ *
+ *   bitbang.c       delay loop calibration (par, serbb, linuxgpio, ...)
+ *   ft245r.c        FTDI handle, pin state, read back ring and thread
+ *   linuxgpio.c     GPIO file descriptors
+ *   linuxspi.c      SPI and GPIO chip file descriptors
+ *   serbb_posix.c   saved terminal mode
+ *   serbb_win32.c   modem line state
+ *   ser_win32.c     serial over ethernet flag
+ *   usbasp.c        libusb context
+ */
+
 /* lets try to select at least 32 bits */
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
@@ -181,8 +210,27 @@ typedef struct cmdbit {
   int          value; /* bit value if type == AVR_CMDBIT_VALUD */
 } CMDBIT;
 
+/*
+ * Bits of one type (AVR_CMDBIT_ADDRESS, _INPUT, _OUTPUT) of a compiled
+ * opcode.  The 32 command bits are handled as one word, bit i of which
+ * is bit i % 8 of cmd[3 - i / 8].
+ */
+typedef struct opcode_field {
+  unsigned long mask;   /* command bits of this type */
+  int           linear; /* command bit i <-> source bit i + shift for all bits */
+  int           shift;
+} OPCODE_FIELD;
+
 typedef struct opcode {
   CMDBIT        bit[32]; /* opcode bit specs */
+
+  /* compiled form of bit[], see avr_compile_opcode() */
+  int           compiled;
+  unsigned long value_mask; /* AVR_CMDBIT_VALUE bits */
+  unsigned long value_bits; /* ... and their values */
+  OPCODE_FIELD  addr;
+  OPCODE_FIELD  input;
+  OPCODE_FIELD  output;
 } OPCODE;
 
 
@@ -302,6 +350,7 @@ typedef struct avrmem {
 
   unsigned char * buf;        /* pointer to memory buffer */
   unsigned char * tags;       /* allocation tags */
+  unsigned int * pagemap;     /* bitmap of pages holding allocated bytes */
   OPCODE * op[AVR_OP_MAX];    /* opcodes */
 } AVRMEM;
 
@@ -312,6 +361,7 @@ extern "C" {
 /* Functions for OPCODE structures */
 OPCODE * avr_new_opcode(void);
 void     avr_free_opcode(OPCODE * op);
+void avr_compile_opcode(OPCODE * op);
 int avr_set_bits(OPCODE * op, unsigned char * cmd);
 int avr_set_addr(OPCODE * op, unsigned char * cmd, unsigned long addr);
 int avr_set_input(OPCODE * op, unsigned char * cmd, unsigned char data);
@@ -324,6 +374,12 @@ int avr_initmem(AVRPART * p);
 AVRMEM * avr_dup_mem(AVRMEM * m);
 void     avr_free_mem(AVRMEM * m);
 AVRMEM * avr_locate_mem(AVRPART * p, char * desc);
+int avr_mem_tag_unit(AVRMEM * m);
+void avr_mem_clear_tags(AVRMEM * m);
+int avr_mem_copy_image(AVRMEM * dst, AVRMEM * src);
+void avr_mem_tag_range(AVRMEM * m, int addr, int len);
+int avr_mem_next_tagged_page(AVRMEM * m, int page);
+int avr_mem_count_tagged_pages(AVRMEM * m, int size);
 void avr_mem_display(const char * prefix, FILE * f, AVRMEM * m, int type,
                      int verbose);
 
@@ -342,6 +398,7 @@ typedef void (*walk_avrparts_cb)(const char *name, const char *desc,
                                  void *cookie);
 void walk_avrparts(LISTID avrparts, walk_avrparts_cb cb, void *cookie);
 void sort_avrparts(LISTID avrparts);
+void index_avrparts(LISTID avrparts);
 
 uint8_t get_fuse_bitmask(AVRMEM * m);
 int compare_memory_masked(AVRMEM * m, unsigned char buf1, unsigned char buf2);
@@ -519,7 +576,7 @@ const char * pinmask_to_str(const pinmask_t * const pinmask);
 
    The target file will be selected at configure time. */
 
-extern long serial_recv_timeout;
+extern LIBAVRDUDE_TLS long serial_recv_timeout;
 union filedescriptor
 {
   int ifd;
@@ -532,6 +589,7 @@ union filedescriptor
     int eep;                    /* event read endpoint */
     int max_xfer;               /* max transfer size */
     int use_interrupt_xfer;     /* device uses interrupt transfers */
+    void *reader;               /* frame reader threads, see usb_libusb.c */
   } usb;
 };
 
@@ -567,7 +625,7 @@ struct serial_device
 #define SERDEV_FL_CANSETSPEED  0x0001 /* device can change speed */
 };
 
-extern struct serial_device *serdev;
+extern LIBAVRDUDE_TLS struct serial_device *serdev;
 extern struct serial_device serial_serdev;
 extern struct serial_device usb_serdev;
 extern struct serial_device usb_serdev_frame;
@@ -639,6 +697,7 @@ typedef struct programmer_t {
   int ispdelay;    /* ISP clock delay */
   union filedescriptor fd;
   int  page_size;  /* page size if the programmer supports paged write/load */
+  int  paged_load_max; /* largest n_bytes for paged_load, 0 for one page */
   int  (*rdy_led)        (struct programmer_t * pgm, int value);
   int  (*err_led)        (struct programmer_t * pgm, int value);
   int  (*pgm_led)        (struct programmer_t * pgm, int value);
@@ -681,6 +740,11 @@ typedef struct programmer_t {
   int  (*set_fosc)       (struct programmer_t * pgm, double v);
   int  (*set_sck_period) (struct programmer_t * pgm, double v);
   int  (*setpin)         (struct programmer_t * pgm, int pinfunc, int value);
+  int  (*setpins)        (struct programmer_t * pgm, unsigned int mask,
+                          unsigned int values);
+  int  (*waveform)       (struct programmer_t * pgm, unsigned int mask,
+                          const unsigned int * states, unsigned char * miso,
+                          int n);
   int  (*getpin)         (struct programmer_t * pgm, int pinfunc);
   int  (*highpulsepin)   (struct programmer_t * pgm, int pinfunc);
   int  (*parseexitspecs) (struct programmer_t * pgm, char *s);
@@ -720,6 +784,10 @@ typedef void (*walk_programmers_cb)(const char *name, const char *desc,
 void walk_programmers(LISTID programmers, walk_programmers_cb cb, void *cookie);
 
 void sort_programmers(LISTID programmers);
+void index_programmers(LISTID programmers);
+
+/* set to ignore the cached delay loop calibration of bitbang programmers */
+extern LIBAVRDUDE_TLS int bitbang_recalibrate;
 
 #ifdef __cplusplus
 }
@@ -731,7 +799,19 @@ typedef void (*FP_UpdateProgress)(int percent, double etime, char *hdr);
 
 extern struct avrpart parts[];
 
-extern FP_UpdateProgress update_progress;
+extern LIBAVRDUDE_TLS FP_UpdateProgress update_progress;
+
+/* message and progress settings of a thread, see avr_thread_state_save() */
+struct avr_thread_state {
+  char * progname;
+  char * progbuf;
+  int verbose;
+  int quell_progress;
+  FP_UpdateProgress update_progress;
+};
+
+/* input file that is parsed while it is being written, see fileio.c */
+typedef struct fileio_stream FILEIO_STREAM;
 
 #ifdef __cplusplus
 extern "C" {
@@ -755,7 +835,10 @@ int avr_write_byte_default(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
 			   unsigned long addr, unsigned char data);
 
 int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
-              int auto_erase);
+              int flags);
+
+int avr_write_stream(PROGRAMMER * pgm, AVRPART * p, char * memtype,
+                     FILEIO_STREAM * stream, int flags);
 
 int avr_signature(PROGRAMMER * pgm, AVRPART * p);
 
@@ -773,6 +856,10 @@ int avr_unlock(PROGRAMMER * pgm, AVRPART * p);
 
 void report_progress (int completed, int total, char *hdr);
 
+void avr_thread_state_save(struct avr_thread_state * s);
+
+void avr_thread_state_restore(const struct avr_thread_state * s);
+
 #ifdef __cplusplus
 }
 #endif
@@ -810,11 +897,31 @@ enum {
 extern "C" {
 #endif
 
+extern LIBAVRDUDE_TLS int fileio_hexrecsize;
+
 char * fmtstr(FILEFMT format);
 
 int fileio(int op, char * filename, FILEFMT format,
            struct avrpart * p, char * memtype, int size);
 
+int fileio_all(char * filename, FILEFMT format, struct avrpart * p,
+               AVRMEM ** mems, int * sizes, int nmax);
+
+int fileio_is_stream(char * filename, FILEFMT format);
+
+FILEIO_STREAM * fileio_stream_open(char * filename, FILEFMT format,
+                                   struct avrpart * p, char * memtype);
+
+int fileio_stream_fill(FILEIO_STREAM * s, unsigned int addr);
+
+int fileio_stream_eof(FILEIO_STREAM * s);
+
+void fileio_stream_consumed(FILEIO_STREAM * s, unsigned int addr);
+
+int fileio_stream_redo(FILEIO_STREAM * s, unsigned int * lo, unsigned int * hi);
+
+int fileio_stream_close(FILEIO_STREAM * s);
+
 #ifdef __cplusplus
 }
 #endif
@@ -849,13 +956,17 @@ int safemode_memfuses (int save, unsigned char * lfuse, unsigned char * hfuse, u
 enum {
   DEVICE_READ,
   DEVICE_WRITE,
-  DEVICE_VERIFY
+  DEVICE_VERIFY,
+  DEVICE_WRITE_VERIFY           /* write, verifying each page as it goes */
 };
 
 enum updateflags {
   UF_NONE = 0,
   UF_NOWRITE = 1,
   UF_AUTO_ERASE = 2,
+  UF_DIFF_WRITE = 4,            /* only write pages that differ from the device */
+  UF_VERIFY = 8,                /* verify while writing */
+  UF_CHIP_ERASED = 16,          /* chip erased in this run, flash is blank */
 };
 
 
@@ -864,6 +975,7 @@ typedef struct update_t {
   int    op;
   char * filename;
   int    format;
+  struct update_load * load;    /* input file read ahead, see preload_updates() */
 } UPDATE;
 
 #ifdef __cplusplus
@@ -875,6 +987,8 @@ extern UPDATE * dup_update(UPDATE * upd);
 extern UPDATE * new_update(int op, char * memtype, int filefmt,
 			   char * filename);
 extern void free_update(UPDATE * upd);
+extern void preload_updates(LISTID updates, struct avrpart * p);
+extern void preload_updates_wait(LISTID updates);
 extern int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd,
 		 enum updateflags flags);
 
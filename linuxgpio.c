@@ -35,6 +35,15 @@
 
 #if HAVE_LINUXGPIO
 
+#if defined(HAVE_LINUX_GPIO_H)
+# include <stdint.h>
+# include <sys/ioctl.h>
+# include <linux/gpio.h>
+# if defined(GPIO_V2_GET_LINE_IOCTL)
+#  define LINUXGPIO_CDEV 1
+# endif
+#endif
+
 /*
  * GPIO user space helpers
  *
@@ -143,12 +152,177 @@ static int linuxgpio_dir_in(unsigned int gpio)
 */
 static int linuxgpio_fds[N_GPIO] ;
 
+#if defined(LINUXGPIO_CDEV)
+
+/*
+ * GPIO character device (/dev/gpiochipN) support
+ *
+ * All pins are requested as lines of one GPIO v2 line request, so
+ * that several of them can be changed or sampled by a single ioctl().
+ * linuxgpio_lines[] maps a GPIO number to its index within the line
+ * request, and linuxgpio_values caches the current output values.
+ */
+
+static int linuxgpio_reqfd = -1;
+static int linuxgpio_lines[N_GPIO];
+static uint64_t linuxgpio_values;
+
+static int linuxgpio_cdev_open(PROGRAMMER *pgm, const char *chip)
+{
+  struct gpio_v2_line_request req;
+  struct gpio_v2_line_config *cfg = &req.config;
+  uint64_t inputs = 0;
+  int fd, i, pin, n = 0;
+
+  memset(&req, 0, sizeof(req));
+
+  for (i = 0; i < N_PINS; i++) {
+    if ( (pgm->pinno[i] & PIN_MASK) == 0 &&
+         i != PIN_AVR_RESET &&
+         i != PIN_AVR_SCK   &&
+         i != PIN_AVR_MOSI  &&
+         i != PIN_AVR_MISO )
+      continue;
+    pin = pgm->pinno[i] & PIN_MASK;
+    if (linuxgpio_lines[pin] < 0) {
+      if (n == GPIO_V2_LINES_MAX) {
+        avrdude_message(MSG_INFO, "%s: too many GPIO lines\n", progname);
+        return -1;
+      }
+      req.offsets[n] = pin;
+      linuxgpio_lines[pin] = n++;
+    }
+    if (i == PIN_AVR_MISO)
+      inputs |= (uint64_t)1 << linuxgpio_lines[pin];
+  }
+
+  req.num_lines = n;
+  strncpy(req.consumer, "avrdude", sizeof(req.consumer) - 1);
+  cfg->flags = GPIO_V2_LINE_FLAG_OUTPUT;
+  cfg->num_attrs = 1;
+  cfg->attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+  cfg->attrs[0].attr.flags = GPIO_V2_LINE_FLAG_INPUT;
+  cfg->attrs[0].mask = inputs;
+
+  if ((fd = open(chip, O_RDWR)) < 0) {
+    avrdude_message(MSG_INFO, "%s: can't open %s: %s\n",
+                    progname, chip, strerror(errno));
+    return -1;
+  }
+  if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+    avrdude_message(MSG_INFO, "%s: can't request GPIO lines from %s, already in use?: %s\n",
+                    progname, chip, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  linuxgpio_reqfd = req.fd;
+  linuxgpio_values = 0;
+
+  return 0;
+}
+
+/*
+ * Set the pins in "mask" (a bit mask of PIN_* functions) to the
+ * corresponding bits of "values", using one ioctl().
+ */
+static int linuxgpio_cdev_setpins(PROGRAMMER * pgm, unsigned int mask,
+                                  unsigned int values)
+{
+  struct gpio_v2_line_values lv;
+  int i, pin, value;
+
+  lv.mask = 0;
+  for (i = 0; i < N_PINS; i++) {
+    if (!(mask & (1U << i)))
+      continue;
+    pin = pgm->pinno[i];
+    value = (values >> i) & 1;
+    if (pin & PIN_INVERSE) {
+      value = !value;
+      pin &= PIN_MASK;
+    }
+    if (linuxgpio_lines[pin] < 0)
+      return -1;
+    lv.mask |= (uint64_t)1 << linuxgpio_lines[pin];
+    if (value)
+      linuxgpio_values |= (uint64_t)1 << linuxgpio_lines[pin];
+    else
+      linuxgpio_values &= ~((uint64_t)1 << linuxgpio_lines[pin]);
+  }
+  lv.bits = linuxgpio_values;
+
+  if (ioctl(linuxgpio_reqfd, GPIO_V2_LINE_SET_VALUES_IOCTL, &lv) < 0)
+    return -1;
+
+  if (pgm->ispdelay > 1)
+    bitbang_delay(pgm->ispdelay);
+
+  return 0;
+}
+
+static int linuxgpio_cdev_getpin(PROGRAMMER * pgm, int pinfunc)
+{
+  struct gpio_v2_line_values lv;
+  int pin = pgm->pinno[pinfunc];
+  int invert = 0;
+
+  if (pin & PIN_INVERSE) {
+    invert = 1;
+    pin &= PIN_MASK;
+  }
+
+  if (linuxgpio_lines[pin] < 0)
+    return -1;
+
+  lv.mask = (uint64_t)1 << linuxgpio_lines[pin];
+  lv.bits = 0;
+  if (ioctl(linuxgpio_reqfd, GPIO_V2_LINE_GET_VALUES_IOCTL, &lv) < 0)
+    return -1;
+
+  return ((lv.bits & lv.mask) != 0) ^ invert;
+}
+
+static void linuxgpio_cdev_close(PROGRAMMER *pgm)
+{
+  struct gpio_v2_line_config cfg;
+  int reset_pin = pgm->pinno[PIN_AVR_RESET] & PIN_MASK;
+  uint64_t reset_line = (uint64_t)1 << linuxgpio_lines[reset_pin];
+
+  //as for sysfs, first make all lines inputs except RESET, then RESET
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.flags = GPIO_V2_LINE_FLAG_INPUT;
+  cfg.num_attrs = 2;
+  cfg.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+  cfg.attrs[0].attr.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+  cfg.attrs[0].mask = reset_line;
+  cfg.attrs[1].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+  cfg.attrs[1].attr.values = linuxgpio_values;
+  cfg.attrs[1].mask = reset_line;
+  ioctl(linuxgpio_reqfd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &cfg);
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.flags = GPIO_V2_LINE_FLAG_INPUT;
+  ioctl(linuxgpio_reqfd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &cfg);
+
+  close(linuxgpio_reqfd);
+  linuxgpio_reqfd = -1;
+}
+
+#endif /* LINUXGPIO_CDEV */
+
 
 static int linuxgpio_setpin(PROGRAMMER * pgm, int pinfunc, int value)
 {
   int r;
   int pin = pgm->pinno[pinfunc]; // TODO
 
+#if defined(LINUXGPIO_CDEV)
+  if (linuxgpio_reqfd >= 0)
+    return linuxgpio_cdev_setpins(pgm, 1U << pinfunc, (value != 0) << pinfunc);
+#endif
+
   if (pin & PIN_INVERSE)
   {
     value  = !value;
@@ -183,6 +357,11 @@ static int linuxgpio_getpin(PROGRAMMER * pgm, int pinfunc)
     pin   &= PIN_MASK;
   }
 
+#if defined(LINUXGPIO_CDEV)
+  if (linuxgpio_reqfd >= 0)
+    return linuxgpio_cdev_getpin(pgm, pinfunc);
+#endif
+
   if ( linuxgpio_fds[pin] < 0 )
     return -1;
 
@@ -204,8 +383,15 @@ static int linuxgpio_getpin(PROGRAMMER * pgm, int pinfunc)
 static int linuxgpio_highpulsepin(PROGRAMMER * pgm, int pinfunc)
 {
   int pin = pgm->pinno[pinfunc]; // TODO
-  
-  if ( linuxgpio_fds[pin & PIN_MASK] < 0 )
+
+#if defined(LINUXGPIO_CDEV)
+  if (linuxgpio_reqfd >= 0)
+    pin = linuxgpio_lines[pin & PIN_MASK];
+  else
+#endif
+    pin = linuxgpio_fds[pin & PIN_MASK];
+
+  if (pin < 0)
     return -1;
 
   linuxgpio_setpin(pgm, pinfunc, 1);
@@ -218,6 +404,13 @@ static int linuxgpio_highpulsepin(PROGRAMMER * pgm, int pinfunc)
 
 static void linuxgpio_display(PROGRAMMER *pgm, const char *p)
 {
+#if defined(LINUXGPIO_CDEV)
+  if (linuxgpio_reqfd >= 0) {
+    avrdude_message(MSG_INFO, "%sPin assignment  : line {n} of %s\n",p,pgm->port);
+    pgm_display_generic_mask(pgm, p, SHOW_AVR_PINS);
+    return;
+  }
+#endif
     avrdude_message(MSG_INFO, "%sPin assignment  : /sys/class/gpio/gpio{n}\n",p);
     pgm_display_generic_mask(pgm, p, SHOW_AVR_PINS);
 }
@@ -252,6 +445,30 @@ static int linuxgpio_open(PROGRAMMER *pgm, char *port)
 
   for (i=0; i<N_GPIO; i++)
     linuxgpio_fds[i] = -1;
+
+#if defined(LINUXGPIO_CDEV)
+  for (i=0; i<N_GPIO; i++)
+    linuxgpio_lines[i] = -1;
+
+  //Use the GPIO character device if the port names a GPIO chip, or if
+  //there is no sysfs GPIO interface (removed in recent kernels), in
+  //which case the first GPIO chip is used.
+  pgm->setpins = NULL;
+  if (strncmp(port, "gpiochip", 8) == 0)
+    snprintf(pgm->port, sizeof(pgm->port), "/dev/%s", port);
+  else if (strncmp(port, "/dev/gpiochip", 13) == 0 ||
+           access("/sys/class/gpio/export", F_OK) == 0)
+    snprintf(pgm->port, sizeof(pgm->port), "%s", port);
+  else
+    strcpy(pgm->port, "/dev/gpiochip0");
+
+  if (strncmp(pgm->port, "/dev/gpiochip", 13) == 0) {
+    if (linuxgpio_cdev_open(pgm, pgm->port) < 0)
+      return -1;
+    pgm->setpins = linuxgpio_cdev_setpins;
+    return 0;
+  }
+#endif
   //Avrdude assumes that if a pin number is 0 it means not used/available
   //this causes a problem because 0 is a valid GPIO number in Linux sysfs.
   //To avoid annoying off by one pin numbering we assume SCK, MOSI, MISO 
@@ -292,6 +509,13 @@ static void linuxgpio_close(PROGRAMMER *pgm)
 {
   int i, reset_pin;
 
+#if defined(LINUXGPIO_CDEV)
+  if (linuxgpio_reqfd >= 0) {
+    linuxgpio_cdev_close(pgm);
+    return;
+  }
+#endif
+
   reset_pin = pgm->pinno[PIN_AVR_RESET] & PIN_MASK;
 
   //first configure all pins as input, except RESET
@@ -339,7 +563,11 @@ void linuxgpio_initpgm(PROGRAMMER *pgm)
   pgm->write_byte     = avr_write_byte_default;
 }
 
+#if defined(LINUXGPIO_CDEV)
+const char linuxgpio_desc[] = "GPIO bitbanging using the Linux GPIO character device or sysfs interface";
+#else
 const char linuxgpio_desc[] = "GPIO bitbanging using the Linux sysfs interface";
+#endif
 
 #else  /* !HAVE_LINUXGPIO */
 
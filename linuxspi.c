@@ -62,6 +62,14 @@
 
 #define LINUXSPI "linuxspi"
 
+/*
+ * Maximum number of 4-byte commands submitted in one SPI_IOC_MESSAGE.
+ * The whole message has to fit into the spidev buffer (4096 bytes by
+ * default), and the transfer array into the size field of the ioctl
+ * number.
+ */
+#define LINUXSPI_MAX_CMDS 128
+
 static int fd_spidev, fd_gpiochip, fd_linehandle;
 
 /**
@@ -90,6 +98,41 @@ static int linuxspi_spi_duplex(PROGRAMMER *pgm, const unsigned char *tx, unsigne
     return (ret == -1) ? -1 : 0;
 }
 
+/**
+ * @brief Sends a sequence of 4-byte commands, batching as many as
+ *        possible into one SPI_IOC_MESSAGE
+ * @return -1 on failure, 0 on success
+ */
+static int linuxspi_spi_cmds(PROGRAMMER *pgm, const unsigned char *tx, unsigned char *rx, int ncmds)
+{
+    struct spi_ioc_transfer tr[LINUXSPI_MAX_CMDS];
+    int i, n, ret;
+
+    for (; ncmds > 0; ncmds -= n, tx += 4 * n, rx += 4 * n) {
+        n = ncmds > LINUXSPI_MAX_CMDS ? LINUXSPI_MAX_CMDS : ncmds;
+
+        memset(tr, 0, n * sizeof(tr[0]));
+        for (i = 0; i < n; i++) {
+            tr[i].tx_buf = (unsigned long)(tx + 4 * i);
+            tr[i].rx_buf = (unsigned long)(rx + 4 * i);
+            tr[i].len = 4;
+            tr[i].delay_usecs = 1;
+            tr[i].speed_hz = pgm->baudrate == 0 ? 400000 : pgm->baudrate;
+            tr[i].bits_per_word = 8;
+            /* deselect between commands, as with one message per command */
+            tr[i].cs_change = i < n - 1;
+        }
+
+        ret = ioctl(fd_spidev, SPI_IOC_MESSAGE(n), tr);
+        if (ret != 4 * n) {
+            avrdude_message(MSG_INFO, "\n%s: error: Unable to send SPI message\n", progname);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static void linuxspi_setup(PROGRAMMER *pgm)
 {
 }
@@ -263,6 +306,129 @@ static int linuxspi_chip_erase(PROGRAMMER *pgm, AVRPART *p)
     return 0;
 }
 
+/*
+ * Write one page: all LOADPAGE commands, the extended address and the
+ * WRITEPAGE command are sent as one batch.
+ */
+static int linuxspi_paged_write(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m,
+                                unsigned int page_size, unsigned int addr,
+                                unsigned int n_bytes)
+{
+    OPCODE *lo = m->op[AVR_OP_LOADPAGE_LO], *hi = m->op[AVR_OP_LOADPAGE_HI];
+    OPCODE *wp = m->op[AVR_OP_WRITEPAGE], *lext = m->op[AVR_OP_LOAD_EXT_ADDR];
+    OPCODE *op;
+    unsigned char *tx, *rx, *cmd;
+    unsigned int a, end;
+    int ncmds, rc;
+
+    /* memories not programmed page by page are written byte-wise */
+    if (!m->paged || lo == NULL || hi == NULL || wp == NULL)
+        return -2;
+
+    end = addr + n_bytes > (unsigned int)m->size ? (unsigned int)m->size : addr + n_bytes;
+
+    tx = calloc(end - addr + 2, 4);
+    rx = malloc(4 * (end - addr + 2));
+    if (tx == NULL || rx == NULL) {
+        avrdude_message(MSG_INFO, "%s: linuxspi_paged_write(): out of memory\n", progname);
+        free(tx);
+        free(rx);
+        return -1;
+    }
+
+    ncmds = 0;
+    for (a = addr; a < end; a++) {
+        op = (a & 1) ? hi : lo;
+        cmd = tx + 4 * ncmds++;
+        avr_set_bits(op, cmd);
+        avr_set_addr(op, cmd, a / 2);
+        avr_set_input(op, cmd, m->buf[a]);
+    }
+    if (lext != NULL) {
+        cmd = tx + 4 * ncmds++;
+        avr_set_bits(lext, cmd);
+        avr_set_addr(lext, cmd, addr / 2);
+    }
+    cmd = tx + 4 * ncmds++;
+    avr_set_bits(wp, cmd);
+    avr_set_addr(wp, cmd, addr / 2);
+
+    pgm->pgm_led(pgm, ON);
+    rc = linuxspi_spi_cmds(pgm, tx, rx, ncmds);
+    /* be conservative about the target voltage, as avr_write_page() is */
+    usleep(m->max_write_delay);
+    pgm->pgm_led(pgm, OFF);
+
+    free(tx);
+    free(rx);
+
+    return rc < 0 ? -1 : (int)n_bytes;
+}
+
+/*
+ * Read a block of memory with one batch of read commands.
+ */
+static int linuxspi_paged_load(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m,
+                               unsigned int page_size, unsigned int addr,
+                               unsigned int n_bytes)
+{
+    OPCODE *lo = m->op[AVR_OP_READ_LO], *hi = m->op[AVR_OP_READ_HI];
+    OPCODE *rd = m->op[AVR_OP_READ], *lext = m->op[AVR_OP_LOAD_EXT_ADDR];
+    OPCODE *op;
+    unsigned char *tx, *rx, *cmd;
+    unsigned int a, end;
+    int ncmds, first, words, rc;
+
+    if (lo != NULL && hi != NULL)
+        words = 1;
+    else if (rd != NULL)
+        words = 0;
+    else
+        return -2;
+
+    end = addr + n_bytes > (unsigned int)m->size ? (unsigned int)m->size : addr + n_bytes;
+
+    tx = calloc(end - addr + 1, 4);
+    rx = malloc(4 * (end - addr + 1));
+    if (tx == NULL || rx == NULL) {
+        avrdude_message(MSG_INFO, "%s: linuxspi_paged_load(): out of memory\n", progname);
+        free(tx);
+        free(rx);
+        return -1;
+    }
+
+    ncmds = 0;
+    if (words && lext != NULL) {
+        cmd = tx + 4 * ncmds++;
+        avr_set_bits(lext, cmd);
+        avr_set_addr(lext, cmd, addr / 2);
+    }
+    first = ncmds;
+    for (a = addr; a < end; a++) {
+        op = words ? ((a & 1) ? hi : lo) : rd;
+        cmd = tx + 4 * ncmds++;
+        avr_set_bits(op, cmd);
+        avr_set_addr(op, cmd, words ? a / 2 : a);
+    }
+
+    pgm->pgm_led(pgm, ON);
+    rc = linuxspi_spi_cmds(pgm, tx, rx, ncmds);
+    pgm->pgm_led(pgm, OFF);
+
+    if (rc == 0) {
+        for (a = addr; a < end; a++) {
+            op = words ? ((a & 1) ? hi : lo) : rd;
+            m->buf[a] = 0;
+            avr_get_output(op, rx + 4 * (first + a - addr), &m->buf[a]);
+        }
+    }
+
+    free(tx);
+    free(rx);
+
+    return rc < 0 ? -1 : (int)n_bytes;
+}
+
 void linuxspi_initpgm(PROGRAMMER *pgm)
 {
     strcpy(pgm->type, LINUXSPI);
@@ -283,6 +449,8 @@ void linuxspi_initpgm(PROGRAMMER *pgm)
     pgm->write_byte     = avr_write_byte_default;
 
     /* optional functions */
+    pgm->paged_write    = linuxspi_paged_write;
+    pgm->paged_load     = linuxspi_paged_load;
     pgm->setup          = linuxspi_setup;
     pgm->teardown       = linuxspi_teardown;
 }
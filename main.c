@@ -44,18 +44,22 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#if !defined(WIN32NATIVE)
+#  include <sys/wait.h>
+#endif
 
 #include "avrdude.h"
 #include "libavrdude.h"
 
+#include "server.h"
 #include "term.h"
 
 
 /* Get VERSION from ac_cfg.h */
 char * version      = VERSION;
 
-char * progname;
-char   progbuf[PATH_MAX]; /* temporary buffer of spaces the same
+LIBAVRDUDE_TLS char * progname;
+LIBAVRDUDE_TLS char   progbuf[PATH_MAX]; /* temporary buffer of spaces the same
                              length as progname; used for lining up
                              multiline messages */
 
@@ -86,12 +90,28 @@ static LISTID additional_config_files = NULL;
 
 static PROGRAMMER * pgm;
 
+/*
+ * One target of a gang programming run (-G option).
+ */
+struct gang_target {
+  char * programmer;
+  char * port;
+  char * partdesc;
+  pid_t  pid;
+  int    status;
+  struct timeval start;
+  struct timeval end;
+};
+
+static LISTID gang_targets = NULL;
+static AVRPART * gang_part = NULL;  /* part the inputs were read for */
+
 /*
  * global options
  */
-int    verbose;     /* verbose output */
-int    quell_progress; /* un-verebose output */
-int    ovsigck;     /* 1=override sig check, 0=don't */
+LIBAVRDUDE_TLS int    verbose;     /* verbose output */
+LIBAVRDUDE_TLS int    quell_progress; /* un-verebose output */
+LIBAVRDUDE_TLS int    ovsigck;     /* 1=override sig check, 0=don't */
 
 
 
@@ -110,7 +130,9 @@ static void usage(void)
  "  -C <config-file>           Specify location of configuration file.\n"
  "  -c <programmer>            Specify programmer type.\n"
  "  -D                         Disable auto erase for flash memory\n"
+ "  -d                         Only write pages that differ from the device.\n"
  "  -i <delay>                 ISP Clock Delay [in microseconds]\n"
+ "  -k                         Recalibrate the bitbang delay loop.\n"
  "  -P <port>                  Specify connection port.\n"
  "  -F                         Override invalid signature check.\n"
  "  -e                         Perform a chip erase.\n"
@@ -119,13 +141,17 @@ static void usage(void)
  "                             Memory operation specification.\n"
  "                             Multiple -U options are allowed, each request\n"
  "                             is performed in the order specified.\n"
+ "                             Memtype \"all\" takes every memory from an ELF file.\n"
+ "  -R <bytes>                 Data bytes per record in hex output files.\n"
  "  -n                         Do not write anything to the device.\n"
  "  -V                         Do not verify.\n"
  "  -u                         Disable safemode, default when running from a script.\n"
+ "  -S <socket>                Keep the programmer open and serve jobs on <socket>.\n"
  "  -s                         Silent safemode operation, will not ask you if\n"
  "                             fuses should be changed back.\n"
  "  -t                         Enter terminal mode.\n"
  "  -E <exitspec>[,<exitspec>] List programmer exit specifications.\n"
+ "  -G <gangfile>              Program all targets listed in <gangfile> at once.\n"
  "  -x <extended_param>        Pass <extended_param> to programmer.\n"
  "  -y                         Count # erase cycles in EEPROM.\n"
  "  -Y <number>                Initialize erase cycle # in EEPROM.\n"
@@ -279,6 +305,197 @@ static void list_parts(FILE * f, const char *prefix, LISTID avrparts)
     walk_avrparts(avrparts, list_avrparts_callback, &c);
 }
 
+/*
+ * Locate any -U options using the default memory region, and fill in
+ * the device-dependent default region name, either "application" (for
+ * Xmega devices), or "flash" (everything else).
+ */
+static int default_memtypes(AVRPART * p)
+{
+  LNODEID ln;
+  UPDATE * upd;
+
+  for (ln=lfirst(updates); ln; ln=lnext(ln)) {
+    upd = ldata(ln);
+    if (upd->memtype == NULL) {
+      const char *mtype = (p->flags & AVRPART_HAS_PDI)? "application": "flash";
+      avrdude_message(MSG_NOTICE2, "%s: defaulting memtype in -U %c:%s option to \"%s\"\n",
+                      progname,
+                      (upd->op == DEVICE_READ)? 'r': (upd->op == DEVICE_VERIFY)? 'v': 'w',
+                      upd->filename, mtype);
+      if ((upd->memtype = strdup(mtype)) == NULL) {
+        avrdude_message(MSG_INFO, "%s: out of memory\n", progname);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Read the list of gang programming targets from "file".  Each line
+ * holds a programmer id, a port, and optionally a part id; empty lines
+ * and lines starting with '#' are ignored.
+ */
+static int gang_read(const char * file)
+{
+  FILE * f;
+  char line[1024];
+  char * prog, * port, * part;
+  struct gang_target * t;
+  int lineno = 0;
+
+  if ((f = fopen(file, "r")) == NULL) {
+    avrdude_message(MSG_INFO, "%s: can't open gang file \"%s\": %s\n",
+                    progname, file, strerror(errno));
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    if ((prog = strtok(line, " \t\r\n")) == NULL || prog[0] == '#')
+      continue;
+    if ((port = strtok(NULL, " \t\r\n")) == NULL) {
+      avrdude_message(MSG_INFO, "%s: %s:%d: no port given for programmer \"%s\"\n",
+                      progname, file, lineno, prog);
+      fclose(f);
+      return -1;
+    }
+    part = strtok(NULL, " \t\r\n");
+
+    if ((t = calloc(1, sizeof(struct gang_target))) == NULL ||
+        (t->programmer = strdup(prog)) == NULL ||
+        (t->port = strdup(port)) == NULL ||
+        (part != NULL && (t->partdesc = strdup(part)) == NULL)) {
+      avrdude_message(MSG_INFO, "%s: out of memory\n", progname);
+      fclose(f);
+      return -1;
+    }
+    ladd(gang_targets, t);
+  }
+  fclose(f);
+
+  if (lsize(gang_targets) == 0) {
+    avrdude_message(MSG_INFO, "%s: gang file \"%s\" lists no targets\n",
+                    progname, file);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void gang_free_target(struct gang_target * t)
+{
+  free(t->programmer);
+  free(t->port);
+  free(t->partdesc);
+  free(t);
+}
+
+#if !defined(WIN32NATIVE)
+/*
+ * If all gang targets are the same part, read the -U input files once
+ * before the processes are started, so they share the images instead
+ * of each parsing the files again.  Otherwise, every process reads the
+ * files for its own part.
+ */
+static void gang_preload(char * partdesc)
+{
+  LNODEID ln;
+  struct gang_target * t;
+  AVRPART * p = NULL, * tp;
+
+  for (ln = lfirst(gang_targets); ln; ln = lnext(ln)) {
+    t = ldata(ln);
+    if (t->partdesc == NULL && partdesc == NULL)
+      return;
+    tp = locate_part(part_list, t->partdesc? t->partdesc: partdesc);
+    if (tp == NULL || (p != NULL && tp != p))
+      return;
+    p = tp;
+  }
+
+  if (avr_initmem(p) != 0 || default_memtypes(p) < 0)
+    exit(1);
+  gang_part = p;
+
+  preload_updates(updates, p);
+  /* no threads must be running while forking */
+  preload_updates_wait(updates);
+}
+
+/*
+ * Start one process per gang target.  The configuration has already
+ * been read at this point, so the children share it with the parent.
+ * In a child, the target to operate on is returned; the parent waits
+ * for all children, reports the results, and returns NULL.
+ */
+static struct gang_target * gang_run(int * exitrc)
+{
+  LNODEID ln;
+  struct gang_target * t;
+  pid_t pid;
+  int status, nok, running;
+  double etime;
+
+  fflush(stdout);
+  fflush(stderr);
+
+  running = 0;
+  for (ln = lfirst(gang_targets); ln; ln = lnext(ln)) {
+    t = ldata(ln);
+    gettimeofday(&t->start, NULL);
+    if ((t->pid = fork()) == 0)
+      return t;
+    if (t->pid < 0) {
+      avrdude_message(MSG_INFO, "%s: cannot start process for %s on %s: %s\n",
+                      progname, t->programmer, t->port, strerror(errno));
+      t->status = -1;
+      continue;
+    }
+    running++;
+  }
+
+  while (running > 0) {
+    if ((pid = wait(&status)) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    for (ln = lfirst(gang_targets); ln; ln = lnext(ln)) {
+      t = ldata(ln);
+      if (t->pid == pid) {
+        gettimeofday(&t->end, NULL);
+        t->status = WIFEXITED(status)? WEXITSTATUS(status): -1;
+        running--;
+        break;
+      }
+    }
+  }
+
+  avrdude_message(MSG_INFO, "\n%s: gang programming results:\n", progname);
+  nok = 0;
+  for (ln = lfirst(gang_targets); ln; ln = lnext(ln)) {
+    t = ldata(ln);
+    etime = t->pid > 0?
+      (t->end.tv_sec - t->start.tv_sec) +
+      (t->end.tv_usec - t->start.tv_usec) / 1000000.0: 0.0;
+    avrdude_message(MSG_INFO, "%s%-20s %-12s %-12s %-6s %6.2fs\n",
+                    progbuf, t->port, t->programmer,
+                    t->partdesc? t->partdesc: "",
+                    t->status == 0? "OK": "FAILED", etime);
+    if (t->status == 0)
+      nok++;
+  }
+  avrdude_message(MSG_INFO, "%s: %d of %d targets succeeded\n\n",
+                  progname, nok, lsize(gang_targets));
+
+  *exitrc = nok == lsize(gang_targets)? 0: 1;
+  return NULL;
+}
+#endif /* !WIN32NATIVE */
+
 static void exithook(void)
 {
     if (pgm->teardown)
@@ -299,6 +516,10 @@ static void cleanup_main(void)
         ldestroy(additional_config_files);
         additional_config_files = NULL;
     }
+    if (gang_targets) {
+        ldestroy_cb(gang_targets, (void(*)(void*))gang_free_target);
+        gang_targets = NULL;
+    }
 
     cleanup_config();
 }
@@ -340,6 +561,9 @@ int main(int argc, char * argv [])
   int     init_ok;     /* Device initialization worked well */
   int     is_open;     /* Device open succeeded */
   char  * logfile;     /* Use logfile rather than stderr for diagnostics */
+  char  * gangfile;    /* list of targets to program at once */
+  char  * sockpath;    /* serve jobs on this socket (-S) */
+  enum updateflags job_uflags; /* flags for jobs in server mode */
   enum updateflags uflags = UF_AUTO_ERASE; /* Flags for do_op() */
   unsigned char safemode_lfuse = 0xff;
   unsigned char safemode_hfuse = 0xff;
@@ -399,12 +623,19 @@ int main(int argc, char * argv [])
     exit(1);
   }
 
+  gang_targets = lcreat(NULL, 0);
+  if (gang_targets == NULL) {
+    avrdude_message(MSG_INFO, "%s: cannot initialize gang target list\n", progname);
+    exit(1);
+  }
+
   partdesc      = NULL;
   port          = NULL;
   erase         = 0;
   calibrate     = 0;
   p             = NULL;
   ovsigck       = 0;
+  bitbang_recalibrate = 0;
   terminal      = 0;
   verify        = 1;        /* on by default */
   quell_progress = 0;
@@ -419,6 +650,8 @@ int main(int argc, char * argv [])
   silentsafe    = 0;       /* Ask by default */
   is_open       = 0;
   logfile       = NULL;
+  gangfile      = NULL;
+  sockpath      = NULL;
 
 #if defined(WIN32NATIVE)
 
@@ -462,7 +695,7 @@ int main(int argc, char * argv [])
   /*
    * process command line arguments
    */
-  while ((ch = getopt(argc,argv,"?b:B:c:C:DeE:Fi:l:np:OP:qstU:uvVx:yY:")) != -1) {
+  while ((ch = getopt(argc,argv,"?b:B:c:C:DdeE:FG:i:kl:np:OP:qR:sS:tU:uvVx:yY:")) != -1) {
 
     switch (ch) {
       case 'b': /* override default programmer baud rate */
@@ -550,6 +783,10 @@ int main(int argc, char * argv [])
         uflags &= ~UF_AUTO_ERASE;
         break;
 
+      case 'd': /* differential write */
+        uflags |= UF_DIFF_WRITE;
+        break;
+
       case 'e': /* perform a chip erase */
         erase = 1;
         uflags &= ~UF_AUTO_ERASE;
@@ -559,10 +796,18 @@ int main(int argc, char * argv [])
         exitspecs = optarg;
         break;
 
+      case 'G': /* gang programming */
+        gangfile = optarg;
+        break;
+
       case 'F': /* override invalid signature check */
         ovsigck = 1;
         break;
 
+      case 'k': /* ignore cached bitbang delay calibration */
+        bitbang_recalibrate = 1;
+        break;
+
       case 'l':
 	logfile = optarg;
 	break;
@@ -587,11 +832,25 @@ int main(int argc, char * argv [])
         quell_progress++ ;
         break;
 
+      case 'R': /* data bytes per Intel Hex / S-Record output record */
+        fileio_hexrecsize = strtol(optarg, &e, 0);
+        if ((e == optarg) || (*e != 0) || fileio_hexrecsize < 1 ||
+            fileio_hexrecsize > 255) {
+          avrdude_message(MSG_INFO, "%s: invalid record size specified '%s'\n",
+                  progname, optarg);
+          exit(1);
+        }
+        break;
+
       case 's' : /* Silent safemode */
         silentsafe = 1;
         safemode = 1;
         break;
         
+      case 'S': /* server mode */
+        sockpath = optarg;
+        break;
+
       case 't': /* enter terminal mode */
         terminal = 1;
         break;
@@ -609,11 +868,8 @@ int main(int argc, char * argv [])
         }
         ladd(updates, upd);
 
-        if (verify && upd->op == DEVICE_WRITE) {
-          upd = dup_update(upd);
-          upd->op = DEVICE_VERIFY;
-          ladd(updates, upd);
-        }
+        if (verify && upd->op == DEVICE_WRITE)
+          upd->op = DEVICE_WRITE_VERIFY;
         break;
 
       case 'v':
@@ -738,6 +994,68 @@ int main(int argc, char * argv [])
 
   avrdude_message(MSG_NOTICE, "\n");
 
+  if (gangfile != NULL) {
+#if defined(WIN32NATIVE)
+    avrdude_message(MSG_INFO, "%s: gang programming (-G) is not supported on this platform\n",
+                    progname);
+    exit(1);
+#else
+    struct gang_target * t;
+
+    if (terminal || sockpath != NULL) {
+      avrdude_message(MSG_INFO, "%s: -t and -S cannot be used with -G\n",
+                      progname);
+      exit(1);
+    }
+    for (ln=lfirst(updates); ln; ln=lnext(ln)) {
+      upd = ldata(ln);
+      if (upd->op != DEVICE_READ && upd->format != FMT_IMM &&
+          (strcmp(upd->filename, "-") == 0 ||
+           fileio_is_stream(upd->filename, upd->format))) {
+        avrdude_message(MSG_INFO, "%s: input from stdin or a pipe cannot be used with -G\n",
+                        progname);
+        exit(1);
+      }
+    }
+    if (gang_read(gangfile) < 0)
+      exit(1);
+    gang_preload(partdesc);
+
+    if ((t = gang_run(&exitrc)) == NULL)
+      return exitrc;
+
+    /*
+     * Child process: operate on this target like a normal avrdude
+     * run would, without progress bars and without reading from the
+     * shared terminal.
+     */
+    programmer = t->programmer;
+    port = t->port;
+    if (t->partdesc != NULL)
+      partdesc = t->partdesc;
+    update_progress = NULL;
+    if (freopen("/dev/null", "r", stdin) == NULL) {
+      avrdude_message(MSG_INFO, "%s: cannot redirect stdin: %s\n",
+                      progname, strerror(errno));
+      exit(1);
+    }
+
+    len = strlen(progname) + strlen(port) + 3;
+    if ((e = malloc(len)) == NULL) {
+      avrdude_message(MSG_INFO, "%s: out of memory\n", progname);
+      exit(1);
+    }
+    snprintf(e, len, "%s[%s]", progname, port);
+    progname = e;
+    len = strlen(progname) + 2;
+    if (len >= (int)sizeof(progbuf))
+      len = sizeof(progbuf) - 1;
+    for (i=0; i<len; i++)
+      progbuf[i] = ' ';
+    progbuf[i] = 0;
+#endif
+  }
+
   if (partdesc) {
     if (strcmp(partdesc, "?") == 0) {
       avrdude_message(MSG_INFO, "\n");
@@ -888,7 +1206,8 @@ int main(int argc, char * argv [])
   }
 
 
-  if (avr_initmem(p) != 0)
+  /* with -G, the memories may already have been set up by gang_preload() */
+  if (p != gang_part && avr_initmem(p) != 0)
   {
     avrdude_message(MSG_INFO, "\n%s: failed to initialize memories\n",
             progname);
@@ -896,25 +1215,17 @@ int main(int argc, char * argv [])
   }
 
   /*
-   * Now that we know which part we are going to program, locate any
-   * -U options using the default memory region, and fill in the
-   * device-dependent default region name, either "application" (for
-   * Xmega devices), or "flash" (everything else).
+   * Now that we know which part we are going to program, fill in the
+   * default memory region of the -U options.
    */
-  for (ln=lfirst(updates); ln; ln=lnext(ln)) {
-    upd = ldata(ln);
-    if (upd->memtype == NULL) {
-      const char *mtype = (p->flags & AVRPART_HAS_PDI)? "application": "flash";
-      avrdude_message(MSG_NOTICE2, "%s: defaulting memtype in -U %c:%s option to \"%s\"\n",
-                      progname,
-                      (upd->op == DEVICE_READ)? 'r': (upd->op == DEVICE_WRITE)? 'w': 'v',
-                      upd->filename, mtype);
-      if ((upd->memtype = strdup(mtype)) == NULL) {
-        avrdude_message(MSG_INFO, "%s: out of memory\n", progname);
-        exit(1);
-      }
-    }
-  }
+  if (default_memtypes(p) < 0)
+    exit(1);
+
+  /*
+   * Start reading the input files while the programmer connects to
+   * the device; do_op() picks up the images later.
+   */
+  preload_updates(updates, p);
 
   /*
    * open the programmer
@@ -1194,6 +1505,7 @@ int main(int argc, char * argv [])
     }
   }
 
+  job_uflags = uflags;
   if (uflags & UF_AUTO_ERASE) {
     if ((p->flags & AVRPART_HAS_PDI) && pgm->page_erase != NULL &&
         lsize(updates) > 0) {
@@ -1210,10 +1522,13 @@ int main(int argc, char * argv [])
       uflags &= ~UF_AUTO_ERASE;
       for (ln=lfirst(updates); ln; ln=lnext(ln)) {
         upd = ldata(ln);
-        m = avr_locate_mem(p, upd->memtype);
+        /* "all" includes the flash */
+        m = avr_locate_mem(p, strcasecmp(upd->memtype, "all") == 0?
+                           (char *)memname: upd->memtype);
         if (m == NULL)
           continue;
-        if ((strcasecmp(m->desc, memname) == 0) && (upd->op == DEVICE_WRITE)) {
+        if ((strcasecmp(m->desc, memname) == 0) &&
+            (upd->op == DEVICE_WRITE || upd->op == DEVICE_WRITE_VERIFY)) {
           erase = 1;
           if (quell_progress < 2) {
             avrdude_message(MSG_INFO, "%s: NOTE: \"%s\" memory has been specified, an erase cycle "
@@ -1227,6 +1542,41 @@ int main(int argc, char * argv [])
     }
   }
 
+  if (uflags & UF_DIFF_WRITE) {
+    /*
+     * A flash page can only be programmed after it has been erased.
+     * Unless each page is erased before writing it (Xmega page
+     * erase), -d has nothing to skip after a chip erase, and without
+     * any erase it would program the differing pages on top of their
+     * old contents.
+     */
+    const char *memname = (p->flags & AVRPART_HAS_PDI)? "application": "flash";
+    AVRMEM * m;
+
+    for (ln=lfirst(updates); ln; ln=lnext(ln)) {
+      upd = ldata(ln);
+      m = avr_locate_mem(p, strcasecmp(upd->memtype, "all") == 0?
+                         (char *)memname: upd->memtype);
+      if (m != NULL && strcasecmp(m->desc, memname) == 0 &&
+          (upd->op == DEVICE_WRITE || upd->op == DEVICE_WRITE_VERIFY))
+        break;
+    }
+    if (ln != NULL && !(uflags & UF_AUTO_ERASE) && !(uflags & UF_NOWRITE)) {
+      if (!erase) {
+        avrdude_message(MSG_INFO, "%s: -d cannot be used to write \"%s\" memory without "
+                        "erasing it, as the programmer cannot erase single pages\n",
+                        progname, memname);
+        exitrc = 1;
+        goto main_exit;
+      }
+      if (quell_progress < 2) {
+        avrdude_message(MSG_INFO, "%s: NOTE: after the chip erase, -d does not read back "
+                        "or skip any \"%s\" pages\n",
+                        progname, memname);
+      }
+    }
+  }
+
   if (init_ok && erase) {
     /*
      * erase the chip's flash and eeprom memories, this is required
@@ -1241,6 +1591,7 @@ int main(int argc, char * argv [])
       }
       exitrc = avr_chip_erase(pgm, p);
       if(exitrc) goto main_exit;
+      uflags |= UF_CHIP_ERASED;
     }
   }
 
@@ -1431,6 +1782,13 @@ int main(int argc, char * argv [])
 
   }
 
+  if (sockpath != NULL && exitrc == 0) {
+    /*
+     * server mode
+     */
+    exitrc = server_mode(pgm, p, sockpath, job_uflags, verify) < 0;
+  }
+
 
 main_exit:
 
@@ -21,6 +21,7 @@
 
 #include "ac_cfg.h"
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -134,6 +135,8 @@ PROGRAMMER * pgm_new(void)
   pgm->parseextparams = NULL;
   pgm->setup          = NULL;
   pgm->teardown       = NULL;
+  pgm->setpins        = NULL;
+  pgm->waveform       = NULL;
 
   return pgm;
 }
@@ -259,6 +262,86 @@ void pgm_display_generic(PROGRAMMER * pgm, const char * p)
   pgm_display_generic_mask(pgm, p, SHOW_ALL_PINS);
 }
 
+/*
+ * Lookup index over a list of programmers, see index_programmers().
+ * This is an open-addressed hash table keyed on the (case-insensitive)
+ * programmer ids; an entry with pgm == NULL marks an empty slot.
+ */
+struct pgmidx_ent {
+  const char * id;
+  PROGRAMMER * pgm;
+};
+
+static struct {
+  LISTID list;                  /* list the index is valid for */
+  int npgms;                    /* lsize(list) at the time of indexing */
+  unsigned int mask;            /* table size - 1 */
+  struct pgmidx_ent * tbl;
+} pgmidx;
+
+static struct pgmidx_ent * pgmidx_slot(const char * id)
+{
+  const char * s;
+  unsigned int i, h;
+
+  for (h = 2166136261U, s = id; *s; s++)
+    h = (h ^ (unsigned char)tolower((unsigned char)*s)) * 16777619U;
+
+  for (i = h & pgmidx.mask;
+       pgmidx.tbl[i].pgm != NULL && strcasecmp(pgmidx.tbl[i].id, id) != 0;
+       i = (i + 1) & pgmidx.mask)
+    ;
+
+  return &pgmidx.tbl[i];
+}
+
+/*
+ * Build the index used by locate_programmer() for the list of
+ * programmers given as "programmers", replacing any previous index.
+ * Passing NULL just discards the index.  The index must be rebuilt or
+ * discarded whenever the list is modified.
+ */
+void index_programmers(LISTID programmers)
+{
+  LNODEID ln1, ln2;
+  PROGRAMMER * p;
+  struct pgmidx_ent * e;
+  unsigned int size;
+  int nids;
+
+  free(pgmidx.tbl);
+  memset(&pgmidx, 0, sizeof(pgmidx));
+
+  if (programmers == NULL)
+    return;
+
+  for (nids = 0, ln1 = lfirst(programmers); ln1; ln1 = lnext(ln1))
+    nids += lsize(((PROGRAMMER *)ldata(ln1))->id);
+  for (size = 16; size < 2U * nids; size <<= 1)
+    ;
+
+  if ((pgmidx.tbl = calloc(size, sizeof(struct pgmidx_ent))) == NULL) {
+    avrdude_message(MSG_INFO, "%s: index_programmers(): out of memory\n",
+                    progname);
+    return;
+  }
+  pgmidx.mask = size - 1;
+
+  /* first definition of an id wins, as with a linear search */
+  for (ln1 = lfirst(programmers); ln1; ln1 = lnext(ln1)) {
+    p = ldata(ln1);
+    for (ln2 = lfirst(p->id); ln2; ln2 = lnext(ln2)) {
+      if ((e = pgmidx_slot(ldata(ln2)))->pgm == NULL) {
+        e->id = ldata(ln2);
+        e->pgm = p;
+      }
+    }
+  }
+
+  pgmidx.list = programmers;
+  pgmidx.npgms = lsize(programmers);
+}
+
 PROGRAMMER * locate_programmer(LISTID programmers, const char * configid)
 {
   LNODEID ln1, ln2;
@@ -266,6 +349,10 @@ PROGRAMMER * locate_programmer(LISTID programmers, const char * configid)
   const char * id;
   int found;
 
+  if (pgmidx.list != NULL && pgmidx.list == programmers &&
+      pgmidx.npgms == lsize(programmers))
+    return pgmidx_slot(configid)->pgm;
+
   found = 0;
 
   for (ln1=lfirst(programmers); ln1 && !found; ln1=lnext(ln1)) {
@@ -328,5 +415,9 @@ static int sort_programmer_compare(PROGRAMMER * p1,PROGRAMMER * p2)
 void sort_programmers(LISTID programmers)
 {
   lsort(programmers,(int (*)(void*, void*)) sort_programmer_compare);
+
+  /* the order decides between duplicate ids, so rebuild the index */
+  if (pgmidx.list == programmers)
+    index_programmers(programmers);
 }
 
@@ -290,10 +290,10 @@ int safemode_readfuses (unsigned char * lfuse, unsigned char * hfuse,
 int safemode_memfuses (int save, unsigned char * lfuse, unsigned char * hfuse,
                        unsigned char * efuse, unsigned char * fuse)
 {
-  static unsigned char safemode_lfuse = 0xff;
-  static unsigned char safemode_hfuse = 0xff;
-  static unsigned char safemode_efuse = 0xff;
-  static unsigned char safemode_fuse = 0xff;
+  static LIBAVRDUDE_TLS unsigned char safemode_lfuse = 0xff;
+  static LIBAVRDUDE_TLS unsigned char safemode_hfuse = 0xff;
+  static LIBAVRDUDE_TLS unsigned char safemode_efuse = 0xff;
+  static LIBAVRDUDE_TLS unsigned char safemode_fuse = 0xff;
 
   switch (save) {
 
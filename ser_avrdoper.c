@@ -56,9 +56,9 @@
 
 static int  reportDataSizes[4] = {13, 29, 61, 125};
 
-static unsigned char    avrdoperRxBuffer[280];  /* buffer for receive data */
-static int              avrdoperRxLength = 0;   /* amount of valid bytes in rx buffer */
-static int              avrdoperRxPosition = 0; /* amount of bytes already consumed in rx buffer */
+static LIBAVRDUDE_TLS unsigned char avrdoperRxBuffer[280];  /* buffer for receive data */
+static LIBAVRDUDE_TLS int avrdoperRxLength = 0;   /* amount of valid bytes in rx buffer */
+static LIBAVRDUDE_TLS int avrdoperRxPosition = 0; /* amount of bytes already consumed in rx buffer */
 
 /* ------------------------------------------------------------------------ */
 /* ------------------------------------------------------------------------ */
@@ -392,7 +392,7 @@ static void dumpBlock(const char *prefix, const unsigned char *buf, int len)
 
 static char *usbErrorText(int usbErrno)
 {
-    static char buffer[32];
+    static LIBAVRDUDE_TLS char buffer[32];
 
     switch(usbErrno){
         case USB_ERROR_NONE:    return "Success.";
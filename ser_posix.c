@@ -45,7 +45,7 @@
 #include "avrdude.h"
 #include "libavrdude.h"
 
-long serial_recv_timeout = 5000; /* ms */
+LIBAVRDUDE_TLS long serial_recv_timeout = 5000; /* ms */
 
 struct baud_mapping {
   long baud;
@@ -73,8 +73,29 @@ static struct baud_mapping baud_lookup_table [] = {
   { 0,      0 }                 /* Terminator. */
 };
 
-static struct termios original_termios;
-static int saved_original_termios;
+static LIBAVRDUDE_TLS struct termios original_termios;
+static LIBAVRDUDE_TLS int saved_original_termios;
+
+/*
+ * Read-ahead buffer.  ser_recv() fetches whatever the kernel has
+ * pending in a single read(), and satisfies subsequent requests from
+ * here, so protocols that receive their replies byte by byte do not
+ * pay for a select()/read() pair per byte.
+ */
+#define SER_RABUF_SIZE 1024
+
+static LIBAVRDUDE_TLS struct {
+  int fd;                       /* descriptor the buffered data belongs to */
+  size_t rpos;                  /* next byte to hand out */
+  size_t len;                   /* number of valid bytes in buf */
+  unsigned char buf[SER_RABUF_SIZE];
+} rabuf = { .fd = -1 };
+
+static void ser_rabuf_reset(int fd)
+{
+  rabuf.fd = fd;
+  rabuf.rpos = rabuf.len = 0;
+}
 
 static speed_t serial_baud_lookup(long baud)
 {
@@ -225,6 +246,7 @@ net_open(const char *port, union filedescriptor *fdp)
   }
   else {
     fdp->ifd = fd;
+    ser_rabuf_reset(fd);
     ret = 0;
   }
   freeaddrinfo(result);
@@ -305,6 +327,9 @@ static int ser_open(char * port, union pinfo pinfo, union filedescriptor *fdp)
     close(fd);
     return -1;
   }
+
+  ser_rabuf_reset(fd);
+
   return 0;
 }
 
@@ -323,6 +348,7 @@ static void ser_close(union filedescriptor *fd)
     saved_original_termios = 0;
   }
 
+  ser_rabuf_reset(-1);
   close(fd->ifd);
 }
 
@@ -380,12 +406,30 @@ static int ser_recv(union filedescriptor *fd, unsigned char * buf, size_t buflen
   int rc;
   unsigned char * p = buf;
   size_t len = 0;
+  size_t n;
+
+  if (rabuf.fd != fd->ifd)
+    ser_rabuf_reset(fd->ifd);
 
   timeout.tv_sec  = serial_recv_timeout / 1000L;
   timeout.tv_usec = (serial_recv_timeout % 1000L) * 1000;
   to2 = timeout;
 
   while (len < buflen) {
+    /*
+     * Hand out what is left over from a previous read() first.
+     */
+    if (rabuf.rpos < rabuf.len) {
+      n = rabuf.len - rabuf.rpos;
+      if (n > buflen - len)
+        n = buflen - len;
+      memcpy(p, rabuf.buf + rabuf.rpos, n);
+      rabuf.rpos += n;
+      p += n;
+      len += n;
+      continue;
+    }
+
   reselect:
     FD_ZERO(&rfds);
     FD_SET(fd->ifd, &rfds);
@@ -409,14 +453,14 @@ static int ser_recv(union filedescriptor *fd, unsigned char * buf, size_t buflen
       }
     }
 
-    rc = read(fd->ifd, p, (buflen - len > 1024) ? 1024 : buflen - len);
+    rc = read(fd->ifd, rabuf.buf, sizeof(rabuf.buf));
     if (rc < 0) {
       avrdude_message(MSG_INFO, "%s: ser_recv(): read error: %s\n",
               progname, strerror(errno));
       return -1;
     }
-    p += rc;
-    len += rc;
+    rabuf.rpos = 0;
+    rabuf.len = rc;
   }
 
   p = buf;
@@ -450,8 +494,8 @@ static int ser_drain(union filedescriptor *fd, int display)
   struct timeval timeout;
   fd_set rfds;
   int nfds;
-  int rc;
-  unsigned char buf;
+  int rc, i;
+  unsigned char buf[64];
 
   timeout.tv_sec = 0;
   timeout.tv_usec = 250000;
@@ -460,6 +504,17 @@ static int ser_drain(union filedescriptor *fd, int display)
     avrdude_message(MSG_INFO, "drain>");
   }
 
+  /*
+   * Discard anything already fetched into the read-ahead buffer.
+   */
+  if (rabuf.fd == fd->ifd) {
+    if (display) {
+      while (rabuf.rpos < rabuf.len)
+        avrdude_message(MSG_INFO, "%02x ", rabuf.buf[rabuf.rpos++]);
+    }
+  }
+  ser_rabuf_reset(fd->ifd);
+
   while (1) {
     FD_ZERO(&rfds);
     FD_SET(fd->ifd, &rfds);
@@ -484,14 +539,15 @@ static int ser_drain(union filedescriptor *fd, int display)
       }
     }
 
-    rc = read(fd->ifd, &buf, 1);
+    rc = read(fd->ifd, buf, sizeof(buf));
     if (rc < 0) {
       avrdude_message(MSG_INFO, "%s: ser_drain(): read error: %s\n",
               progname, strerror(errno));
       return -1;
     }
     if (display) {
-      avrdude_message(MSG_INFO, "%02x ", buf);
+      for (i = 0; i < rc; i++)
+        avrdude_message(MSG_INFO, "%02x ", buf[i]);
     }
   }
 
@@ -510,6 +566,6 @@ struct serial_device serial_serdev =
   .flags = SERDEV_FL_CANSETSPEED,
 };
 
-struct serial_device *serdev = &serial_serdev;
+LIBAVRDUDE_TLS struct serial_device *serdev = &serial_serdev;
 
 #endif  /* WIN32NATIVE */
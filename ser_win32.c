@@ -40,7 +40,7 @@
 #include "avrdude.h"
 #include "libavrdude.h"
 
-long serial_recv_timeout = 5000; /* ms */
+LIBAVRDUDE_TLS long serial_recv_timeout = 5000; /* ms */
 
 #define W32SERBUFSIZE 1024
 
@@ -693,6 +693,6 @@ struct serial_device serial_serdev =
   .flags = SERDEV_FL_CANSETSPEED,
 };
 
-struct serial_device *serdev = &serial_serdev;
+LIBAVRDUDE_TLS struct serial_device *serdev = &serial_serdev;
 
 #endif /* WIN32NATIVE */
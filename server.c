@@ -0,0 +1,440 @@
+/*
+ * avrdude - A Downloader/Uploader for AVR device programmers
+ * Copyright (C) 2026 The AVRDUDE authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$ */
+
+/*
+ * Server mode: keep the programmer open and the device in programming
+ * mode, and accept jobs over a local (UNIX domain) socket.
+ *
+ * A job consists of lines of text, terminated by an empty line or the
+ * end of the connection:
+ *
+ *   -p <partno>     operate on this part (re-initializes the device if
+ *                   it differs from the current one)
+ *   -e              perform a chip erase
+ *   -U <spec>       memory operation, as on the command line
+ *   -R <n>          data bytes per Intel Hex / S-Record output record,
+ *                   for this job only
+ *   quit            terminate the server
+ *
+ * Each job is answered by a single line, either "ok" or "failed".
+ * Several jobs can be sent over one connection.
+ */
+
+#include "ac_cfg.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avrdude.h"
+#include "libavrdude.h"
+
+#include "server.h"
+
+#if !defined(WIN32NATIVE)
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SERVER_MAXLINE 1024
+
+struct server_job {
+  char * partdesc;              /* -p, or NULL for the current part */
+  int erase;                    /* -e */
+  LISTID updates;               /* -U */
+  int recsize;                  /* -R, or 0 for the command line value */
+  int quit;
+};
+
+static volatile sig_atomic_t server_stop;
+
+static void server_sighandler(int sig)
+{
+  server_stop = 1;
+}
+
+
+static void server_job_clear(struct server_job * job)
+{
+  free(job->partdesc);
+  job->partdesc = NULL;
+  job->erase = 0;
+  job->recsize = 0;
+  job->quit = 0;
+  if (job->updates != NULL)
+    ldestroy_cb(job->updates, (void(*)(void*))free_update);
+  job->updates = lcreat(NULL, 0);
+}
+
+
+/*
+ * If line "cp" is the two character option "opt", return its argument,
+ * or NULL if it is some other line, or lacks the argument.
+ */
+static char * server_option(char * cp, const char * opt)
+{
+  if (strncmp(cp, opt, 2) != 0)
+    return NULL;
+  for (cp += 2; *cp == ' ' || *cp == '\t'; cp++)
+    ;
+  return *cp != 0? cp: NULL;
+}
+
+
+/*
+ * Read one job from the client.  Returns 1 if a job has been read, 0
+ * if the client closed the connection without sending anything, and
+ * -1 if the job could not be parsed.
+ */
+static int server_read_job(FILE * f, struct server_job * job, int verify)
+{
+  char line[SERVER_MAXLINE];
+  char * cp, * arg, * e;
+  UPDATE * upd;
+  int nlines = 0, rc = 1;
+
+  server_job_clear(job);
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    cp = line + strlen(line);
+    while (cp > line && (cp[-1] == '\n' || cp[-1] == '\r' ||
+                         cp[-1] == ' ' || cp[-1] == '\t'))
+      *--cp = 0;
+    for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
+      ;
+    if (*cp == 0) {
+      if (nlines > 0)
+        return rc;
+      continue;                 /* ignore empty lines between jobs */
+    }
+    nlines++;
+
+    if (strcmp(cp, "quit") == 0) {
+      job->quit = 1;
+    } else if (strcmp(cp, "-e") == 0) {
+      job->erase = 1;
+    } else if ((arg = server_option(cp, "-p")) != NULL) {
+      free(job->partdesc);
+      job->partdesc = strdup(arg);
+    } else if ((arg = server_option(cp, "-U")) != NULL) {
+      if ((upd = parse_op(arg)) == NULL) {
+        avrdude_message(MSG_INFO, "%s: server: error parsing update operation '%s'\n",
+                        progname, arg);
+        rc = -1;
+        continue;
+      }
+      if (verify && upd->op == DEVICE_WRITE)
+        upd->op = DEVICE_WRITE_VERIFY;
+      ladd(job->updates, upd);
+    } else if ((arg = server_option(cp, "-R")) != NULL) {
+      job->recsize = strtol(arg, &e, 0);
+      if (*e != 0 || job->recsize < 1 || job->recsize > 255) {
+        avrdude_message(MSG_INFO, "%s: server: invalid record size specified '%s'\n",
+                        progname, arg);
+        job->recsize = 0;
+        rc = -1;
+      }
+    } else {
+      avrdude_message(MSG_INFO, "%s: server: invalid request \"%s\"\n",
+                      progname, cp);
+      rc = -1;
+    }
+  }
+
+  return nlines > 0? rc: 0;
+}
+
+
+/*
+ * (Re-)initialize the device for part "p", and check its signature.
+ */
+static int server_init_device(PROGRAMMER * pgm, AVRPART * p)
+{
+  AVRMEM * sig;
+  int rc;
+
+  pgm->disable(pgm);
+  pgm->enable(pgm);
+
+  if ((rc = pgm->initialize(pgm, p)) < 0) {
+    avrdude_message(MSG_INFO, "%s: server: initialization failed, rc=%d\n",
+                    progname, rc);
+    return -1;
+  }
+
+  if (p->flags & AVRPART_AVR32)
+    return 0;
+
+  if ((rc = avr_signature(pgm, p)) != 0) {
+    avrdude_message(MSG_INFO, "%s: server: error reading signature data, rc=%d\n",
+                    progname, rc);
+    return -1;
+  }
+
+  if ((sig = avr_locate_mem(p, "signature")) != NULL && !ovsigck &&
+      (sig->size != 3 ||
+       sig->buf[0] != p->signature[0] ||
+       sig->buf[1] != p->signature[1] ||
+       sig->buf[2] != p->signature[2])) {
+    avrdude_message(MSG_INFO, "%s: server: device signature %02x %02x %02x does not "
+                    "match %s\n",
+                    progname, sig->buf[0], sig->buf[1], sig->buf[2], p->desc);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Run one job on part "p".  Chip erase, including the automatic one
+ * before writing flash, is handled the same way as for a normal run.
+ */
+static int server_run_job(PROGRAMMER * pgm, AVRPART * p,
+                          struct server_job * job, enum updateflags uflags)
+{
+  LNODEID ln;
+  UPDATE * upd;
+  AVRMEM * m;
+  const char * memname = (p->flags & AVRPART_HAS_PDI)? "application": "flash";
+  int erase = job->erase;
+  int recsize, rc = 0;
+
+  /* an erase done for the command line or an earlier job does not count */
+  uflags &= ~UF_CHIP_ERASED;
+
+  for (ln = lfirst(job->updates); ln; ln = lnext(ln)) {
+    upd = ldata(ln);
+    if (upd->memtype == NULL && (upd->memtype = strdup(memname)) == NULL) {
+      avrdude_message(MSG_INFO, "%s: out of memory\n", progname);
+      return -1;
+    }
+  }
+
+  if (uflags & UF_AUTO_ERASE) {
+    if (!((p->flags & AVRPART_HAS_PDI) && pgm->page_erase != NULL)) {
+      uflags &= ~UF_AUTO_ERASE;
+      for (ln = lfirst(job->updates); ln; ln = lnext(ln)) {
+        upd = ldata(ln);
+        if ((m = avr_locate_mem(p, strcasecmp(upd->memtype, "all") == 0?
+                                (char *)memname: upd->memtype)) != NULL &&
+            strcasecmp(m->desc, memname) == 0 &&
+            (upd->op == DEVICE_WRITE || upd->op == DEVICE_WRITE_VERIFY))
+          erase = 1;
+      }
+    }
+  }
+
+  /* see main(): -d must not program flash pages that were not erased */
+  if ((uflags & UF_DIFF_WRITE) && !(uflags & UF_AUTO_ERASE) && !erase &&
+      !(uflags & UF_NOWRITE)) {
+    for (ln = lfirst(job->updates); ln; ln = lnext(ln)) {
+      upd = ldata(ln);
+      if ((m = avr_locate_mem(p, strcasecmp(upd->memtype, "all") == 0?
+                              (char *)memname: upd->memtype)) != NULL &&
+          strcasecmp(m->desc, memname) == 0 &&
+          (upd->op == DEVICE_WRITE || upd->op == DEVICE_WRITE_VERIFY)) {
+        avrdude_message(MSG_INFO, "%s: server: -d cannot be used to write \"%s\" memory "
+                        "without erasing it\n",
+                        progname, memname);
+        return -1;
+      }
+    }
+  }
+
+  if (erase && !(uflags & UF_NOWRITE)) {
+    if (quell_progress < 2)
+      avrdude_message(MSG_INFO, "%s: erasing chip\n", progname);
+    if (avr_chip_erase(pgm, p) != 0)
+      return -1;
+    uflags |= UF_CHIP_ERASED;
+  }
+
+  recsize = fileio_hexrecsize;
+  if (job->recsize > 0)
+    fileio_hexrecsize = job->recsize;
+  for (ln = lfirst(job->updates); ln; ln = lnext(ln)) {
+    if (do_op(pgm, p, ldata(ln), uflags) != 0) {
+      rc = -1;
+      break;
+    }
+  }
+  fileio_hexrecsize = recsize;
+
+  return rc;
+}
+
+
+int server_mode(PROGRAMMER * pgm, AVRPART * p, const char * sockpath,
+                enum updateflags uflags, int verify)
+{
+  struct sockaddr_un saddr;
+  struct sigaction sa, osa_int, osa_term, osa_pipe;
+  struct server_job job;
+  AVRPART * cur = p, * np, * owned = NULL;
+  FILE * f;
+  struct stat st;
+  mode_t omask;
+  int lsock, fd, rc, reinit = 0, quit = 0;
+
+  if (strlen(sockpath) >= sizeof(saddr.sun_path)) {
+    avrdude_message(MSG_INFO, "%s: server: socket name \"%s\" too long\n",
+                    progname, sockpath);
+    return -1;
+  }
+
+  /* only replace the socket of an earlier server, nothing else */
+  if (lstat(sockpath, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      avrdude_message(MSG_INFO, "%s: server: \"%s\" exists and is not a socket\n",
+                      progname, sockpath);
+      return -1;
+    }
+    unlink(sockpath);
+  }
+
+  if ((lsock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    avrdude_message(MSG_INFO, "%s: server: cannot create socket: %s\n",
+                    progname, strerror(errno));
+    return -1;
+  }
+  memset(&saddr, 0, sizeof(saddr));
+  saddr.sun_family = AF_UNIX;
+  strcpy(saddr.sun_path, sockpath);
+  /* jobs can write to the device, so only the owner may connect */
+  omask = umask(0177);
+  rc = bind(lsock, (struct sockaddr *)&saddr, sizeof(saddr));
+  umask(omask);
+  if (rc < 0 || listen(lsock, 4) < 0) {
+    avrdude_message(MSG_INFO, "%s: server: cannot listen on \"%s\": %s\n",
+                    progname, sockpath, strerror(errno));
+    close(lsock);
+    return -1;
+  }
+
+  /* no SA_RESTART, so accept() and fgets() return on a signal */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = server_sighandler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, &osa_int);
+  sigaction(SIGTERM, &sa, &osa_term);
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, &osa_pipe);
+
+  if (quell_progress < 2)
+    avrdude_message(MSG_INFO, "%s: server: accepting jobs on \"%s\"\n",
+                    progname, sockpath);
+
+  memset(&job, 0, sizeof(job));
+  server_stop = 0;
+
+  while (!server_stop && !quit) {
+    if ((fd = accept(lsock, NULL, NULL)) < 0) {
+      if (errno == EINTR)
+        continue;
+      avrdude_message(MSG_INFO, "%s: server: accept() failed: %s\n",
+                      progname, strerror(errno));
+      break;
+    }
+    if ((f = fdopen(fd, "r")) == NULL) {
+      close(fd);
+      continue;
+    }
+
+    while (!server_stop && (rc = server_read_job(f, &job, verify)) != 0) {
+      if (rc > 0 && job.partdesc != NULL &&
+          strcasecmp(job.partdesc, cur->id) != 0 &&
+          strcasecmp(job.partdesc, cur->desc) != 0) {
+        /* switch to a different part */
+        if ((np = locate_part(part_list, job.partdesc)) == NULL) {
+          avrdude_message(MSG_INFO, "%s: server: AVR part \"%s\" not found\n",
+                          progname, job.partdesc);
+          rc = -1;
+        } else {
+          np = avr_dup_part(np);
+          if (avr_initmem(np) != 0) {
+            avr_free_part(np);
+            rc = -1;
+          } else {
+            if (owned != NULL)
+              avr_free_part(owned);
+            cur = owned = np;
+            reinit = 1;
+          }
+        }
+      }
+
+      /* re-enter programming mode if the last job left it in doubt */
+      if (rc > 0 && reinit) {
+        if (server_init_device(pgm, cur) < 0)
+          rc = -1;
+        else
+          reinit = 0;
+      }
+
+      if (rc > 0 && server_run_job(pgm, cur, &job, uflags) < 0) {
+        rc = -1;
+        reinit = 1;
+      }
+
+      if (job.quit)
+        quit = 1;
+
+      if (quell_progress < 2)
+        avrdude_message(MSG_INFO, "%s: server: job %s\n", progname,
+                        rc > 0? "done": "failed");
+      if (write(fd, rc > 0? "ok\n": "failed\n", rc > 0? 3: 7) < 0)
+        break;
+      if (quit)
+        break;
+    }
+    fclose(f);
+  }
+
+  server_job_clear(&job);
+  ldestroy(job.updates);
+  close(lsock);
+  unlink(sockpath);
+
+  sigaction(SIGINT, &osa_int, NULL);
+  sigaction(SIGTERM, &osa_term, NULL);
+  sigaction(SIGPIPE, &osa_pipe, NULL);
+
+  if (owned != NULL)
+    avr_free_part(owned);
+
+  return 0;
+}
+
+#else  /* WIN32NATIVE */
+
+int server_mode(PROGRAMMER * pgm, AVRPART * p, const char * sockpath,
+                enum updateflags uflags, int verify)
+{
+  avrdude_message(MSG_INFO, "%s: server mode is not supported on this platform\n",
+                  progname);
+  return -1;
+}
+
+#endif /* WIN32NATIVE */
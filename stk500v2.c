@@ -78,6 +78,9 @@
 // Retry count
 #define RETRIES 5
 
+// Largest block avr_read() hands to stk500v2_paged_load() at once
+#define STK500V2_PAGED_LOAD_MAX 4096
+
 #define DEBUG(...) avrdude_message(MSG_TRACE2, __VA_ARGS__)
 
 #define DEBUGRECV(...) avrdude_message(MSG_TRACE2, __VA_ARGS__)
@@ -716,6 +719,13 @@ static int stk500v2_recv(PROGRAMMER * pgm, unsigned char *msg, size_t maxsize) {
         return -5;
      } /* switch */
 
+     /*
+      * Only consult the clock while hunting for a frame start; inside
+      * a frame, every serial_recv() enforces its own timeout anyway.
+      */
+     if (state != sSTART)
+       continue;
+
      gettimeofday(&tv, NULL);
      tnow = tv.tv_sec;
      if (tnow-tstart > timeoutval) {			// wuff - signed/unsigned/overflow
@@ -4316,6 +4326,7 @@ static void stk600_setup_xprog(PROGRAMMER * pgm)
     pgm->read_byte = stk600_xprog_read_byte;
     pgm->write_byte = stk600_xprog_write_byte;
     pgm->paged_load = stk600_xprog_paged_load;
+    pgm->paged_load_max = 0;
     pgm->paged_write = stk600_xprog_paged_write;
     pgm->page_erase = stk600_xprog_page_erase;
     pgm->chip_erase = stk600_xprog_chip_erase;
@@ -4332,6 +4343,7 @@ static void stk600_setup_isp(PROGRAMMER * pgm)
     pgm->read_byte = stk500isp_read_byte;
     pgm->write_byte = stk500isp_write_byte;
     pgm->paged_load = stk500v2_paged_load;
+    pgm->paged_load_max = STK500V2_PAGED_LOAD_MAX;
     pgm->paged_write = stk500v2_paged_write;
     pgm->page_erase = stk500v2_page_erase;
     pgm->chip_erase = stk500v2_chip_erase;
@@ -4363,6 +4375,7 @@ void stk500v2_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = stk500v2_paged_write;
   pgm->paged_load     = stk500v2_paged_load;
+  pgm->paged_load_max = STK500V2_PAGED_LOAD_MAX;
   pgm->page_erase     = stk500v2_page_erase;
   pgm->print_parms    = stk500v2_print_parms;
   pgm->set_vtarget    = stk500v2_set_vtarget;
@@ -4471,6 +4484,7 @@ void stk500v2_jtagmkII_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = stk500v2_paged_write;
   pgm->paged_load     = stk500v2_paged_load;
+  pgm->paged_load_max = STK500V2_PAGED_LOAD_MAX;
   pgm->page_erase     = stk500v2_page_erase;
   pgm->print_parms    = stk500v2_print_parms;
   pgm->set_sck_period = stk500v2_set_sck_period_mk2;
@@ -4506,6 +4520,7 @@ void stk500v2_dragon_isp_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = stk500v2_paged_write;
   pgm->paged_load     = stk500v2_paged_load;
+  pgm->paged_load_max = STK500V2_PAGED_LOAD_MAX;
   pgm->page_erase     = stk500v2_page_erase;
   pgm->print_parms    = stk500v2_print_parms;
   pgm->set_sck_period = stk500v2_set_sck_period_mk2;
@@ -4610,6 +4625,7 @@ void stk600_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = stk500v2_paged_write;
   pgm->paged_load     = stk500v2_paged_load;
+  pgm->paged_load_max = STK500V2_PAGED_LOAD_MAX;
   pgm->page_erase     = stk500v2_page_erase;
   pgm->print_parms    = stk500v2_print_parms;
   pgm->set_vtarget    = stk600_set_vtarget;
@@ -4718,6 +4734,7 @@ void stk500v2_jtag3_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = stk500v2_paged_write;
   pgm->paged_load     = stk500v2_paged_load;
+  pgm->paged_load_max = STK500V2_PAGED_LOAD_MAX;
   pgm->page_erase     = stk500v2_page_erase;
   pgm->print_parms    = stk500v2_print_parms;
   pgm->set_sck_period = stk500v2_jtag3_set_sck_period;
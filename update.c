@@ -19,6 +19,8 @@
 
 /* $Id$ */
 
+#include "ac_cfg.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -28,6 +30,32 @@
 #include "avrdude.h"
 #include "libavrdude.h"
 
+#if defined(HAVE_PTHREAD_H)
+#  include <pthread.h>
+#endif
+
+/*
+ * Input file of a write or verify operation that is being read on a
+ * thread of its own, into a private copy of the part, while the
+ * programmer is still connecting to the device.
+ */
+struct update_load {
+#if defined(HAVE_PTHREAD_H)
+  pthread_t thread;
+#endif
+  AVRPART * owner;              /* part the image is meant for */
+  AVRPART * part;               /* private copy the file is read into */
+  char * filename;
+  char * memtype;
+  int format;
+  int rc;                       /* result of fileio() */
+  int done;                     /* thread has been joined */
+  struct avr_thread_state state; /* of the thread that started it */
+};
+
+static void update_load_wait(struct update_load * l);
+static void update_load_free(struct update_load * l);
+
 UPDATE * parse_op(char * s)
 {
   char buf[1024];
@@ -41,6 +69,7 @@ UPDATE * parse_op(char * s)
     avrdude_message(MSG_INFO, "%s: out of memory\n", progname);
     exit(1);
   }
+  upd->load = NULL;
 
   i = 0;
   p = s;
@@ -174,6 +203,7 @@ UPDATE * dup_update(UPDATE * upd)
   else
     u->memtype = NULL;
   u->filename = strdup(upd->filename);
+  u->load = NULL;
 
   return u;
 }
@@ -192,6 +222,7 @@ UPDATE * new_update(int op, char * memtype, int filefmt, char * filename)
   u->filename = strdup(filename);
   u->op = op;
   u->format = filefmt;
+  u->load = NULL;
 
   return u;
 }
@@ -199,6 +230,11 @@ UPDATE * new_update(int op, char * memtype, int filefmt, char * filename)
 void free_update(UPDATE * u)
 {
     if (u != NULL) {
+	if(u->load != NULL) {
+	    /* waits for the thread, which still uses filename and memtype */
+	    update_load_free(u->load);
+	    u->load = NULL;
+	}
 	if(u->memtype != NULL) {
 	    free(u->memtype);
 	    u->memtype = NULL;
@@ -212,13 +248,361 @@ void free_update(UPDATE * u)
 }
 
 
-int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags flags)
+#if defined(HAVE_PTHREAD_H)
+
+static void * update_load_thread(void * arg)
+{
+  struct update_load * l = arg;
+
+  avr_thread_state_restore(&l->state);
+
+  l->rc = fileio(FIO_READ, l->filename, l->format, l->part, l->memtype, -1);
+
+  return NULL;
+}
+
+
+static void update_load_wait(struct update_load * l)
+{
+  if (!l->done) {
+    pthread_join(l->thread, NULL);
+    l->done = 1;
+  }
+}
+
+
+static void update_load_free(struct update_load * l)
+{
+  update_load_wait(l);
+  avr_free_part(l->part);
+  free(l);
+}
+
+
+/*
+ * Start reading the input files of all write and verify operations on
+ * worker threads, so that parsing them overlaps with connecting to the
+ * device.  Each image is attached to its UPDATE, and picked up by
+ * do_op().  Input from stdin or a pipe is left to do_op(), as is any
+ * file that an earlier read operation is going to write.
+ */
+void preload_updates(LISTID updates, struct avrpart * p)
+{
+  LNODEID ln, ln2;
+  UPDATE * upd, * prev;
+  struct update_load * l;
+
+  for (ln=lfirst(updates); ln; ln=lnext(ln)) {
+    upd = ldata(ln);
+    if (upd->load != NULL || upd->op == DEVICE_READ ||
+        upd->format == FMT_IMM || strcmp(upd->filename, "-") == 0 ||
+        fileio_is_stream(upd->filename, upd->format) ||
+        avr_locate_mem(p, upd->memtype) == NULL)
+      continue;
+
+    for (ln2=lfirst(updates); ln2 != ln; ln2=lnext(ln2)) {
+      prev = ldata(ln2);
+      if (prev->op == DEVICE_READ && strcmp(prev->filename, upd->filename) == 0)
+        break;
+    }
+    if (ln2 != ln)
+      continue;
+
+    if ((l = calloc(1, sizeof(*l))) == NULL)
+      return;
+    l->owner = p;
+    l->part = avr_dup_part(p);
+    l->filename = upd->filename;
+    l->memtype = upd->memtype;
+    l->format = upd->format;
+    l->rc = -1;
+    avr_thread_state_save(&l->state);
+
+    if (pthread_create(&l->thread, NULL, update_load_thread, l) != 0) {
+      /* do_op() reads the file itself then */
+      avr_free_part(l->part);
+      free(l);
+      return;
+    }
+    upd->load = l;
+  }
+}
+
+
+/*
+ * Wait until all input files started by preload_updates() have been
+ * read, e.g. before the process forks.
+ */
+void preload_updates_wait(LISTID updates)
+{
+  LNODEID ln;
+  UPDATE * upd;
+
+  for (ln=lfirst(updates); ln; ln=lnext(ln)) {
+    upd = ldata(ln);
+    if (upd->load != NULL)
+      update_load_wait(upd->load);
+  }
+}
+
+#else  /* !HAVE_PTHREAD_H */
+
+/* without threads, nothing is ever read ahead */
+static void update_load_wait(struct update_load * l)
+{
+}
+
+static void update_load_free(struct update_load * l)
+{
+}
+
+void preload_updates(LISTID updates, struct avrpart * p)
+{
+}
+
+void preload_updates_wait(LISTID updates)
+{
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+
+/*
+ * Load the input file of upd into memory mem of p: take the image
+ * read ahead by preload_updates() if there is one, or read the file
+ * now.  Returns the size as fileio() does.
+ */
+static int update_read_file(struct avrpart * p, UPDATE * upd, AVRMEM * mem)
+{
+  struct update_load * l = upd->load;
+  AVRMEM * m;
+  int rc;
+
+  if (l == NULL)
+    return fileio(FIO_READ, upd->filename, upd->format, p, upd->memtype, -1);
+
+  upd->load = NULL;
+  update_load_wait(l);
+  rc = l->rc;
+  if (rc >= 0 &&
+      (l->owner != p || (m = avr_locate_mem(l->part, upd->memtype)) == NULL ||
+       avr_mem_copy_image(mem, m) < 0)) {
+    /* not the part the image has been read for, start over */
+    rc = fileio(FIO_READ, upd->filename, upd->format, p, upd->memtype, -1);
+  }
+  update_load_free(l);
+
+  return rc;
+}
+
+
+/*
+ * Verify the device memory against the image of upd that has already
+ * been loaded into p.
+ */
+static int update_verify(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd,
+                         AVRMEM * mem, int size)
 {
   struct avrpart * v;
+  int rc;
+
+  v = avr_dup_part(p);
+  if (quell_progress < 2) {
+    avrdude_message(MSG_INFO, "%s: input file %s contains %d bytes\n",
+          progname, upd->filename, size);
+    avrdude_message(MSG_INFO, "%s: reading on-chip %s data:\n",
+          progname, mem->desc);
+  }
+
+  report_progress (0,1,"Reading");
+  rc = avr_read(pgm, p, mem->desc, v);
+  if (rc < 0) {
+    avrdude_message(MSG_INFO, "%s: failed to read all of %s memory, rc=%d\n",
+            progname, mem->desc, rc);
+    pgm->err_led(pgm, ON);
+    avr_free_part(v);
+    return -1;
+  }
+  report_progress (1,1,NULL);
+
+
+
+  if (quell_progress < 2) {
+    avrdude_message(MSG_INFO, "%s: verifying ...\n", progname);
+  }
+  rc = avr_verify(p, v, mem->desc, size);
+  if (rc < 0) {
+    avrdude_message(MSG_INFO, "%s: verification error; content mismatch\n",
+            progname);
+    pgm->err_led(pgm, ON);
+    avr_free_part(v);
+    return -1;
+  }
+
+  if (quell_progress < 2) {
+    avrdude_message(MSG_INFO, "%s: %d bytes of %s verified\n",
+            progname, rc, mem->desc);
+  }
+
+  pgm->vfy_led(pgm, OFF);
+  avr_free_part(v);
+
+  return 0;
+}
+
+
+/*
+ * Write the image of upd that has been loaded into memory mem of p,
+ * and verify it as requested.
+ */
+static int update_write(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd,
+                        AVRMEM * mem, int size, enum updateflags flags)
+{
+  int rc, vsize;
+
+  /*
+   * write the buffer contents to the selected memory type
+   */
+  if (quell_progress < 2) {
+    avrdude_message(MSG_INFO, "%s: writing %s (%d bytes):\n",
+          progname, mem->desc, size);
+  }
+
+  if (!(flags & UF_NOWRITE)) {
+    if (upd->op == DEVICE_WRITE_VERIFY) {
+      /* verify each page right after it has been written */
+      flags |= UF_VERIFY;
+      pgm->vfy_led(pgm, ON);
+    }
+    report_progress(0,1,"Writing");
+    rc = avr_write(pgm, p, mem->desc, size, flags);
+    report_progress(1,1,NULL);
+  }
+  else {
+    /*
+     * test mode, don't actually write to the chip, output the buffer
+     * to stdout in intel hex instead
+     */
+    rc = fileio(FIO_WRITE, "-", FMT_IHEX, p, mem->desc, size);
+  }
+
+  if (rc < 0) {
+    avrdude_message(MSG_INFO, "%s: failed to write %s memory, rc=%d\n",
+            progname, mem->desc, rc);
+    return -1;
+  }
+
+  vsize = rc;
+
+  if (quell_progress < 2) {
+    avrdude_message(MSG_INFO, "%s: %d bytes of %s written\n", progname,
+          vsize, mem->desc);
+  }
+
+  if (flags & UF_VERIFY) {
+    if (quell_progress < 2) {
+      avrdude_message(MSG_INFO, "%s: %d bytes of %s verified\n",
+            progname, size, mem->desc);
+    }
+    pgm->vfy_led(pgm, OFF);
+  }
+  else if (upd->op == DEVICE_WRITE_VERIFY) {
+    /*
+     * test mode, nothing has been written, so compare the image
+     * against what is currently on the chip
+     */
+    pgm->vfy_led(pgm, ON);
+    if (quell_progress < 2) {
+      avrdude_message(MSG_INFO, "%s: verifying %s memory against %s:\n",
+            progname, mem->desc, upd->filename);
+    }
+    if (update_verify(pgm, p, upd, mem, size) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Write or verify all memories an ELF file holds data for ("-U
+ * all:w:file.elf"), reading the file once.  The lock bits go last, so
+ * they cannot get in the way of the other memories.
+ */
+static int update_all(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd,
+                      enum updateflags flags)
+{
+  AVRMEM ** mems;
+  int * sizes;
+  int n, i, rc, last;
+
+  if (upd->op == DEVICE_READ) {
+    avrdude_message(MSG_INFO, "%s: memory type \"all\" can only be written or verified\n",
+            progname);
+    return -1;
+  }
+
+  mems = malloc(lsize(p->mem) * sizeof(*mems));
+  sizes = malloc(lsize(p->mem) * sizeof(*sizes));
+  if (mems == NULL || sizes == NULL) {
+    avrdude_message(MSG_INFO, "%s: out of memory\n", progname);
+    free(mems);
+    free(sizes);
+    return -1;
+  }
+
+  if (quell_progress < 2) {
+    avrdude_message(MSG_INFO, "%s: reading input file \"%s\"\n",
+                    progname,
+                    strcmp(upd->filename, "-")==0 ? "<stdin>" : upd->filename);
+  }
+  n = fileio_all(upd->filename, upd->format, p, mems, sizes, lsize(p->mem));
+  if (n < 0) {
+    avrdude_message(MSG_INFO, "%s: read from file '%s' failed\n",
+            progname, upd->filename);
+    rc = -1;
+  }
+  else if (n == 0) {
+    avrdude_message(MSG_INFO, "%s: input file %s holds no data for any memory of part \"%s\"\n",
+            progname, upd->filename, p->desc);
+    rc = -1;
+  }
+  else
+    rc = 0;
+
+  for (last = 0; last < 2 && rc == 0; last++) {
+    for (i = 0; i < n && rc == 0; i++) {
+      if ((strncmp(mems[i]->desc, "lock", 4) == 0) != last)
+        continue;
+      if (upd->op == DEVICE_VERIFY) {
+        pgm->vfy_led(pgm, ON);
+        if (quell_progress < 2) {
+          avrdude_message(MSG_INFO, "%s: verifying %s memory against %s:\n",
+                progname, mems[i]->desc, upd->filename);
+        }
+        rc = update_verify(pgm, p, upd, mems[i], sizes[i]);
+      }
+      else
+        rc = update_write(pgm, p, upd, mems[i], sizes[i], flags);
+    }
+  }
+
+  free(mems);
+  free(sizes);
+
+  return rc;
+}
+
+
+int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags flags)
+{
   AVRMEM * mem;
-  int size, vsize;
+  int size;
   int rc;
 
+  if (strcasecmp(upd->memtype, "all") == 0)
+    return update_all(pgm, p, upd, flags);
+
   mem = avr_locate_mem(p, upd->memtype);
   if (mem == NULL) {
     avrdude_message(MSG_INFO, "\"%s\" memory type not defined for part \"%s\"\n",
@@ -259,58 +643,80 @@ int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags f
       return -1;
     }
   }
-  else if (upd->op == DEVICE_WRITE) {
+  else if ((upd->op == DEVICE_WRITE || upd->op == DEVICE_WRITE_VERIFY) &&
+           !(flags & UF_NOWRITE) && fileio_is_stream(upd->filename, upd->format)) {
     /*
-     * write the selected device memory using data from a file; first
-     * read the data from the specified file
+     * the input comes from stdin or a pipe: write each page as soon as
+     * the input has moved past it, rather than waiting for all of it
      */
+    FILEIO_STREAM * stream;
+
     if (quell_progress < 2) {
-      avrdude_message(MSG_INFO, "%s: reading input file \"%s\"\n",
-                      progname,
+      avrdude_message(MSG_INFO, "%s: writing %s while reading input file \"%s\":\n",
+                      progname, mem->desc,
                       strcmp(upd->filename, "-")==0 ? "<stdin>" : upd->filename);
     }
-    rc = fileio(FIO_READ, upd->filename, upd->format, p, upd->memtype, -1);
-    if (rc < 0) {
+    stream = fileio_stream_open(upd->filename, upd->format, p, upd->memtype);
+    if (stream == NULL) {
       avrdude_message(MSG_INFO, "%s: read from file '%s' failed\n",
               progname, upd->filename);
       return -1;
     }
-    size = rc;
 
-    /*
-     * write the buffer contents to the selected memory type
-     */
-    if (quell_progress < 2) {
-      avrdude_message(MSG_INFO, "%s: writing %s (%d bytes):\n",
-            progname, mem->desc, size);
-	  }
-
-    if (!(flags & UF_NOWRITE)) {
-      report_progress(0,1,"Writing");
-      rc = avr_write(pgm, p, upd->memtype, size, (flags & UF_AUTO_ERASE) != 0);
-      report_progress(1,1,NULL);
-    }
-    else {
-      /*
-       * test mode, don't actually write to the chip, output the buffer
-       * to stdout in intel hex instead
-       */
-      rc = fileio(FIO_WRITE, "-", FMT_IHEX, p, upd->memtype, size);
+    if (upd->op == DEVICE_WRITE_VERIFY) {
+      /* verify each page right after it has been written */
+      flags |= UF_VERIFY;
+      pgm->vfy_led(pgm, ON);
     }
+    report_progress(0,1,"Writing");
+    rc = avr_write_stream(pgm, p, upd->memtype, stream, flags);
+    report_progress(1,1,NULL);
+    size = fileio_stream_close(stream);
 
     if (rc < 0) {
       avrdude_message(MSG_INFO, "%s: failed to write %s memory, rc=%d\n",
               progname, mem->desc, rc);
       return -1;
     }
-
-    vsize = rc;
+    if (size < 0) {
+      avrdude_message(MSG_INFO, "%s: read from file '%s' failed\n",
+              progname, upd->filename);
+      return -1;
+    }
 
     if (quell_progress < 2) {
       avrdude_message(MSG_INFO, "%s: %d bytes of %s written\n", progname,
-            vsize, mem->desc);
+            rc, mem->desc);
     }
 
+    if (flags & UF_VERIFY) {
+      if (quell_progress < 2) {
+        avrdude_message(MSG_INFO, "%s: %d bytes of %s verified\n",
+              progname, size, mem->desc);
+      }
+      pgm->vfy_led(pgm, OFF);
+    }
+  }
+  else if (upd->op == DEVICE_WRITE || upd->op == DEVICE_WRITE_VERIFY) {
+    /*
+     * write the selected device memory using data from a file; first
+     * read the data from the specified file
+     */
+    if (quell_progress < 2) {
+      avrdude_message(MSG_INFO, "%s: reading input file \"%s\"\n",
+                      progname,
+                      strcmp(upd->filename, "-")==0 ? "<stdin>" : upd->filename);
+    }
+    rc = update_read_file(p, upd, mem);
+    if (rc < 0) {
+      avrdude_message(MSG_INFO, "%s: read from file '%s' failed\n",
+              progname, upd->filename);
+      return -1;
+    }
+    size = rc;
+
+    if (update_write(pgm, p, upd, mem, size, flags) < 0)
+      return -1;
   }
   else if (upd->op == DEVICE_VERIFY) {
     /*
@@ -327,53 +733,16 @@ int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags f
             progname, mem->desc, upd->filename);
     }
 
-    rc = fileio(FIO_READ, upd->filename, upd->format, p, upd->memtype, -1);
+    rc = update_read_file(p, upd, mem);
     if (rc < 0) {
       avrdude_message(MSG_INFO, "%s: read from file '%s' failed\n",
               progname, upd->filename);
       return -1;
     }
-    v = avr_dup_part(p);
     size = rc;
-    if (quell_progress < 2) {
-      avrdude_message(MSG_INFO, "%s: input file %s contains %d bytes\n",
-            progname, upd->filename, size);
-      avrdude_message(MSG_INFO, "%s: reading on-chip %s data:\n",
-            progname, mem->desc);
-    }
 
-    report_progress (0,1,"Reading");
-    rc = avr_read(pgm, p, upd->memtype, v);
-    if (rc < 0) {
-      avrdude_message(MSG_INFO, "%s: failed to read all of %s memory, rc=%d\n",
-              progname, mem->desc, rc);
-      pgm->err_led(pgm, ON);
-      avr_free_part(v);
+    if (update_verify(pgm, p, upd, mem, size) < 0)
       return -1;
-    }
-    report_progress (1,1,NULL);
-
-
-
-    if (quell_progress < 2) {
-      avrdude_message(MSG_INFO, "%s: verifying ...\n", progname);
-    }
-    rc = avr_verify(p, v, upd->memtype, size);
-    if (rc < 0) {
-      avrdude_message(MSG_INFO, "%s: verification error; content mismatch\n",
-              progname);
-      pgm->err_led(pgm, ON);
-      avr_free_part(v);
-      return -1;
-    }
-
-    if (quell_progress < 2) {
-      avrdude_message(MSG_INFO, "%s: %d bytes of %s verified\n",
-              progname, rc, mem->desc);
-    }
-
-    pgm->vfy_led(pgm, OFF);
-    avr_free_part(v);
   }
   else {
     avrdude_message(MSG_INFO, "%s: invalid update operation (%d) requested\n",
@@ -34,6 +34,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #if defined(HAVE_USB_H)
 #  include <usb.h>
@@ -53,10 +54,15 @@
 #  undef interface
 #endif
 
-static char usbbuf[USBDEV_MAX_XFER_3];
-static int buflen = -1, bufptr;
+#if defined(HAVE_PTHREAD_H)
+#  include <pthread.h>
+#  define USB_READER
+#endif
+
+static LIBAVRDUDE_TLS char usbbuf[USBDEV_MAX_XFER_3];
+static LIBAVRDUDE_TLS int buflen = -1, bufptr;
 
-static int usb_interface;
+static LIBAVRDUDE_TLS int usb_interface;
 
 /*
  * The "baud" parameter is meaningless for USB devices, so we reuse it
@@ -246,6 +252,7 @@ static int usbdev_open(char * port, union pinfo pinfo, union filedescriptor *fd)
 		    }
 
 		  fd->usb.handle = udev;
+		  fd->usb.reader = NULL;
 		  if (fd->usb.rep == 0)
 		    {
 		      /* Try finding out what our read endpoint is. */
@@ -461,6 +468,284 @@ static int usbdev_recv(union filedescriptor *fd, unsigned char *buf, size_t nbyt
   return 0;
 }
 
+#if defined(USB_READER)
+/*
+ * Frame reader for the frame oriented devices.  libusb-0.1 cannot have
+ * more than one request per call in flight, so one thread per IN
+ * endpoint keeps a read posted all the time, assembles the packets
+ * into frames, and queues the frames for usbdev_recv_frame().  The
+ * frame buffers come from a small pool; when all of them are waiting
+ * to be picked up, the threads stop reading until one is returned.
+ *
+ * Besides having the response read already posted when the device
+ * answers, this removes the poll of the event endpoint that used to
+ * precede every response read.
+ *
+ * Frames end with a short packet, except on the interrupt (HID)
+ * devices, whose reports always have the full size: there, each
+ * packet is a frame of its own.  After a read error, a single error
+ * frame is queued, and usbdev_recv_frame() fails right away rather
+ * than waiting until the endpoint works again.
+ *
+ * The reader belongs to the file descriptor, so the device can be used
+ * from any thread, not just the one that opened it.
+ */
+#define USB_POOL_SIZE     8
+#define USB_READ_TIMEOUT  100   /* ms; lets the threads notice shutdown */
+#define USB_RECV_TIMEOUT  10    /* s */
+
+struct usb_frame {
+  unsigned char data[USBDEV_MAX_XFER_3];
+  int len;                      /* -1: read error or overflow */
+  int event;
+};
+
+struct usb_reader;
+
+struct usb_reader_ep {
+  struct usb_reader *r;
+  int ep;
+  int event;
+  int started;
+  int failed;                   /* last read failed, error frame queued */
+  pthread_t thread;
+};
+
+struct usb_reader {
+  usb_dev_handle *udev;
+  int max_xfer;
+  int use_interrupt_xfer;
+  struct usb_reader_ep eps[2];  /* response and event endpoint */
+
+  pthread_mutex_t lock;
+  pthread_cond_t avail, space;
+  int stop;
+  struct usb_frame pool[USB_POOL_SIZE];
+  int freelist[USB_POOL_SIZE], nfree;
+  int queue[USB_POOL_SIZE], qhead, qcount;
+
+  struct avr_thread_state state; /* of the thread that opened the device */
+};
+
+static int usb_read_timedout(int rv)
+{
+#if defined(WIN32NATIVE)
+  return rv == -116;            /* libusb-win32 */
+#else
+  return rv == -ETIMEDOUT;
+#endif
+}
+
+static void usb_reader_put(struct usb_reader *r, int idx)
+{
+  pthread_mutex_lock(&r->lock);
+  r->queue[(r->qhead + r->qcount) % USB_POOL_SIZE] = idx;
+  r->qcount++;
+  pthread_cond_signal(&r->avail);
+  pthread_mutex_unlock(&r->lock);
+}
+
+static void *usb_reader_thread(void *arg)
+{
+  struct usb_reader_ep *e = arg;
+  struct usb_reader *r = e->r;
+  struct usb_frame *f;
+  char pkt[USBDEV_MAX_XFER_3];
+  int idx = -1, rv, stop;
+
+  avr_thread_state_restore(&r->state);
+
+  for (;;) {
+    pthread_mutex_lock(&r->lock);
+    while (idx < 0 && !r->stop) {
+      if (r->nfree > 0) {
+        idx = r->freelist[--r->nfree];
+        r->pool[idx].len = 0;
+        r->pool[idx].event = e->event;
+      } else
+        pthread_cond_wait(&r->space, &r->lock);
+    }
+    stop = r->stop;
+    pthread_mutex_unlock(&r->lock);
+    if (stop)
+      break;
+    f = &r->pool[idx];
+
+    if (r->use_interrupt_xfer && !e->event)
+      rv = usb_interrupt_read(r->udev, e->ep, pkt, r->max_xfer, USB_READ_TIMEOUT);
+    else
+      rv = usb_bulk_read(r->udev, e->ep, pkt, r->max_xfer, USB_READ_TIMEOUT);
+
+    if (rv < 0) {
+      if (usb_read_timedout(rv)) {
+        /* deliver what we have, in case the device sent no short packet */
+        if (f->len != 0) {
+          usb_reader_put(r, idx);
+          idx = -1;
+        }
+        continue;
+      }
+      if (e->event) {
+        usleep(USB_READ_TIMEOUT * 1000);
+        continue;
+      }
+      if (!e->failed) {
+        avrdude_message(MSG_NOTICE2, "%s: usb_reader_thread(): usb_%s_read(): %s\n",
+                        progname, (r->use_interrupt_xfer? "interrupt": "bulk"),
+                        usb_strerror());
+        pthread_mutex_lock(&r->lock);
+        e->failed = 1;
+        pthread_mutex_unlock(&r->lock);
+        f->len = -1;
+        usb_reader_put(r, idx);
+        idx = -1;
+      }
+      usleep(USB_READ_TIMEOUT * 1000);
+      continue;
+    }
+    if (e->failed) {
+      pthread_mutex_lock(&r->lock);
+      e->failed = 0;
+      pthread_mutex_unlock(&r->lock);
+    }
+
+    if (f->len >= 0) {
+      if (f->len + rv <= sizeof(f->data)) {
+        memcpy(f->data + f->len, pkt, rv);
+        f->len += rv;
+      } else
+        f->len = -1;            /* buffer overflow */
+    }
+    if (rv == r->max_xfer && !r->use_interrupt_xfer)
+      continue;
+
+    if (e->event && f->len >= 0 && f->len <= 4) {
+      if (f->len > 0)
+        avrdude_message(MSG_INFO, "Short event len = %d, ignored.\n", f->len);
+      f->len = 0;
+      continue;
+    }
+    usb_reader_put(r, idx);
+    idx = -1;
+  }
+
+  if (idx >= 0) {
+    pthread_mutex_lock(&r->lock);
+    r->freelist[r->nfree++] = idx;
+    pthread_mutex_unlock(&r->lock);
+  }
+  return NULL;
+}
+
+static void usb_reader_stop(union filedescriptor *fd)
+{
+  struct usb_reader *r = fd->usb.reader;
+  int i;
+
+  if (r == NULL)
+    return;
+  fd->usb.reader = NULL;
+
+  pthread_mutex_lock(&r->lock);
+  r->stop = 1;
+  pthread_cond_broadcast(&r->space);
+  pthread_mutex_unlock(&r->lock);
+  for (i = 0; i < 2; i++)
+    if (r->eps[i].started)
+      pthread_join(r->eps[i].thread, NULL);
+
+  pthread_cond_destroy(&r->avail);
+  pthread_cond_destroy(&r->space);
+  pthread_mutex_destroy(&r->lock);
+  free(r);
+}
+
+static int usb_reader_start(union filedescriptor *fd)
+{
+  struct usb_reader *r;
+  int i;
+
+  if ((r = calloc(1, sizeof(*r))) == NULL) {
+    avrdude_message(MSG_INFO, "%s: usb_reader_start(): out of memory\n", progname);
+    return -1;
+  }
+  r->udev = fd->usb.handle;
+  r->max_xfer = fd->usb.max_xfer;
+  r->use_interrupt_xfer = fd->usb.use_interrupt_xfer;
+  avr_thread_state_save(&r->state);
+  for (i = 0; i < USB_POOL_SIZE; i++)
+    r->freelist[r->nfree++] = i;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->avail, NULL);
+  pthread_cond_init(&r->space, NULL);
+  fd->usb.reader = r;
+
+  r->eps[0].ep = fd->usb.rep;
+  r->eps[1].ep = fd->usb.eep;
+  r->eps[1].event = 1;
+  for (i = 0; i < 2; i++) {
+    r->eps[i].r = r;
+    if (r->eps[i].ep == 0)
+      continue;
+    if (pthread_create(&r->eps[i].thread, NULL, usb_reader_thread, &r->eps[i]) != 0) {
+      avrdude_message(MSG_INFO, "%s: usb_reader_start(): cannot create reader thread\n",
+                      progname);
+      usb_reader_stop(fd);
+      return -1;
+    }
+    r->eps[i].started = 1;
+  }
+  return 0;
+}
+
+/*
+ * Wait for the next frame from the reader threads.
+ */
+static int usb_reader_recv(struct usb_reader *r, unsigned char *buf, size_t nbytes)
+{
+  struct timeval tv;
+  struct timespec deadline;
+  struct usb_frame *f;
+  int idx, n, rc = 0;
+
+  gettimeofday(&tv, NULL);
+  deadline.tv_sec = tv.tv_sec + USB_RECV_TIMEOUT;
+  deadline.tv_nsec = tv.tv_usec * 1000;
+
+  pthread_mutex_lock(&r->lock);
+  while (r->qcount == 0 && rc == 0 && !r->eps[0].failed)
+    rc = pthread_cond_timedwait(&r->avail, &r->lock, &deadline);
+  if (r->qcount == 0) {
+    pthread_mutex_unlock(&r->lock);
+    if (r->eps[0].failed)
+      return -1;                /* the error frame has been consumed already */
+    avrdude_message(MSG_NOTICE2, "%s: usbdev_recv_frame(): timeout\n", progname);
+    return -1;
+  }
+  idx = r->queue[r->qhead];
+  r->qhead = (r->qhead + 1) % USB_POOL_SIZE;
+  r->qcount--;
+  pthread_mutex_unlock(&r->lock);
+
+  f = &r->pool[idx];
+  if (f->len < 0 || f->len > nbytes) {
+    n = -1;                     /* read error, or buffer overflow */
+  } else {
+    memcpy(buf, f->data, f->len);
+    n = f->len;
+    if (f->event)
+      n |= USB_RECV_FLAG_EVENT;
+  }
+
+  pthread_mutex_lock(&r->lock);
+  r->freelist[r->nfree++] = idx;
+  pthread_cond_signal(&r->space);
+  pthread_mutex_unlock(&r->lock);
+
+  return n;
+}
+#endif /* USB_READER */
+
 /*
  * This version of recv keeps reading packets until we receive a short
  * packet.  Then, the entire frame is assembled and returned to the
@@ -480,6 +765,18 @@ static int usbdev_recv_frame(union filedescriptor *fd, unsigned char *buf, size_
   if (udev == NULL)
     return -1;
 
+#if defined(USB_READER)
+  {
+    struct usb_reader *r = fd->usb.reader;
+
+    if (r != NULL) {
+      if ((n = usb_reader_recv(r, buf, nbytes)) < 0)
+        return -1;
+      goto printout;
+    }
+  }
+#endif
+
   /* If there's an event EP, and it has data pending, return it first. */
   if (fd->usb.eep != 0)
   {
@@ -586,6 +883,28 @@ static int usbdev_drain(union filedescriptor *fd, int display)
   return 0;
 }
 
+#if defined(USB_READER)
+static int usbdev_open_frame(char * port, union pinfo pinfo, union filedescriptor *fd)
+{
+  if (usbdev_open(port, pinfo, fd) < 0)
+    return -1;
+  if (usb_reader_start(fd) < 0) {
+    usbdev_close(fd);
+    return -1;
+  }
+  return 0;
+}
+
+static void usbdev_close_frame(union filedescriptor *fd)
+{
+  usb_reader_stop(fd);
+  usbdev_close(fd);
+}
+#else
+#  define usbdev_open_frame usbdev_open
+#  define usbdev_close_frame usbdev_close
+#endif
+
 /*
  * Device descriptor for the JTAG ICE mkII.
  */
@@ -604,8 +923,8 @@ struct serial_device usb_serdev =
  */
 struct serial_device usb_serdev_frame =
 {
-  .open = usbdev_open,
-  .close = usbdev_close,
+  .open = usbdev_open_frame,
+  .close = usbdev_close_frame,
   .send = usbdev_send,
   .recv = usbdev_recv_frame,
   .drain = usbdev_drain,
@@ -122,6 +122,11 @@ struct pdata
   int use_tpi;
   int section_e;
   int sck_3mhz;
+  int queue_depth;              /* 0: paged transfers are synchronous */
+#ifdef USE_LIBUSB_1_0
+  struct usbasp_queued *queue;
+  int queue_head, queue_count;
+#endif
 };
 
 #define PDATA(pgm) ((struct pdata *)(pgm->cookie))
@@ -192,6 +197,9 @@ static void usbasp_setup(PROGRAMMER * pgm)
 
 static void usbasp_teardown(PROGRAMMER * pgm)
 {
+#ifdef USE_LIBUSB_1_0
+  free(PDATA(pgm)->queue);
+#endif
   free(pgm->cookie);
 }
 
@@ -308,6 +316,168 @@ static int usbasp_transmit(PROGRAMMER * pgm,
 }
 
 
+#ifdef USE_LIBUSB_1_0
+/*
+ * Queue of asynchronous control transfers, used by the paged functions
+ * to keep several blocks in flight.  The control pipe processes them in
+ * order, so this only saves the host side turnaround between blocks.
+ */
+struct usbasp_queued {
+  struct libusb_transfer *xfer;
+  unsigned char *dest;          /* where received data go, or NULL */
+  int expect;                   /* expected length, -1 for don't care */
+  int done;
+};
+
+static void LIBUSB_CALL usbasp_queue_cb(struct libusb_transfer *xfer)
+{
+  ((struct usbasp_queued *)xfer->user_data)->done = 1;
+}
+
+/*
+ * Wait for the oldest queued transfer, and check its result.
+ */
+static int usbasp_queue_complete(PROGRAMMER * pgm)
+{
+  IMPORT_PDATA(pgm);
+  struct usbasp_queued *q = &pdata->queue[pdata->queue_head];
+  struct libusb_transfer *xfer = q->xfer;
+  int rv = 0, rc;
+
+  while (!q->done) {
+    rc = libusb_handle_events_completed(ctx, &q->done);
+    if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+      avrdude_message(MSG_INFO, "%s: error: usbasp_queue_complete: %s\n",
+                      progname, strerror(libusb_to_errno(rc)));
+      libusb_cancel_transfer(xfer);
+    }
+  }
+
+  if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    avrdude_message(MSG_INFO, "%s: error: usbasp_queue_complete: transfer status %d\n",
+                    progname, xfer->status);
+    rv = -1;
+  } else if (q->expect >= 0 && xfer->actual_length != q->expect) {
+    avrdude_message(MSG_INFO, "%s: error: wrong transfer size %x\n",
+                    progname, xfer->actual_length);
+    rv = -1;
+  } else if (q->dest != NULL) {
+    memcpy(q->dest, libusb_control_transfer_get_data(xfer), xfer->actual_length);
+  }
+
+  libusb_free_transfer(xfer);
+  q->xfer = NULL;
+  pdata->queue_head = (pdata->queue_head + 1) % pdata->queue_depth;
+  pdata->queue_count--;
+  return rv;
+}
+
+/*
+ * Wait for all queued transfers.  After an error, the remaining ones
+ * are cancelled.
+ */
+static int usbasp_queue_finish(PROGRAMMER * pgm)
+{
+  IMPORT_PDATA(pgm);
+  int rv = 0, i;
+
+  while (pdata->queue_count > 0) {
+    if (usbasp_queue_complete(pgm) < 0 && rv == 0) {
+      rv = -1;
+      for (i = 0; i < pdata->queue_count; i++)
+        libusb_cancel_transfer(pdata->queue[(pdata->queue_head + i) % pdata->queue_depth].xfer);
+    }
+  }
+  return rv;
+}
+#else
+static int usbasp_queue_finish(PROGRAMMER * pgm)
+{
+  return 0;
+}
+#endif
+
+/*
+ * Send a block of a paged transfer.  With libusb-1.0 and a firmware
+ * that knows about USBASP_FUNC_GETCAPABILITIES, the transfer is only
+ * queued, and "buffer" is filled in by usbasp_queue_finish().
+ * "expect" is the number of bytes the transfer must move, or -1 if
+ * the result does not matter (a queued transfer then discards it).
+ */
+static int usbasp_queue(PROGRAMMER * pgm,
+                        unsigned char receive, unsigned char functionid,
+                        const unsigned char *send,
+                        unsigned char *buffer, int buffersize, int expect)
+{
+  IMPORT_PDATA(pgm);
+  int n;
+
+#ifdef USE_LIBUSB_1_0
+  if (pdata->queue_depth > 0) {
+    struct usbasp_queued *q;
+    unsigned char *data;
+    int rc;
+
+    if (pdata->queue == NULL &&
+        (pdata->queue = calloc(pdata->queue_depth, sizeof(*pdata->queue))) == NULL) {
+      avrdude_message(MSG_INFO, "%s: usbasp_queue(): out of memory\n", progname);
+      return -1;
+    }
+    if (pdata->queue_count == pdata->queue_depth &&
+        usbasp_queue_complete(pgm) < 0) {
+      usbasp_queue_finish(pgm);
+      return -1;
+    }
+
+    avrdude_message(MSG_TRACE, "%s: usbasp_queue(\"%s\", 0x%02x, 0x%02x, 0x%02x, 0x%02x)\n",
+                    progname,
+                    usbasp_get_funcname(functionid), send[0], send[1], send[2], send[3]);
+
+    q = &pdata->queue[(pdata->queue_head + pdata->queue_count) % pdata->queue_depth];
+    if ((q->xfer = libusb_alloc_transfer(0)) == NULL ||
+        (data = malloc(LIBUSB_CONTROL_SETUP_SIZE + buffersize)) == NULL) {
+      avrdude_message(MSG_INFO, "%s: usbasp_queue(): out of memory\n", progname);
+      libusb_free_transfer(q->xfer);
+      usbasp_queue_finish(pgm);
+      return -1;
+    }
+    libusb_fill_control_setup(data,
+                              (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | (receive << 7)) & 0xff,
+                              functionid & 0xff,
+                              ((send[1] << 8) | send[0]) & 0xffff,
+                              ((send[3] << 8) | send[2]) & 0xffff,
+                              buffersize & 0xffff);
+    if (!receive)
+      memcpy(data + LIBUSB_CONTROL_SETUP_SIZE, buffer, buffersize);
+    libusb_fill_control_transfer(q->xfer, pdata->usbhandle, data,
+                                 usbasp_queue_cb, q, 5000);
+    q->xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    q->dest = (receive && expect >= 0)? buffer: NULL;
+    q->expect = expect;
+    q->done = 0;
+
+    if ((rc = libusb_submit_transfer(q->xfer)) < 0) {
+      avrdude_message(MSG_INFO, "%s: error: usbasp_queue: %s\n",
+                      progname, strerror(libusb_to_errno(rc)));
+      libusb_free_transfer(q->xfer);
+      q->xfer = NULL;
+      usbasp_queue_finish(pgm);
+      return -1;
+    }
+    pdata->queue_count++;
+    return 0;
+  }
+#endif
+
+  n = usbasp_transmit(pgm, receive, functionid, send, buffer, buffersize);
+  if (expect >= 0 && n != expect) {
+    avrdude_message(MSG_INFO, "%s: error: wrong transfer size %x\n",
+                    progname, n);
+    return -1;
+  }
+  return 0;
+}
+
 /*
  * Try to open USB device with given VID, PID, vendor and product name
  * Parts of this function were taken from an example code by OBJECTIVE
@@ -592,10 +762,16 @@ static int usbasp_initialize(PROGRAMMER * pgm, AVRPART * p)
 
   /* get capabilities */
   memset(temp, 0, sizeof(temp));
-  if(usbasp_transmit(pgm, 1, USBASP_FUNC_GETCAPABILITIES, temp, res, sizeof(res)) == 4)
+  if(usbasp_transmit(pgm, 1, USBASP_FUNC_GETCAPABILITIES, temp, res, sizeof(res)) == 4) {
     pdata->capabilities = res[0] | ((unsigned int)res[1] << 8) | ((unsigned int)res[2] << 16) | ((unsigned int)res[3] << 24);
-  else
+    /* firmware this recent copes with back to back block transfers */
+#ifdef USE_LIBUSB_1_0
+    pdata->queue_depth = USBASP_QUEUE_DEPTH;
+#endif
+  } else {
     pdata->capabilities = 0;
+    pdata->queue_depth = 0;
+  }
 
   pdata->use_tpi = ((pdata->capabilities & USBASP_CAP_TPI) != 0 && (p->flags & AVRPART_HAS_TPI) != 0) ? 1 : 0;
   // query support for 3 MHz SCK in UsbAsp-flash firmware
@@ -729,7 +905,6 @@ static int usbasp_spi_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                  unsigned int page_size,
                                  unsigned int address, unsigned int n_bytes)
 {
-  int n;
   unsigned char cmd[4];
   int wbytes = n_bytes;
   int blocksize;
@@ -767,7 +942,8 @@ static int usbasp_spi_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     cmd[1] = address >> 8;
     cmd[2] = address >> 16;
     cmd[3] = address >> 24;
-    usbasp_transmit(pgm, 1, USBASP_FUNC_SETLONGADDRESS, cmd, temp, sizeof(temp));
+    if (usbasp_queue(pgm, 1, USBASP_FUNC_SETLONGADDRESS, cmd, temp, sizeof(temp), -1) < 0)
+      return -3;
 
     /* send command with address (compatibility mode) - if firmware on
 	  usbasp doesn't support newmode, then they use address from this */
@@ -777,18 +953,16 @@ static int usbasp_spi_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     cmd[2] = 0;
     cmd[3] = 0;
 
-    n = usbasp_transmit(pgm, 1, function, cmd, buffer, blocksize);
-
-    if (n != blocksize) {
-      avrdude_message(MSG_INFO, "%s: error: wrong reading bytes %x\n",
-	      progname, n);
+    if (usbasp_queue(pgm, 1, function, cmd, buffer, blocksize, blocksize) < 0)
       return -3;
-    }
 
     buffer += blocksize;
     address += blocksize;
   }
 
+  if (usbasp_queue_finish(pgm) < 0)
+    return -3;
+
   return n_bytes;
 }
 
@@ -796,7 +970,6 @@ static int usbasp_spi_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                   unsigned int page_size,
                                   unsigned int address, unsigned int n_bytes)
 {
-  int n;
   unsigned char cmd[4];
   int wbytes = n_bytes;
   int blocksize;
@@ -838,7 +1011,8 @@ static int usbasp_spi_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     cmd[1] = address >> 8;
     cmd[2] = address >> 16;
     cmd[3] = address >> 24;
-    usbasp_transmit(pgm, 1, USBASP_FUNC_SETLONGADDRESS, cmd, temp, sizeof(temp));
+    if (usbasp_queue(pgm, 1, USBASP_FUNC_SETLONGADDRESS, cmd, temp, sizeof(temp), -1) < 0)
+      return -3;
 
     /* normal command - firmware what support newmode - use address from previous command,
       firmware what doesn't support newmode - ignore previous command and use address from this command */
@@ -849,19 +1023,17 @@ static int usbasp_spi_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     cmd[3] = (blockflags & 0x0F) + ((page_size & 0xF00) >> 4); //TP: Mega128 fix
     blockflags = 0;
 
-    n = usbasp_transmit(pgm, 0, function, cmd, buffer, blocksize);
-
-    if (n != blocksize) {
-      avrdude_message(MSG_INFO, "%s: error: wrong count at writing %x\n",
-	      progname, n);
-      return -3;        
-    }
+    if (usbasp_queue(pgm, 0, function, cmd, buffer, blocksize, blocksize) < 0)
+      return -3;
 
 
     buffer += blocksize;
     address += blocksize;
   }
 
+  if (usbasp_queue_finish(pgm) < 0)
+    return -3;
+
   return n_bytes;
 }
 
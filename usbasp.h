@@ -52,6 +52,9 @@
 #define USBASP_READBLOCKSIZE   200
 #define USBASP_WRITEBLOCKSIZE  200
 
+/* Number of block transfers kept in flight by paged load/write */
+#define USBASP_QUEUE_DEPTH     8
+
 /* ISP SCK speed identifiers */
 #define USBASP_ISP_SCK_AUTO   0
 #define USBASP_ISP_SCK_0_5    1   /* 500 Hz */